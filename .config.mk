@@ -0,0 +1,67 @@
+PATH = /usr/bin:/bin
+PREFIX = /tmp/satinst
+SYSCONFDIR = /tmp/satinst/etc
+COMDIR = /tmp/satinst/com/lib
+VARDIR = /tmp/satinst/var
+RUNDIR = /tmp/satinst/var/run
+TMPDIR = /tmp/satinst/tmp
+DEVDIR = /dev
+SYSDIR = /sys
+PROCDIR = /proc
+EXEC_PREFIX = /tmp/satinst
+BINDIR = /tmp/satinst/bin
+SBINDIR = /tmp/satinst/sbin
+LIBEXECDIR = /tmp/satinst/libexec
+LIBDIR = /tmp/satinst/lib
+INCLUDEDIR = /tmp/satinst/include
+OLDINCLUDEDIR = /tmp/satinst/include
+DATADIR = /tmp/satinst/share
+RESDIR = /tmp/satinst/share
+SYSDEPDATADIR = /tmp/satinst/lib
+SYSDEPRESDIR = /tmp/satinst/lib
+LISPDIR = /tmp/satinst/share/emacs/site-lisp
+LOCALEDIR = /tmp/satinst/share/locale
+LICENSEDIR = /tmp/satinst/share/licenses
+CACHEDIR = /tmp/satinst/var/cache
+SPOOLDIR = /tmp/satinst/var/spool
+EMPTYDIR = /tmp/satinst/var/empty
+LOGDIR = /tmp/satinst/var/log
+STATEDIR = /tmp/satinst/var/lib
+GAMEDIR = /tmp/satinst/var/games
+COMCACHEDIR = /tmp/satinst/com/cache
+COMPOOLDIR = /tmp/satinst/com/spool
+COMLOGDIR = /tmp/satinst/com/log
+COMSTATEDIR = /tmp/satinst/com/lib
+COMGAMEDIR = /tmp/satinst/com/lib/games
+LOCALTMPDIR = /tmp/satinst/var/tmp
+SHAREDTMPDIR = /tmp/satinst/com/lib/tmp
+LOCKDIR = /tmp/satinst/var/run/lock
+SKELDIR = /tmp/satinst/etc/skel
+SELFPROCDIR = /proc/self
+DOCDIR = /tmp/satinst/share/doc/sat
+INFODIR = /tmp/satinst/share/info
+DVIDIR = /tmp/satinst/share/doc/sat
+PDFDIR = /tmp/satinst/share/doc/sat
+PSDIR = /tmp/satinst/share/doc/sat
+HTMLDIR = /tmp/satinst/share/doc/sat
+MANDIR = /tmp/satinst/share/man
+MAN0 = man0
+MAN1 = man1
+MAN2 = man2
+MAN3 = man3
+MAN4 = man4
+MAN5 = man5
+MAN6 = man6
+MAN7 = man7
+MAN8 = man8
+MAN9 = man9
+MAN0EXT = .0
+MAN1EXT = .1
+MAN2EXT = .2
+MAN3EXT = .3
+MAN4EXT = .4
+MAN5EXT = .5
+MAN6EXT = .6
+MAN7EXT = .7
+MAN8EXT = .8
+MAN9EXT = .9
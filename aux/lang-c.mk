@@ -0,0 +1,8 @@
+
+bin/sat: aux/sat.o aux/common.o aux/metrics.o aux/parse_time.o aux/virtual_clock.o
+bin/satq: aux/satq.o aux/common.o aux/metrics.o aux/virtual_clock.o
+bin/satrm: aux/satrm.o aux/common.o aux/metrics.o aux/virtual_clock.o
+bin/satr: aux/satr.o aux/common.o aux/metrics.o aux/virtual_clock.o
+bin/satd: aux/satd.o aux/common.o aux/metrics.o aux/daemonise.o aux/virtual_clock.o
+bin/satd-diminished: aux/satd-diminished.o aux/common.o aux/metrics.o aux/virtual_clock.o
+bin/satd-timer: aux/satd-timer.o aux/common.o aux/metrics.o aux/virtual_clock.o
@@ -20,10 +20,19 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include "common.h"
+#include "metrics.h"
 #include <ctype.h>
 #include <stdarg.h>
+#include <poll.h>
 #include <pwd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/ioprio.h>
+#include <linux/sched.h>
 
 
 
@@ -32,6 +41,18 @@
  */
 extern char **environ;
 
+/**
+ * How long time, in nanoseconds, to spin before a job
+ * expires, 0 unless in low-latency mode, see `low_latency`.
+ */
+static long int spin = 0;
+
+/**
+ * Whether the process holds one of the queue's slots,
+ * see `hold_slot`.
+ */
+static int slotted = 0;
+
 
 
 /**
@@ -65,268 +86,2140 @@ fail:  \
 
 
 /**
- * Wrapper for `pread` that reads the required amount of data.
+ * Wrapper for `pread` that reads the required amount of data.
+ * 
+ * @param   fildes  See pread(3).
+ * @param   buf     See pread(3).
+ * @param   nbyte   See pread(3).
+ * @param   offset  See pread(3).
+ * @return          See pread(3), only short if the file is shorter.
+ */
+ssize_t
+preadn(int fildes, void *buf, size_t nbyte, size_t offset)
+{
+	char *buffer = buf;
+	PIO(pread);
+}
+
+
+/**
+ * Wrapper for `pwrite` that writes all specified data.
+ * 
+ * @param   fildes  See pwrite(3).
+ * @param   buf     See pwrite(3).
+ * @param   nbyte   See pwrite(3).
+ * @param   offset  See pwrite(3).
+ * @return          See pwrite(3).
+ */
+ssize_t
+pwriten(int fildes, const void *buf, size_t nbyte, size_t offset)
+{
+	const char *buffer = buf;
+	PIO(pwrite);
+}
+
+
+/**
+ * Unmarshal a job's command line and environment.
+ * 
+ * The elements are not actually copied, subpointers to
+ * `full->payload` are stored in the returned list. Both
+ * lists are stored in the same allocation, so only the
+ * returned list shall be freed.
+ * 
+ * @param   full   The job, with its payload.
+ * @param   skip   The number of unset elements to reserve
+ *                 before the command line.
+ * @param   extra  The number of elements to reserve after
+ *                 the environment's `NULL`-terminator.
+ * @param   envp   Output parameter for the environment, whose
+ *                 first element is the working directory.
+ * @return         The command line, preceded by `skip` unset
+ *                 elements, `NULL` on error.
+ * 
+ * @throws  EINVAL  The payload does not end with a NUL byte,
+ *                  or it does not contain the working directory.
+ * @throws  Any exception specified for malloc(3).
+ */
+char **
+restore_job(struct job_full *full, size_t skip, size_t extra, char ***envp)
+{
+	char *p = full->payload, *end = full->payload + full->job.n;
+	char **rc = NULL;
+	size_t n = 0, i = skip, e = 0;
+
+	/* memchr(3) is vectorised by the C library, so it is used to find the NUL bytes. */
+	while (p < end) {
+		t (errno = EINVAL, !(p = memchr(p, '\0', (size_t)(end - p))));
+		p++, n++;
+	}
+	t (errno = EINVAL, n <= (size_t)(full->job.argc));
+	t (!(rc = malloc((skip + n + 2 + extra) * sizeof(char*))));
+	for (p = full->payload; e < n; p = (char *)memchr(p, '\0', (size_t)(end - p)) + 1, e++) {
+		if (e == (size_t)(full->job.argc))
+			rc[i++] = NULL;
+		rc[i++] = p;
+	}
+	rc[i] = NULL;
+	*envp = rc + skip + full->job.argc + 1;
+fail:
+	return rc;
+}
+
+
+/**
+ * Create a new open file descriptor for an already
+ * existing file descriptor.
+ * 
+ * @param   fd     The file descriptor that shall be promoted
+ *                 to a new open file descriptor.
+ * @param   oflag  See open(3), `O_CREAT` is not allowed.
+ * @return         0 on success, -1 on error.
+ */
+int
+reopen(int fd, int oflag)
+{
+	char path[sizeof("/dev/fd/") + 3 * sizeof(int)];
+	int r, saved_errno;
+
+	sprintf(path, "/dev/fd/%i", fd);
+	if (r = open(path, oflag), r < 0)
+		return -1;
+	if (DUP2_AND_CLOSE(r, fd) == -1)
+		return S(close(r)), -1;
+	return 0;
+}
+
+
+/**
+ * Get the name of the selected queue.
+ * 
+ * @return  The name of the queue, `NULL` for the default
+ *          queue, or, with `errno` set to `EINVAL`, if
+ *          SAT_QUEUE is not a valid queue name.
+ */
+static const char *
+get_queue(void)
+{
+	const char *queue = getenv("SAT_QUEUE");
+	if (!queue || !*queue || !strcmp(queue, "default"))
+		return errno = 0, NULL;
+	if (strchr(queue, '/') || !strcmp(queue, ".") || !strcmp(queue, ".."))
+		return errno = EINVAL, NULL;
+	return queue;
+}
+
+
+/**
+ * Select the queue, by setting SAT_QUEUE, so that it is
+ * inherited by satd(1) if it is started.
+ * 
+ * @param   name  The name of the queue, "default" for
+ *                the queue that is used if none is selected.
+ * @return        0 on success, -1 on error.
+ * 
+ * @throws  EINVAL  `name` is not a valid queue name.
+ * @throws          Any exception specified for setenv(3).
+ */
+int
+set_queue(const char *name)
+{
+	if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+		return errno = EINVAL, -1;
+	return setenv("SAT_QUEUE", name, 1);
+}
+
+
+/**
+ * Get the pathname of a file in the runtime directory.
+ * 
+ * Each queue, except the default queue, has a runtime
+ * directory of its own, “queues/$SAT_QUEUE” in the
+ * default queue's runtime directory.
+ * 
+ * @param   name  The basename of the file.
+ * @return        The pathname, `NULL` on error.
+ * 
+ * @throws  EINVAL  SAT_QUEUE is not a valid queue name.
+ * @throws          Any exception specified for malloc(3).
+ */
+char *
+runtime_path(const char *name)
+{
+	const char *dir, *queue;
+	char *path = NULL;
+	size_t n;
+
+	t (queue = get_queue(), !queue && errno);
+	dir = getenv("XDG_RUNTIME_DIR"), dir = (dir ? dir : "/run");
+	n = strlen(dir) + strlen(name) + (queue ? strlen(queue) + sizeof("queues//") : 0);
+	t (!(path = malloc(n * sizeof(char) + sizeof("/" PACKAGE "/"))));
+	if (queue)
+		sprintf(path, "%s/" PACKAGE "/queues/%s/%s", dir, queue, name);
+	else
+		stpcpy(stpcpy(stpcpy(path, dir), "/" PACKAGE "/"), name);
+fail:
+	return path;
+}
+
+
+/**
+ * Parse a launch-rate limit, the number of jobs
+ * that may be started per second, optionally followed
+ * by "/" and the number that may be started at once.
+ * 
+ * @param   str   The limit.
+ * @param   rate  Output parameter for the limit.
+ * @return        0 on success, -1 if `str` is invalid.
+ * 
+ * @throws  EINVAL  `str` is invalid.
+ */
+static int
+parse_rate(const char *str, struct launch_rate *rate)
+{
+	char *end;
+
+	if (!isdigit(*str))
+		return -1;
+	rate->rate = (errno = 0, strtod)(str, &end);
+	rate->burst = 1;
+	if ((*end == '/') && isdigit(end[1]))
+		rate->burst = strtod(end + 1, &end);
+	return (errno || *end || !(rate->rate > 0) || !(rate->burst >= 1)) ? (errno = EINVAL, -1) : 0;
+}
+
+
+/**
+ * Read the selected queue's settings from the file
+ * named by SAT_QUEUES_PATH, if it exists.
+ * 
+ * @param   limit     Output parameter for the maximum number of
+ *                    concurrently running jobs, 1 if not specified.
+ * @param   priority  Output parameter for the niceness, 0 if not
+ *                    specified.
+ * @param   timeout   Output parameter for the timeout, zero if not
+ *                    specified, and the grace period, `TIMEOUT_GRACE`
+ *                    seconds if not specified. May be `NULL`.
+ * @param   rate      Output parameter for the queue's launch-rate
+ *                    limit, and the limit for all queues, unlimited
+ *                    if not specified, the burst is 1 if not specified.
+ *                    May be `NULL`.
+ * @return            0 on success, -1 on error, in which case
+ *                    the defaults are stored.
+ * 
+ * @throws  EINVAL  The queue's entry is malformated.
+ * @throws          Any exception specified for fopen(3) and getline(3).
+ */
+int
+get_queue_settings(size_t *limit, int *priority, struct timespec timeout[2], struct launch_rate rate[2])
+{
+#define BLANK  " \t\n"
+#define DEFAULTS  \
+	(*limit = 1, *priority = 0, timeout ? (memset(timeout, 0, 2 * sizeof(*timeout)),  \
+	                                       timeout[1].tv_sec = TIMEOUT_GRACE) : 0,   \
+	 rate ? (rate[0].rate = rate[1].rate = 0, rate[0].burst = rate[1].burst = 1) : 0)
+	const char *path, *queue;
+	char *line = NULL, *word, *end;
+	size_t size = 0;
+	long int value, grace;
+	struct launch_rate dummy;
+	FILE *f = NULL;
+	int saved_errno, found = 0;
+
+	DEFAULTS;
+	t (queue = get_queue(), !queue && errno);
+	queue = queue ? queue : "default";
+	if (!(path = getenv("SAT_QUEUES_PATH")))
+		return 0;
+	if (!(f = fopen(path, "r")))
+		return errno == ENOENT ? 0 : -1;
+
+	while (errno = 0, getline(&line, &size, f) > 0) {
+		line[strcspn(line, "#")] = '\0';
+		if (!(word = strtok(line, BLANK)))
+			continue;
+		if (!strcmp(word, "*")) {
+			word = strtok(NULL, BLANK);
+			t (errno = EINVAL, !word || parse_rate(word, rate ? rate + 1 : &dummy) || strtok(NULL, BLANK));
+			continue;
+		}
+		if (found || strcmp(word, queue))
+			continue;
+		found = 1;
+		word = strtok(NULL, BLANK);
+		t (errno = EINVAL, !word);
+		value = (errno = 0, strtol)(word, &end, 10);
+		t (errno = EINVAL, *end || !isdigit(*word) || (value < 1));
+		*limit = (size_t)value;
+		if ((word = strtok(NULL, BLANK))) {
+			value = (errno = 0, strtol)(word, &end, 10);
+			if (*word == '-' || *word == '+')
+				word++;
+			t (errno = EINVAL, *end || !isdigit(*word) || (value < -20) || (value > 19));
+			*priority = (int)value;
+		}
+		if (word && (word = strtok(NULL, BLANK))) {
+			value = (errno = 0, strtol)(word, &end, 10), grace = TIMEOUT_GRACE;
+			if ((*end == '/') && isdigit(end[1]))
+				grace = strtol(end + 1, &end, 10);
+			t (errno = EINVAL, *end || !isdigit(*word) || (value < 0));
+			if (timeout)
+				timeout[0].tv_sec = (time_t)value, timeout[1].tv_sec = (time_t)grace;
+		}
+		if (word && (word = strtok(NULL, BLANK)))
+			t (errno = EINVAL, parse_rate(word, rate ? rate : &dummy));
+		t (errno = EINVAL, word && strtok(NULL, BLANK));
+	}
+	t (errno);
+
+	free(line);
+	fclose(f);
+	return 0;
+fail:
+	DEFAULTS;
+	S(free(line), f ? fclose(f) : 0);
+	return -1;
+#undef BLANK
+#undef DEFAULTS
+}
+
+
+/**
+ * Get the pathname of a job's script.
+ * 
+ * @param   no  The job number.
+ * @return      The pathname, `NULL` on error.
+ * 
+ * @throws  Any exception specified for malloc(3).
+ */
+char *
+script_path(size_t no)
+{
+	char name[sizeof("scripts/") + 3 * sizeof(size_t)];
+	sprintf(name, "scripts/%zu", no);
+	return runtime_path(name);
+}
+
+
+/**
+ * Add an entry to the event log.
+ * 
+ * The caller should be holding the state file's lock
+ * so that events are logged in the correct order.
+ * 
+ * The log is opened on the first call, and is kept
+ * open, it is never removed.
+ * 
+ * @param   no      The job number.
+ * @param   action  The action, see `struct event`.
+ * @return          0 on success, -1 on error.
+ */
+int
+log_event(size_t no, const char *action)
+{
+	static int fd = -1;
+	char *path;
+	struct event_log log;
+	struct event event;
+	ssize_t r;
+	int saved_errno;
+
+	memset(&event, 0, sizeof(event));
+	event.no = no;
+	strncpy(event.action, action, sizeof(event.action) - 1);
+	t (clock_gettime(CLOCK_REALTIME, &(event.when)));
+
+	if (fd < 0) {
+		t (!(path = runtime_path("events")));
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		S(free(path));
+		t (fd == -1);
+	}
+
+	/* The log has its own lock because it is shared by all writers. */
+	t (flock(fd, LOCK_EX));
+	t (r = preadn(fd, &log, sizeof(log), (size_t)0), r < 0);
+	event.seq = r < (ssize_t)sizeof(log) ? 0 : log.seq;
+	log.seq = event.seq + 1;
+	t (pwriten(fd, &event, sizeof(event), EVENT_OFFSET(event.seq)) < (ssize_t)sizeof(event));
+	t (pwriten(fd, &log, sizeof(log), (size_t)0) < (ssize_t)sizeof(log));
+	flock(fd, LOCK_UN); /* Failure isn't fatal. */
+
+	return 0;
+fail:
+	if (fd >= 0)
+		S(flock(fd, LOCK_UN));
+	return -1;
+}
+
+
+/**
+ * Add an entry to the workload trace, if tracing is enabled.
+ * 
+ * The caller should be holding the state file's lock
+ * so that operations are traced in the correct order.
+ * 
+ * @param   op   The operation, see `struct trace`.
+ * @param   job  The job, `NULL` for listings.
+ * @param   n    The number of listed jobs, ignored unless `job` is `NULL`.
+ * @return       0 on success, -1 on error.
+ */
+int
+log_trace(char op, const struct job *job, size_t n)
+{
+	char *path = NULL;
+	struct trace entry;
+	struct timespec now;
+	int fd = -1, saved_errno;
+
+	/* Tracing is enabled by creating the file, so it is never created here. */
+	t (!(path = runtime_path("trace")));
+	fd = open(path, O_WRONLY | O_APPEND);
+	free(path), path = NULL;
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.op  = op;
+	entry.clk = job ? job->clk : CLOCK_REALTIME;
+	entry.no  = job ? job->no : 0;
+	entry.n   = job ? job->n : n;
+	t (clock_gettime(CLOCK_REALTIME, &(entry.when)));
+	if (job) {
+		t (clock_gettime(job->clk, &now));
+		entry.left.tv_sec  = job->ts.tv_sec  - now.tv_sec;
+		entry.left.tv_nsec = job->ts.tv_nsec - now.tv_nsec;
+		if (entry.left.tv_nsec < 0)
+			entry.left.tv_sec -= 1, entry.left.tv_nsec += 1000000000L;
+	}
+
+	/* Appends this small are atomic, so no lock is needed. */
+	t (write(fd, &entry, sizeof(entry)) < (ssize_t)sizeof(entry));
+
+	close(fd);
+	return 0;
+fail:
+	S(free(path), close(fd));
+	return -1;
+}
+
+
+/**
+ * Add an entry to the history journal.
+ * 
+ * The caller must be holding the state file's
+ * exclusive lock, as the journal may be rotated.
+ * 
+ * @param   full  The job, with its payload.
+ * @param   run   Information about the job's run.
+ * @return        0 on success, -1 on error.
+ */
+int
+log_history(const struct job_full *full, const struct run *run)
+{
+	const struct job *job = &(full->job);
+	char *path = NULL;
+	char *old = NULL;
+	struct history entry;
+	struct stat attr;
+	int fd = -1, saved_errno;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.no        = job->no;
+	entry.clk       = job->clk;
+	entry.status    = run->status;
+	entry.scheduled = job->ts;
+	entry.spawned   = run->spawned;
+	entry.exited    = run->exited;
+	entry.utime     = run->usage.ru_utime;
+	entry.stime     = run->usage.ru_stime;
+	entry.maxrss    = run->usage.ru_maxrss;
+	strncpy(entry.argv0, full->payload, sizeof(entry.argv0) - 1);
+
+	t (!(path = runtime_path("history")));
+	t (fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR), fd == -1);
+	t (fstat(fd, &attr));
+	if ((size_t)(attr.st_size) + sizeof(entry) > HISTORY_SEGMENT_SIZE) {
+		/* Rotate: the current segment replaces the previous. */
+		t (!(old = runtime_path("history.old")));
+		t (rename(path, old));
+		close(fd);
+		t (fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR), fd == -1);
+	}
+	t (write(fd, &entry, sizeof(entry)) < (ssize_t)sizeof(entry));
+
+	close(fd);
+	free(path), free(old);
+	return 0;
+fail:
+	S(close(fd), free(path), free(old));
+	return -1;
+}
+
+
+/**
+ * The number of environment variables `run_environment` adds.
+ */
+#define RUN_ENVIRONMENT  14
+
+/**
+ * Format the environment variables that describe a run of a job.
+ * 
+ * @param  buf  Output buffer for the environment variables.
+ * @param  env  Output parameter for pointers to the elements of `buf`.
+ * @param  job  The job.
+ * @param  run  Information about the run.
+ */
+static void
+run_environment(char buf[RUN_ENVIRONMENT][64], char **env, const struct job *job, const struct run *run)
+{
+#define TIME(NAME, TS)  sprintf(*env++ = *buf++, "SAT_" NAME "=%lli.%09li", (long long int)((TS).tv_sec), (TS).tv_nsec)
+#define RTIME(NAME, TV)  sprintf(*env++ = *buf++, "SAT_" NAME "=%lli.%06li", (long long int)((TV).tv_sec), (long int)((TV).tv_usec))
+
+	sprintf(*env++ = *buf++, "SAT_JOB=%zu", job->no);
+	sprintf(*env++ = *buf++, "SAT_CLOCK=%s", job->clk == CLOCK_BOOTTIME ? "boottime" : "walltime");
+	TIME("QUEUED", job->queued);
+	TIME("SCHEDULED", job->ts);
+	TIME("FIRED", run->fired);
+	TIME("SPAWNED", run->spawned);
+	TIME("EXITED", run->exited);
+	if (WIFEXITED(run->status))
+		sprintf(*env++ = *buf++, "SAT_STATUS=%i", WEXITSTATUS(run->status));
+	else
+		sprintf(*env++ = *buf++, "SAT_SIGNAL=%i", WTERMSIG(run->status));
+	RTIME("UTIME", run->usage.ru_utime);
+	RTIME("STIME", run->usage.ru_stime);
+	sprintf(*env++ = *buf++, "SAT_MAXRSS=%li", run->usage.ru_maxrss);
+	sprintf(*env++ = *buf++, "SAT_CPU_USAGE=%llu.%06llu",
+	        (unsigned long long int)(run->cpu_usage / 1000000), (unsigned long long int)(run->cpu_usage % 1000000));
+	sprintf(*env++ = *buf++, "SAT_MEMORY_PEAK=%llu", (unsigned long long int)(run->memory_peak));
+	sprintf(*env++ = *buf++, "SAT_ATTEMPT=%u", job->attempt + 1);
+}
+
+
+/**
+ * Write a value to a control file in a cgroup.
+ * 
+ * @param   cgroup  File descriptor for the cgroup.
+ * @param   file    The name of the control file.
+ * @param   value   The value.
+ * @return          0 on success, -1 on error.
+ */
+static int
+write_control(int cgroup, const char *file, const char *value)
+{
+	ssize_t r;
+	int fd, saved_errno;
+	if (fd = openat(cgroup, file, O_WRONLY | O_CLOEXEC), fd == -1)
+		return -1;
+	r = write(fd, value, strlen(value));
+	return S(close(fd)), -(r < 0);
+}
+
+
+/**
+ * Create a cgroup, with a job's limits, for the job to run in.
+ * 
+ * The cgroup is created in the cgroup named by SAT_CGROUP
+ * in the job's environment, which must be delegated to us
+ * and not have any processes, and is named after the
+ * queue and the job, “QUEUE.JOB-ID”.
+ * 
+ * @param   job     The job.
+ * @param   envp    The job's environment.
+ * @param   name    Output parameter for the cgroup's name.
+ * @param   parent  Output parameter for a file descriptor for
+ *                  the cgroup that the cgroup was created in.
+ * @return          A file descriptor for the cgroup, -1 on error.
+ */
+static int
+create_cgroup(const struct job *job, char **envp, char **name, int *parent)
+{
+#define ENABLE(CONTROLLER)  t (write_control(*parent, "cgroup.subtree_control", "+" CONTROLLER))
+
+	char value[sizeof("default ") + 2 * 3 * sizeof(uint64_t)];
+	const char *queue, *path = NULL;
+	int fd = -1, saved_errno;
+
+	*name = NULL, *parent = -1;
+	for (; *envp; envp++)
+		if (!strncmp(*envp, "SAT_CGROUP=", sizeof("SAT_CGROUP=") - 1))
+			path = *envp + sizeof("SAT_CGROUP=") - 1;
+	t (errno = ENOENT, !path || !*path);
+	t (queue = get_queue(), !queue && errno);
+	queue = queue ? queue : "default";
+	t (!(*name = malloc(strlen(queue) + 3 * sizeof(size_t) + 2)));
+	sprintf(*name, "%s.%zu", queue, job->no);
+
+	t (*parent = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC), *parent == -1);
+	if (job->cpu_weight || job->cpu_max[0])  ENABLE("cpu");
+	if (job->memory_max)                     ENABLE("memory");
+	if (job->io_weight)                      ENABLE("io");
+	/* A recurring job's cgroup is reused if it could not be removed. */
+	t (mkdirat(*parent, *name, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) && (errno != EEXIST));
+	t (fd = openat(*parent, *name, O_RDONLY | O_DIRECTORY | O_CLOEXEC), fd == -1);
+
+	if (job->cpu_weight) {
+		sprintf(value, "%u", job->cpu_weight);
+		t (write_control(fd, "cpu.weight", value));
+	}
+	if (job->cpu_max[0]) {
+		sprintf(value, "%lu %lu", job->cpu_max[0], job->cpu_max[1]);
+		t (write_control(fd, "cpu.max", value));
+	}
+	if (job->memory_max) {
+		sprintf(value, "%llu", (unsigned long long int)(job->memory_max));
+		t (write_control(fd, "memory.max", value));
+	}
+	if (job->io_weight) {
+		sprintf(value, "default %u", job->io_weight);
+		t (write_control(fd, "io.weight", value));
+	}
+	return fd;
+
+fail:
+	saved_errno = errno;
+	if (fd >= 0)
+		close(fd), unlinkat(*parent, *name, AT_REMOVEDIR);
+	if (*parent >= 0)
+		close(*parent), *parent = -1;
+	free(*name), *name = NULL;
+	errno = saved_errno;
+	return -1;
+#undef ENABLE
+}
+
+
+/**
+ * Read how much CPU time and memory the processes
+ * in a cgroup have used. Values that cannot be
+ * read are left unmodified, and so is `errno`.
+ * 
+ * @param  cgroup  File descriptor for the cgroup.
+ * @param  run     The run, `cpu_usage` and `memory_peak` will be set.
+ */
+static void
+read_cgroup_usage(int cgroup, struct run *run)
+{
+	char buf[1024], *p;
+	ssize_t r;
+	int fd, saved_errno = errno;
+
+	if (fd = openat(cgroup, "cpu.stat", O_RDONLY | O_CLOEXEC), fd >= 0) {
+		r = read(fd, buf, sizeof(buf) - 1);
+		buf[r < 0 ? 0 : r] = '\0';
+		if ((p = strstr(buf, "usage_usec ")))
+			run->cpu_usage = (uint64_t)strtoull(p + sizeof("usage_usec ") - 1, NULL, 10);
+		close(fd);
+	}
+	/* memory.peak is only available if the memory controller is enabled. */
+	if (fd = openat(cgroup, "memory.peak", O_RDONLY | O_CLOEXEC), fd >= 0) {
+		if (r = read(fd, buf, sizeof(buf) - 1), r > 0)
+			buf[r] = '\0', run->memory_peak = (uint64_t)strtoull(buf, NULL, 10);
+		close(fd);
+	}
+	errno = saved_errno;
+}
+
+
+/**
+ * Wait until a job's process exits, or until it times
+ * out, in which case it is sent SIGTERM, and, if it has
+ * not exited after the grace period, SIGKILL. The process
+ * is not reaped. If the timeout cannot be enforced, this
+ * function returns immediately, and the job is simply
+ * waited for. `errno` is left unmodified.
+ * 
+ * @param  pid        The job's process.
+ * @param  cgroup     File descriptor for the job's cgroup, -1 if
+ *                    none. If the job is killed, so is everything
+ *                    else in its cgroup.
+ * @param  timeout    The timeout, measured from when the job was
+ *                    executed, followed by the grace period.
+ * @param  timed_out  Output parameter for whether the job
+ *                    timed out, see `struct run.timed_out`.
+ */
+static void
+enforce_timeout(pid_t pid, int cgroup, const struct timespec timeout[2], char *timed_out)
+{
+	struct itimerspec spec;
+	struct pollfd fds[2];
+	uint64_t expirations;
+	int saved_errno = errno;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value = timeout[0];
+	fds[0].events = fds[1].events = POLLIN;
+	fds[1].fd = -1;
+	/* The pidfd becomes readable when the process exits. */
+	t (fds[0].fd = (int)syscall(SYS_pidfd_open, pid, 0), fds[0].fd < 0);
+	t (fds[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC), fds[1].fd < 0);
+	t (timerfd_settime(fds[1].fd, 0, &spec, NULL));
+
+	for (;;) {
+		if (poll(fds, (nfds_t)2, -1) < 0) {
+			t (errno != EINTR);
+		} else if (fds[0].revents) {
+			break;
+		} else if (read(fds[1].fd, &expirations, sizeof(expirations)) < 0) {
+			t (errno != EINTR && errno != EAGAIN);
+		} else if (!*timed_out) {
+			*timed_out = 't';
+			metrics_count(METRIC(terminated), 1, 0);
+			t (syscall(SYS_pidfd_send_signal, fds[0].fd, SIGTERM, NULL, 0));
+			spec.it_value = timeout[1];
+			if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+				spec.it_value.tv_nsec = 1; /* A zero value would disarm the timer. */
+			t (timerfd_settime(fds[1].fd, 0, &spec, NULL));
+		} else {
+			*timed_out = 'k';
+			metrics_count(METRIC(killed), 1, 0);
+			if (cgroup >= 0)
+				write_control(cgroup, "cgroup.kill", "1");
+			syscall(SYS_pidfd_send_signal, fds[0].fd, SIGKILL, NULL, 0);
+			break;
+		}
+	}
+fail:
+	if (fds[0].fd >= 0)  close(fds[0].fd);
+	if (fds[1].fd >= 0)  close(fds[1].fd);
+	errno = saved_errno;
+}
+
+
+/**
+ * Apply a job's CPU affinity, niceness, I/O priority,
+ * and scheduling policy to the calling process.
+ * 
+ * This is done in the job's process before it is
+ * executed, and by sat(1), in a child process, to
+ * check that the job can be run as requested.
+ * 
+ * @param   job  The job.
+ * @return       0 on success, -1 on error.
+ */
+int
+apply_attributes(const struct job *job)
+{
+	struct sched_param param;
+	int policy;
+
+	/* glibc's sched_setaffinity(3) requires _GNU_SOURCE, the mask has the kernel's format anyway. */
+	if (HAS_AFFINITY(job))
+		t (syscall(SYS_sched_setaffinity, 0, sizeof(job->cpus), job->cpus));
+	if (job->renice)
+		t (setpriority(PRIO_PROCESS, 0, job->nice));
+	if (job->ioprio)
+		t (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, job->ioprio));
+	if (job->policy) {
+		switch (job->policy) {
+		case 'b':  policy = SCHED_BATCH;  break;
+		case 'i':  policy = SCHED_IDLE;   break;
+		case 'f':  policy = SCHED_FIFO;   break;
+		case 'r':  policy = SCHED_RR;     break;
+		default:   policy = SCHED_OTHER;  break;
+		}
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = job->rtprio;
+		t (sched_setscheduler(0, policy, &param));
+	}
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Run a job or a hook.
+ * 
+ * If the job has any cgroup limits, it is spawned directly
+ * into a cgroup of its own, which is removed afterwards.
+ * If the job, or its queue, has a timeout, the job is
+ * terminated if it runs for too long.
+ * 
+ * @param   full  The job, with its payload.
+ * @param   hook  The hook, `NULL` to run the job.
+ * @param   run   If `hook` is `NULL`: output parameter for information
+ *                about the run, `fired` is not modified. Otherwise:
+ *                information about the run to pass to the hook, via
+ *                the environment. May be `NULL`.
+ * @return        0 on success, -1 on error, 1 if the child failed.
+ */
+int
+run_job_or_hook(struct job_full *full, const char *hook, struct run *run)
+{
+	struct job *job = &(full->job);
+	struct clone_args clone_args;
+	char *cgroup_name = NULL;
+	int cgroup = -1, parent = -1;
+	pid_t pid;
+	char **args = NULL;
+	char **argv = NULL;
+	char **envp = NULL;
+	char runenvbuf[RUN_ENVIRONMENT][64];
+	size_t envn;
+	struct timespec forked, started, now, timeout[2];
+	struct rusage usage;
+	size_t limit;
+	int status = 0, saved_errno, priority, fds[2] = {-1, -1}, fd, i;
+	char c, timed_out = 0;
+
+	if (hook)
+		log_event(job->no, hook); /* Failure isn't fatal. */
+
+	/* One allocation, with room for the hook's arguments and the run's environment. */
+	t (!(args = restore_job(full, 2, RUN_ENVIRONMENT, &envp)));
+	for (envn = 0; envp[envn]; envn++); /* Includes wdir. */
+
+	if (hook) {
+		argv = args;
+		argv[0] = getenv("SAT_HOOK_PATH");
+		argv[1] = (strstr)(hook, hook); /* strstr: just to remove a warning */
+		if (run) {
+			/* Put first so that they are not shadowed by the job's environment. */
+			memmove(envp + 1 + RUN_ENVIRONMENT, envp + 1, envn * sizeof(*envp));
+			run_environment(runenvbuf, envp + 1, job, run);
+		}
+	} else {
+		argv = args + 2;
+	}
+
+	if (!hook && HAS_CGROUP(job))
+		t (cgroup = create_cgroup(job, envp + 1, &cgroup_name, &parent), cgroup == -1);
+
+	/* The write-end is closed when the child exec:s, so that we can measure the time it takes.
+	 * The pipe is moved above the file descriptors that the child closes, since they are not
+	 * open in all processes, in which case the pipe could have been created on them. */
+	t (pipe(fds));
+	for (i = 0; i < 2; i++) {
+		t (fd = fcntl(fds[i], F_DUPFD_CLOEXEC, LOCK_FILENO + 1), fd == -1);
+		close(fds[i]), fds[i] = fd;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &forked);
+
+	if (cgroup >= 0) {
+		/* Like fork(3), but the child starts in the cgroup. */
+		memset(&clone_args, 0, sizeof(clone_args));
+		clone_args.flags = CLONE_INTO_CGROUP;
+		clone_args.exit_signal = SIGCHLD;
+		clone_args.cgroup = (uint64_t)cgroup;
+		pid = (pid_t)syscall(SYS_clone3, &clone_args, sizeof(clone_args));
+	} else {
+		pid = fork();
+	}
+	if (!pid) {
+		if (!hook && run && (run->script >= 0))
+			dup2(run->script, STDIN_FILENO);
+		close(STATE_FILENO), close(BOOT_FILENO), close(REAL_FILENO), close(fds[0]);
+		if (!hook && apply_attributes(job))
+			exit(1);
+		(void)(status = chdir(envp[0]));
+		environ = envp + 1;
+		execvp(*argv, argv);
+		exit(1);
+	}
+
+	t (pid < 0);
+	close(fds[1]), fds[1] = -1;
+	while ((read(fds[0], &c, (size_t)1) < 0) && (errno == EINTR));
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	metrics_record(METRIC(spawn), &forked, &started);
+	if (!hook && !clock_gettime(job->clk, &now)) {
+		metrics_record(METRIC(lateness), &(job->ts), &now);
+		if (run)  run->spawned = now;
+	}
+
+	if (!hook) {
+		timeout[0] = job->timeout, timeout[1] = job->grace;
+		if (!timeout[0].tv_sec && !timeout[0].tv_nsec)
+			S(get_queue_settings(&limit, &priority, timeout, NULL)); /* Failure isn't fatal. */
+		if (timeout[0].tv_sec || timeout[0].tv_nsec)
+			enforce_timeout(pid, cgroup, timeout, &timed_out);
+	}
+	t (wait4(pid, &status, 0, &usage) != pid);
+	metrics_record(hook ? METRIC(hook) : METRIC(runtime), hook ? &forked : &started, NULL);
+	if (!hook && run) {
+		clock_gettime(job->clk, &(run->exited));
+		run->status = status;
+		run->usage = usage;
+		run->timed_out = timed_out;
+		run->cpu_usage  = (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000;
+		run->cpu_usage += (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+		run->memory_peak = (uint64_t)(usage.ru_maxrss) * 1024;
+		if (cgroup >= 0)
+			read_cgroup_usage(cgroup, run);
+	}
+	errno = 0; /* Whatever failed above, without being fatal, is not an error. */
+fail:
+	S(free(args), close(fds[0]), close(fds[1]), close(cgroup));
+	if (parent >= 0)
+		S(unlinkat(parent, cgroup_name, AT_REMOVEDIR), close(parent)); /* Failure isn't fatal. */
+	free(cgroup_name);
+	return status ? 1 : -!!saved_errno;
+}
+
+
+/**
+ * Read the state file's header.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   header  Output parameter for the header. If the state file
+ *                  is new, it will be filled with zeroes, except for
+ *                  its magic and version.
+ * @return          1 if the file has a header, 0 if it is new, -1 on error.
+ * 
+ * @throws  EBADMSG  The file is not a state file, or it
+ *                   was written by an incompatible version.
+ * @throws  Any error specified for pread(3).
+ */
+int
+read_header(struct state_header *header)
+{
+	ssize_t r;
+	if (r = preadn(STATE_FILENO, header, sizeof(*header), (size_t)0), r < 0)
+		return -1;
+	if (r == (ssize_t)sizeof(*header)) {
+		if (memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) || (header->version != STATE_VERSION))
+			return errno = EBADMSG, -1;
+		return 1;
+	}
+	if (r)
+		return errno = EBADMSG, -1;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, STATE_MAGIC, sizeof(header->magic));
+	header->version = STATE_VERSION;
+	return 0;
+}
+
+
+/**
+ * Write the state file's header.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   header  The header.
+ * @return          0 on success, -1 on error.
+ */
+int
+write_header(const struct state_header *header)
+{
+	if (pwriten(STATE_FILENO, header, sizeof(*header), (size_t)0) < (ssize_t)sizeof(*header))
+		return -1;
+	metrics_count(METRIC(depth[0]), (uint64_t)(header->jobs[0]), 1);
+	metrics_count(METRIC(depth[1]), (uint64_t)(header->jobs[1]), 1);
+	return 0;
+}
+
+
+/**
+ * Lock the state file, and record how long we had to wait.
+ * 
+ * @param   operation  `LOCK_SH` or `LOCK_EX`.
+ * @return             0 on success, -1 on error.
+ */
+int
+lock_state(int operation)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (flock(STATE_FILENO, operation))
+		return -1;
+	metrics_record(METRIC(lock_wait), &start, NULL);
+	return 0;
+}
+
+
+/**
+ * Account for a job in the state file's header.
+ * 
+ * @param  header  The header.
+ * @param  job     The header of the job that has been queued.
+ */
+void
+header_add_job(struct state_header *header, const struct job_header *job)
+{
+	int c = CLOCK_INDEX(job->clk);
+	if (!header->jobs[c]++) {
+		header->earliest[c] = header->latest[c] = job->ts;
+	} else {
+		if (timecmp(&(job->ts), header->earliest + c) < 0)  header->earliest[c] = job->ts;
+		if (timecmp(&(job->ts), header->latest   + c) > 0)  header->latest[c]   = job->ts;
+	}
+	header->payload += job->size;
+}
+
+
+/**
+ * The number of jobs `read_jobs` is used to read at a time
+ * when the state file is scanned. The buffers for them are
+ * too large for the stack, so they are allocated.
+ */
+#define SCAN_CHUNK  (size_t)256
+
+
+/**
+ * Read jobs' headers from the state file.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   jobs   Output buffer for the jobs' headers.
+ * @param   first  The index of the first job to read.
+ * @param   max    The maximum number of jobs to read.
+ * @return         The number of read jobs, -1 on error.
+ */
+static ssize_t
+read_jobs(struct job_header *jobs, size_t first, size_t max)
+{
+	ssize_t r = preadn(STATE_FILENO, jobs, max * sizeof(*jobs), sizeof(struct state_header) + first * sizeof(*jobs));
+	return r < 0 ? -1 : r / (ssize_t)sizeof(*jobs);
+}
+
+
+/**
+ * Stop accounting for a job in the state file's header.
+ * 
+ * The job must already have been removed from the state
+ * file, it is scanned for new bounds if the job was
+ * the earliest or the latest job.
+ * 
+ * @param   header  The header.
+ * @param   job     The header of the job that has been removed.
+ * @return          0 on success, -1 on error.
+ */
+static int
+header_remove_job(struct state_header *header, const struct job_header *job)
+{
+	int c = CLOCK_INDEX(job->clk);
+	struct job_header *js;
+	size_t i, k;
+	ssize_t r;
+
+	header->payload -= job->size;
+	if (!--(header->jobs[c]))
+		return 0;
+	if (timecmp(&(job->ts), header->earliest + c) && timecmp(&(job->ts), header->latest + c))
+		return 0;
+
+	if (!(js = malloc(SCAN_CHUNK * sizeof(*js))))
+		return -1;
+	header->jobs[c] = 0;
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r) {
+		for (k = 0; k < (size_t)r; k++) {
+			if (CLOCK_INDEX(js[k].clk) == c) {
+				header->payload -= js[k].size; /* Undo `header_add_job`'s addition. */
+				header_add_job(header, js + k);
+			}
+		}
+	}
+	free(js);
+	return -(r < 0);
+}
+
+
+/**
+ * Open the payload heap.
+ * 
+ * @param   open_flags  Flags (the second parameter) for `open`.
+ * @return              A file descriptor to the payload heap, -1 on error.
+ */
+int
+open_heap(int open_flags)
+{
+	char *path;
+	int fd = -1, saved_errno;
+
+	t (!(path = runtime_path("heap")));
+	fd = open(path, open_flags, S_IRUSR | S_IWUSR);
+fail:
+	S(free(path));
+	return fd;
+}
+
+
+/**
+ * Create the header of a job that is being queued.
+ * 
+ * @param  job       The job.
+ * @param  heap_off  The offset of the job in the payload heap.
+ * @param  header    Output parameter for the job's header.
+ */
+void
+make_job_header(const struct job *job, size_t heap_off, struct job_header *header)
+{
+	memset(header, 0, sizeof(*header));
+	header->no       = job->no;
+	header->clk      = job->clk;
+	header->ts       = job->ts;
+	header->heap_off = heap_off;
+	header->size     = JOB_SIZE(job->n);
+	header->running  = job->running;
+	header->running_since = job->running_since;
+	header->attempt  = job->attempt;
+	header->waiting  = (unsigned char)(job->waiting);
+	header->quiet    = job->quiet;
+	header->cancelled = job->cancelled;
+	header->recur    = job->recur;
+	header->stale    = job->stale;
+	header->deferred = !!HAS_LIMITS(job);
+	header->retries  = !!job->attempts;
+}
+
+
+/**
+ * Copy the fields that are kept up to date in
+ * a job's header, rather than in the payload
+ * heap, from the header to the job.
+ * 
+ * @param  job     The job.
+ * @param  header  The job's header.
+ */
+static void
+copy_header(struct job *job, const struct job_header *header)
+{
+	job->ts      = header->ts;
+	job->waiting = header->waiting;
+	job->quiet   = header->quiet;
+	job->attempt = header->attempt;
+	job->running = header->running;
+	job->running_since = header->running_since;
+	job->cancelled = header->cancelled;
+}
+
+
+/**
+ * Append a job to the payload heap, and its header to the state file.
+ * 
+ * The caller must be holding the state file's exclusive
+ * lock, and shall write the header afterwards.
+ * 
+ * @param   header  The state file's header, will be updated.
+ * @param   full    The job, with its payload.
+ * @return          0 on success, -1 on error.
+ */
+int
+add_job(struct state_header *header, const struct job_full *full)
+{
+	struct job_header job;
+	struct stat attr;
+	size_t off;
+	int heap = -1, saved_errno;
+
+	/* The job is written to the heap first, so that its header never points to nothing. */
+	t (heap = open_heap(O_RDWR | O_CREAT), heap == -1);
+	t (fstat(heap, &attr));
+	make_job_header(&(full->job), (size_t)(attr.st_size), &job);
+	t (pwriten(heap, full, job.size, job.heap_off) < (ssize_t)(job.size));
+	fsync(heap);
+	close(heap), heap = -1;
+
+	t (fstat(STATE_FILENO, &attr));
+	off = (size_t)(attr.st_size) < sizeof(*header) ? sizeof(*header) : (size_t)(attr.st_size);
+	t (pwriten(STATE_FILENO, &job, sizeof(job), off) < (ssize_t)sizeof(job));
+	header_add_job(header, &job);
+	return 0;
+fail:
+	S(close(heap));
+	return -1;
+}
+
+
+/**
+ * Read a job, without its payload, from the payload heap.
+ * 
+ * @param   heap    The payload heap.
+ * @param   header  The job's header.
+ * @param   job     Output parameter for the job, with the
+ *                  fields that are kept in `header` copied.
+ * @return          0 on success, -1 on error.
+ * 
+ * @throws  EBADMSG  The job in the heap does not match its header.
+ * @throws  Any error specified for pread(3).
+ */
+int
+read_job(int heap, const struct job_header *header, struct job *job)
+{
+	ssize_t r;
+	if (r = preadn(heap, job, sizeof(*job), header->heap_off), r < 0)
+		return -1;
+	if ((r < (ssize_t)sizeof(*job)) || (header->size != JOB_SIZE(job->n)) || (job->no != header->no))
+		return errno = EBADMSG, -1;
+	copy_header(job, header);
+	return 0;
+}
+
+
+/**
+ * Shrink the payload heap if enough of it belongs to removed jobs.
+ * 
+ * The payloads are stored in the same order as the jobs, so
+ * they are only ever moved towards the beginning of the heap.
+ * Each job's record is updated before the next payload is
+ * moved, and a payload is never moved over itself, so if the
+ * compaction fails part-way, every job still points to its
+ * payload, and the rest of the garbage is left for later.
+ * 
+ * The caller must be holding the state file's exclusive
+ * lock, and must have written the header, it is written
+ * again if the heap is shrunk.
+ * 
+ * @param   header  The state file's header, will be updated.
+ * @param   heap    The payload heap.
+ * @return          0 on success, -1 on error.
+ */
+static int
+collect_garbage(struct state_header *header, int heap)
+{
+#define COPY_CHUNK  (size_t)(64 << 10)
+
+	struct job_header *js = NULL;
+	size_t i, k, done, m, pos = 0;
+	char *buf = NULL;
+	ssize_t r;
+	int saved_errno;
+
+	if (!header->jobs[0] && !header->jobs[1]) {
+		t (ftruncate(heap, 0));
+		header->garbage = 0;
+		return write_header(header);
+	}
+	if ((header->garbage < HEAP_COMPACT_MIN) || (header->garbage < header->payload))
+		return 0;
+
+	t (!(buf = malloc(COPY_CHUNK)));
+	t (!(js = malloc(SCAN_CHUNK * sizeof(*js))));
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r) {
+		for (k = 0; k < (size_t)r; pos += js[k++].size) {
+			if (js[k].heap_off == pos)
+				continue;
+			if (pos + js[k].size > js[k].heap_off) {
+				/* If the move failed, the payload would be lost, so it is left where it is. */
+				pos = js[k].heap_off;
+				continue;
+			}
+			for (done = 0; done < js[k].size; done += m) {
+				m = js[k].size - done < COPY_CHUNK ? js[k].size - done : COPY_CHUNK;
+				t (preadn(heap, buf, m, js[k].heap_off + done) < (ssize_t)m);
+				t (pwriten(heap, buf, m, pos + done) < (ssize_t)m);
+			}
+			js[k].heap_off = pos;
+			t (pwriten(STATE_FILENO, js + k, sizeof(*js), sizeof(*header) + (i + k) * sizeof(*js))
+			   < (ssize_t)sizeof(*js));
+		}
+	}
+	t (r < 0);
+	t (ftruncate(heap, (off_t)pos));
+	free(buf);
+	free(js);
+	header->garbage = pos > header->payload ? pos - header->payload : 0;
+	return write_header(header);
+
+fail:
+	S(free(buf), free(js));
+	return -1;
+}
+
+
+/**
+ * Check whether a job is queued.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   no  The job number.
+ * @return      1 if the job is queued, 0 if it is not, -1 on error.
+ */
+int
+is_queued(size_t no)
+{
+	struct job_header *js;
+	size_t i, k;
+	ssize_t r;
+
+	if (!(js = malloc(SCAN_CHUNK * sizeof(*js))))
+		return -1;
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r)
+		for (k = 0; k < (size_t)r; k++)
+			if (js[k].no == no)
+				return free(js), 1;
+	free(js);
+	return -(r < 0);
+}
+
+
+/**
+ * Let a deferred job run, now that the system is quiet enough.
+ * 
+ * @param   no  The job number.
+ * @return      0 on success, even if the job is not queued, -1 on error.
+ */
+int
+mark_quiet(size_t no)
+{
+	struct job_header *js = NULL;
+	size_t i, k;
+	ssize_t r;
+	int saved_errno;
+
+	t (!(js = malloc(SCAN_CHUNK * sizeof(*js))));
+	t (lock_state(LOCK_EX));
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r)
+		for (k = 0; k < (size_t)r; k++)
+			if (js[k].no == no)
+				goto found_it;
+	t (r < 0);
+	flock(STATE_FILENO, LOCK_UN); /* Failure isn't fatal. */
+	free(js);
+	return 0;
+
+found_it:
+	js[k].quiet = 1;
+	t (pwriten(STATE_FILENO, js + k, sizeof(*js), sizeof(struct state_header) + (i + k) * sizeof(*js))
+	   < (ssize_t)sizeof(*js));
+	log_event(no, "quiet"); /* Failure isn't fatal. */
+	flock(STATE_FILENO, LOCK_UN); /* Failure isn't fatal. */
+	free(js);
+	return 0;
+fail:
+	S(flock(STATE_FILENO, LOCK_UN), free(js));
+	return -1;
+}
+
+
+/**
+ * Find the first second, at or after a specified time, that
+ * matches a calendar pattern.
+ * 
+ * @param   calendar  The pattern, see `struct job`.
+ * @param   from      The earliest acceptable time.
+ * @param   match     Output parameter for the matching time.
+ * @return            0 on success, -1 if there is no match within eight
+ *                    years, which is enough for any date that exists.
+ */
+static int
+next_calendar_match(const int calendar[6], time_t from, time_t *match)
+{
+#define MATCH(I, V)  ((calendar[I] < 0) || (calendar[I] == (V)))
+
+	struct tm tm;
+	int h, m, s, days;
+	time_t midnight;
+
+	for (days = 0; days <= 8 * 366; days++) {
+		t (!gmtime_r(&from, &tm));
+		midnight = from - (time_t)(tm.tm_hour * 60 * 60 + tm.tm_min * 60 + tm.tm_sec);
+		if ((calendar[0] >= 0) && (tm.tm_year + 1900 > calendar[0]))
+			break;
+		if (MATCH(0, tm.tm_year + 1900) && MATCH(1, tm.tm_mon + 1) && MATCH(2, tm.tm_mday)) {
+			for (h = tm.tm_hour; h < 24; h++) {
+				for (m = (h == tm.tm_hour ? tm.tm_min : 0); MATCH(3, h) && (m < 60); m++) {
+					for (s = (h == tm.tm_hour && m == tm.tm_min ? tm.tm_sec : 0); MATCH(4, m) && (s < 60); s++) {
+						if (MATCH(5, s)) {
+							*match = midnight + (time_t)(h * 60 * 60 + m * 60 + s);
+							return 0;
+						}
+					}
+				}
+			}
+		}
+		from = midnight + (time_t)(24 * 60 * 60);
+	}
+fail:
+	return -1;
+
+#undef MATCH
+}
+
+
+/**
+ * Calculate when a recurring job shall run next.
+ * 
+ * Occurrences are calculated from the job's expiration
+ * time, rather than from when it ran, so that they do not
+ * drift. Occurrences that have already passed are skipped.
+ * 
+ * @param   job   The job, `ts` is the time of the occurrence that expired.
+ * @param   now   The current time, in the job's clock.
+ * @param   next  Output parameter for the next occurrence.
+ * @return        0 on success, -1 if the job has no more occurrences.
+ */
+int
+next_occurrence(const struct job *job, const struct timespec *now, struct timespec *next)
+{
+	uint64_t interval, passed = 0, k;
+	const struct timespec *from = timecmp(now, &(job->ts)) > 0 ? now : &(job->ts);
+
+	switch (job->recur) {
+	case 'i':
+		interval = (uint64_t)(job->interval.tv_sec) * 1000000000ULL + (uint64_t)(job->interval.tv_nsec);
+		if (from == now) {
+			passed  = (uint64_t)(now->tv_sec - job->ts.tv_sec) * 1000000000ULL;
+			passed += (uint64_t)(now->tv_nsec - job->ts.tv_nsec);
+		}
+		k = (passed / interval + 1) * interval;
+		next->tv_sec  = job->ts.tv_sec  + (time_t)(k / 1000000000ULL);
+		next->tv_nsec = job->ts.tv_nsec + (long int)(k % 1000000000ULL);
+		if (next->tv_nsec >= 1000000000L)
+			next->tv_sec += 1, next->tv_nsec -= 1000000000L;
+		return 0;
+
+	case 'c':
+		next->tv_nsec = 0;
+		return next_calendar_match(job->calendar, from->tv_sec + 1, &(next->tv_sec));
+
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * Check whether a job is overdue by more than
+ * its `overdue`, see `struct job`'s `stale`.
+ * 
+ * @param   job  The job.
+ * @param   now  The current time, in the job's clock.
+ * @return       1 if the job is overdue, 0 otherwise.
+ */
+int
+is_overdue(const struct job *job, const struct timespec *now)
+{
+	struct timespec due = job->ts;
+	due.tv_sec += job->overdue.tv_sec;
+	due.tv_nsec += job->overdue.tv_nsec;
+	if (due.tv_nsec >= 1000000000L)
+		due.tv_sec += 1, due.tv_nsec -= 1000000000L;
+	return timecmp(now, &due) > 0;
+}
+
+
+/**
+ * Get when a process was started, so that it can be told
+ * apart from a process that is later given the same PID.
+ * 
+ * @param   pid  The process.
+ * @return       When the process was started, in clock ticks
+ *               after boot, 0 if it does not exist, if it has
+ *               died, or on error.
+ */
+static unsigned long long int
+process_start(pid_t pid)
+{
+	char path[sizeof("/proc//stat") + 3 * sizeof(pid_t)];
+	char buf[1024], *p;
+	ssize_t n;
+	int fd, i;
+
+	sprintf(path, "/proc/%ji/stat", (intmax_t)pid);
+	if (fd = open(path, O_RDONLY | O_CLOEXEC), fd == -1)
+		return 0;
+	n = preadn(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	/* The start time is the 22nd field, the 2nd, the name, may contain spaces.
+	 * The 3rd is the state, a process that has died, but not been reaped, is dead. */
+	if (!(p = strrchr(buf, ')')) || (p[1] != ' ') || strchr("ZXx", p[2]))
+		return 0;
+	for (i = 2; i < 22; i++)
+		if (!(p = strchr(p + 1, ' ')))
+			return 0;
+	return strtoull(p + 1, NULL, 10);
+}
+
+
+/**
+ * Check whether a job is running, that is, whether
+ * it is marked as running by a process that is alive.
  * 
- * @param   fildes  See pread(3).
- * @param   buf     See pread(3).
- * @param   nbyte   See pread(3).
- * @param   offset  See pread(3).
- * @return          See pread(3), only short if the file is shorter.
+ * @param   running  The job's `running`.
+ * @param   since    The job's `running_since`, if 0 any process
+ *                   with the PID `running` is taken to be it.
+ * @return           1 if the job is running, 0 otherwise.
  */
-ssize_t
-preadn(int fildes, void *buf, size_t nbyte, size_t offset)
+int
+is_running(pid_t running, unsigned long long int since)
 {
-	char *buffer = buf;
-	PIO(pread);
+	int saved_errno = errno, r;
+	if (since)
+		r = running && (process_start(running) == since);
+	else
+		r = running && (!kill(running, 0) || (errno == EPERM));
+	errno = saved_errno;
+	return r;
 }
 
 
 /**
- * Wrapper for `pwrite` that writes all specified data.
+ * Enter low-latency mode, if the daemon runs in it,
+ * that is, if satd(1) was started with -l: the process's
+ * memory is locked, so that it is never paged out, and it
+ * is run with a real-time scheduling policy. The policy
+ * is reset in child processes, so jobs and hooks run
+ * with the normal policy.
  * 
- * @param   fildes  See pwrite(3).
- * @param   buf     See pwrite(3).
- * @param   nbyte   See pwrite(3).
- * @param   offset  See pwrite(3).
- * @return          See pwrite(3).
+ * @return  How long time, in nanoseconds, to spin, rather than
+ *          sleep, before a job expires, 0 if the daemon does not
+ *          run in low-latency mode, -1 on error.
  */
-ssize_t
-pwriten(int fildes, const void *buf, size_t nbyte, size_t offset)
+long int
+low_latency(void)
 {
-	const char *buffer = buf;
-	PIO(pwrite);
+	struct sched_param param = { .sched_priority = LOW_LATENCY_PRIORITY };
+	const char *env = getenv("SAT_LOW_LATENCY"); /* Set by satd(1), to its calibrated spin. */
+
+	if (!env || !*env)
+		return spin = 0;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) || sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param))
+		return -1;
+	return spin = strtol(env, NULL, 10);
+}
+
+
+/**
+ * Let `remove_job` unlock the queue whilst the job runs,
+ * because the process holds one of the queue's slots.
+ */
+void
+hold_slot(void)
+{
+	slotted = 1;
 }
 
 
 /**
- * Unmarshal a `NULL`-terminated string array.
+ * Wait, in low-latency mode, until a job expires.
  * 
- * The elements are not actually copied, subpointers
- * to `buf` are stored in the returned list.
+ * We sleep until `spin` nanoseconds before the job
+ * expires, and then read the job's clock until it
+ * has expired, so that we do not depend on how
+ * late the kernel wakes us up.
  * 
- * @param   buf  The marshalled array. Must end with a NUL byte.
- * @param   len  The length of `buf`.
- * @param   n    Output parameter for the number of elements. May be `NULL`
- * @return       The list, `NULL` on error.
+ * The job's clock is read with clock_gettime(3), so that it
+ * is the virtual clock when compiled with VIRTUAL_CLOCK=1,
+ * and the sleep is therefore relative, and measured in
+ * `CLOCK_MONOTONIC`, rather than absolute in the job's clock.
  * 
- * @throws  Any exception specified for realloc(3).
+ * @param  job  The job's header.
  */
-char **
-restore_array(char *buf, size_t len, size_t *n)
+static void
+wait_until(const struct job_header *job)
 {
-	char **rc = malloc((len + 1) * sizeof(char*));
-	char **new = NULL;
-	size_t i = 0, e = 0;
+	struct timespec left, now;
 
-	t (!rc);
-	while (i < len)  i += strlen(rc[e++] = buf + i) + 1;
-	if (n)           *n = e;
-	rc[e++] = NULL;
-	new = realloc(rc, e * sizeof(char*));
-fail:
-	return new ? new : rc;
+	if (clock_gettime(job->clk, &now))
+		return;
+	left.tv_sec = job->ts.tv_sec - now.tv_sec;
+	left.tv_nsec = job->ts.tv_nsec - now.tv_nsec - spin;
+	while (left.tv_nsec < 0)
+		left.tv_sec -= 1, left.tv_nsec += 1000000000L;
+	if (left.tv_sec >= 0)
+		while (clock_nanosleep(CLOCK_MONOTONIC, 0, &left, &left) == EINTR);
+	while (!clock_gettime(job->clk, &now) && (timecmp(&now, &(job->ts)) < 0));
 }
 
 
 /**
- * Create `NULL`-terminate subcopy of an list,
+ * Remove a job's header from the state file.
  * 
- * @param   list  The list.
- * @param   n     The number of elements in the new sublist.
- * @return        The sublist, `NULL` on error.
+ * Only the jobs' headers are shifted, the job
+ * is left in the heap as garbage, which the caller
+ * shall collect, after it has written the header.
  * 
- * @throws  Any exception specified for malloc(3).
+ * @param   header  The state file's header, it is updated but not written.
+ * @param   off     The offset of the job's header in the state file.
+ * @param   job     The job's header.
+ * @return          0 on success, -1 on error.
  */
-char **
-sublist(char *const *list, size_t n)
+static int
+unlink_job(struct state_header *header, size_t off, const struct job_header *job)
 {
-	char **rc = malloc((n + 1) * sizeof(char*));
-	t (!rc);
-	for (rc[n] = NULL; n--; rc[n] = list[n]);
+	char *buf = NULL;
+	size_t n;
+	ssize_t r;
+	struct stat attr;
+	int saved_errno;
+
+	t (fstat(STATE_FILENO, &attr));
+	n = (size_t)(attr.st_size) - off - sizeof(*job);
+	t (!(buf = malloc(n)));
+	t (r = preadn(STATE_FILENO, buf, n, off + sizeof(*job)), r < 0);
+	t (pwriten(STATE_FILENO, buf, (size_t)r, off) < 0);
+	t (ftruncate(STATE_FILENO, (off_t)r + (off_t)off));
+	free(buf), buf = NULL;
+	t (header_remove_job(header, job));
+	header->garbage += job->size;
+	return 0;
 fail:
-	return rc;
+	S(free(buf));
+	return -1;
 }
 
 
 /**
- * Create a new open file descriptor for an already
- * existing file descriptor.
+ * Calculate how long to wait before a failed job is retried.
  * 
- * @param   fd     The file descriptor that shall be promoted
- *                 to a new open file descriptor.
- * @param   oflag  See open(3), `O_CREAT` is not allowed.
- * @return         0 on success, -1 on error.
+ * The delay is doubled for each failed attempt, but
+ * never beyond `RETRY_MAX_DELAY` seconds, and randomly
+ * varied by up to the job's jitter, so that jobs that
+ * failed together are not retried together.
+ * 
+ * @param  job    The job, `attempt` is the number of attempts that
+ *                failed before the one that just failed.
+ * @param  delay  Output parameter for the delay.
  */
-int
-reopen(int fd, int oflag)
+static void
+retry_delay(const struct job *job, struct timespec *delay)
 {
-	char path[sizeof("/dev/fd/") + 3 * sizeof(int)];
-	int r, saved_errno;
+	uint64_t ns, max = (uint64_t)RETRY_MAX_DELAY * 1000000000ULL;
+	uint32_t rnd = 0;
+	unsigned int i;
 
-	sprintf(path, "/dev/fd/%i", fd);
-	if (r = open(path, oflag), r < 0)
-		return -1;
-	if (DUP2_AND_CLOSE(r, fd) == -1)
-		return S(close(r)), -1;
-	return 0;
+	ns = (uint64_t)(job->retry_delay.tv_sec) * 1000000000ULL + (uint64_t)(job->retry_delay.tv_nsec);
+	for (i = 0; (i < job->attempt) && (ns < max); i++)
+		ns *= 2;
+	ns = ns < max ? ns : max;
+	if (job->jitter) {
+		if (getrandom(&rnd, sizeof(rnd), GRND_NONBLOCK) < (ssize_t)sizeof(rnd))
+			rnd = (uint32_t)(getpid() ^ time(NULL)); /* Good enough to spread retries. */
+		ns = (uint64_t)((double)ns * (1 + job->jitter / 100. * (2. * rnd / UINT32_MAX - 1)));
+	}
+	delay->tv_sec = (time_t)(ns / 1000000000ULL);
+	delay->tv_nsec = (long int)(ns % 1000000000ULL);
 }
 
 
 /**
- * Run a job or a hook.
+ * Finish an attempt to run a job that may be retried.
  * 
- * @param   job   The job.
- * @param   hook  The hook, `NULL` to run the job.
- * @return        0 on success, -1 on error, 1 if the child failed.
+ * The job was kept in place whilst it ran. If it failed
+ * it is rescheduled in place, keeping its job number,
+ * otherwise it is removed. It is also removed if it was
+ * cancelled whilst it ran, in which case, if it failed,
+ * it finishes as if it had been removed rather than run.
+ * The caller must be holding the state file's exclusive lock.
+ * 
+ * @param   job      The job, as it was when the attempt started.
+ * @param   result   's' if the attempt succeeded, 'f' if it failed,
+ *                   set to 0 if the job was cancelled and failed.
+ * @param   retried  Output parameter for whether the job was rescheduled.
+ * @return           0 on success, -1 on error.
  */
-int
-run_job_or_hook(struct job *job, const char *hook)
+static int
+finish_attempt(const struct job *job, char *result, int *retried)
 {
-	pid_t pid;
-	char **args = NULL;
-	char **argv = NULL;
-	char **envp = NULL;
-	size_t argsn;
-	void *new;
-	int status = 0, saved_errno;
+	char *path = NULL;
+	size_t i, k, off;
+	ssize_t r;
+	struct state_header header;
+	struct job_header *js = NULL;
+	struct job_header found, next;
+	struct timespec delay;
+	int heap = -1, failed = *result == 'f', saved_errno;
 
-	t (!(args = restore_array(job->payload, job->n, &argsn)));
-	t (!(argv = sublist(args, (size_t)(job->argc))));
-	t (!(envp = sublist(args + job->argc, argsn - (size_t)(job->argc)))); /* Includes wdir. */
-	free(args), args = NULL;
+	*retried = 0;
+	t (!(js = malloc(SCAN_CHUNK * sizeof(*js))));
+	t (read_header(&header) < 0);
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r)
+		for (k = 0; k < (size_t)r; k++)
+			if ((js[k].no == job->no) && (js[k].running == getpid()))
+				goto found_it;
+	t (r < 0);
+	free(js);
+	return 0; /* It was removed whilst it ran. */
 
-	if (hook) {
-		t (!(new = realloc(argv, ((size_t)(job->argc) + 3) * sizeof(*argv))));
-		argv = new;
-		memmove(argv + 2, argv, ((size_t)(job->argc) + 1) * sizeof(*argv));
-		argv[0] = getenv("SAT_HOOK_PATH");
-		argv[1] = (strstr)(hook, hook); /* strstr: just to remove a warning */
+found_it:
+	found = js[k];
+	free(js), js = NULL;
+	off = sizeof(header) + (i + k) * sizeof(found);
+	if (failed && found.cancelled) {
+		*result = 0;
+		failed = 0;
 	}
-
-	if (!(pid = fork())) {
-		close(STATE_FILENO), close(BOOT_FILENO), close(REAL_FILENO);
-		(void)(status = chdir(envp[0]));
-		environ = envp + 1;
-		execvp(*argv, argv);
-		exit(1);
+	if (failed) {
+		next = found;
+		next.running = 0;
+		next.running_since = 0;
+		retry_delay(job, &delay);
+		t (clock_gettime(found.clk, &(next.ts)));
+		next.ts.tv_sec += delay.tv_sec;
+		next.ts.tv_nsec += delay.tv_nsec;
+		if (next.ts.tv_nsec >= 1000000000L)
+			next.ts.tv_sec += 1, next.ts.tv_nsec -= 1000000000L;
+		next.attempt += 1;
+		t (pwriten(STATE_FILENO, &next, sizeof(next), off) < (ssize_t)sizeof(next));
+		header_add_job(&header, &next);
+		t (header_remove_job(&header, &found));
+		*retried = 1;
+		log_event(next.no, "retry"); /* Failure isn't fatal. */
+	} else {
+		t (unlink_job(&header, off, &found));
+		if (job->script) {
+			t (!(path = script_path(job->no)));
+			unlink(path); /* Failure isn't fatal. */
+			free(path), path = NULL;
+		}
 	}
-
-	t ((pid < 0) || (waitpid(pid, &status, 0) != pid));
+	t (write_header(&header));
+	fsync(STATE_FILENO);
+	if (!failed && (heap = open_heap(O_RDWR), heap >= 0))
+		collect_garbage(&header, heap), close(heap); /* Failure isn't fatal. */
+	return 0;
 fail:
-	S(free(args), free(argv), free(envp));
-	return status ? 1 : -!!saved_errno;
+	S(free(js), free(path));
+	return -1;
 }
 
 
 /**
- * Removes (and optionally runs) a job.
+ * Remove (and optionally run) a job, see `remove_job`.
  * 
- * @param   jobno   The job number, `NULL` for any job.
- * @param   runjob  Shall we run the job too? 2 if its time has expired (not forced).
- * @return          0 on success, -1 on error.
+ * The caller must be holding the state file's exclusive
+ * lock, it is released whilst the job runs if the process
+ * holds one of the queue's slots, see `hold_slot`. The jobs that
+ * wait for the job are not released, that is left to the
+ * caller, so that it can do it without recursion.
+ * 
+ * @param   no        The job number, `NULL` for any job.
+ * @param   runjob    See `remove_job`.
+ * @param   taken     Output parameter for the job's number.
+ * @param   finished  Output parameter for whether the job has finished,
+ *                    that is, whether the jobs that wait for it shall
+ *                    be released. It has not if it is retried, if
+ *                    its occurrence was skipped, or if it is running
+ *                    in another process, in which case it is only
+ *                    marked as cancelled.
+ * @param   result    Output parameter for how the job finished, see
+ *                    `release_dependents`.
+ * @return            0 on success, -1 on error.
  * 
  * @throws  0  The job is not in the queue.
  */
-int
-remove_job(const char *jobno, int runjob)
+static int
+take_job(const size_t *no, int runjob, size_t *taken, int *finished, char *result)
 {
-	char *end;
-	char *buf = NULL;
-	size_t no = 0, off = sizeof(size_t), n;
+	char *path = NULL;
+	size_t i, k, off, waited_for;
 	ssize_t r;
-	struct stat attr;
-	struct job job;
-	struct job *job_full = NULL;
-	int rc = 0, saved_errno = 0;
+	struct state_header header;
+	struct job_header *js = NULL;
+	struct job_header found, next;
+	struct job_full *job_full = NULL;
+	struct job *job;
+	struct timespec fired[2], now;
+	struct run run;
+	const struct timespec *from;
+	int heap = -1, script = -1, recurs, retries = 0, retried = 0, waited = 0, rc = 0, saved_errno = 0;
 
-	if (jobno) {
-		no = (errno = 0, strtoul)(jobno, &end, 10);
-		if (errno || *end || !isdigit(*jobno))
-			return 0;
-	}
+	*finished = 0;
+	*result = 0;
+	clock_gettime(CLOCK_REALTIME, fired + CLOCK_INDEX(CLOCK_REALTIME));
+	clock_gettime(CLOCK_BOOTTIME, fired + CLOCK_INDEX(CLOCK_BOOTTIME));
 
-	t (flock(STATE_FILENO, LOCK_EX));
-	t (fstat(STATE_FILENO, &attr));
-	for (n = (size_t)(attr.st_size); off < n; off += sizeof(job) + job.n) {
-		t (preadn(STATE_FILENO, &job, sizeof(job), off) < (ssize_t)sizeof(job));
-		if (!jobno || (job.no == no))
-			goto found_it;
-	}
-	flock(STATE_FILENO, LOCK_UN); /* Failure isn't fatal. */
+again:
+	t (!(js = malloc(SCAN_CHUNK * sizeof(*js))));
+	t (read_header(&header) < 0);
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r)
+		for (k = 0; k < (size_t)r; k++)
+			if ((!no || (js[k].no == *no)) &&
+			    (waited ? (js[k].running == getpid()) : !(runjob && IS_RUNNING(js + k))))
+				goto found_it;
+	t (r < 0);
+	free(js);
 	return errno = 0, -1;
 
 found_it:
-	t (!(job_full = malloc(sizeof(job) + job.n)));
-	*job_full = job;
-	t (preadn(STATE_FILENO, job_full->payload, job.n, off + sizeof(job)) < (ssize_t)(job.n));
-	n -= off + sizeof(job) + job.n;
-	t (!(buf = malloc(n)));
-	t (r = preadn(STATE_FILENO, buf, n, off + sizeof(job) + job.n), r < 0);
-	t (pwriten(STATE_FILENO, buf, (size_t)r, off) < 0);
-	t (ftruncate(STATE_FILENO, (off_t)r + (off_t)off));
-	free(buf), buf = NULL;
+	*taken = js[k].no;
+	found = js[k];
+	free(js), js = NULL;
+	off = sizeof(header) + (i + k) * sizeof(found);
+	if (!runjob && IS_RUNNING(&found)) {
+		/* The process that runs it removes it when the attempt has finished. */
+		found.cancelled = 1;
+		t (pwriten(STATE_FILENO, &found, sizeof(found), off) < (ssize_t)sizeof(found));
+		log_event(found.no, "cancelled"); /* Failure isn't fatal. */
+		return 0;
+	}
+	if ((runjob == 2) && spin && !waited && !clock_gettime(found.clk, &now) && (timecmp(&now, &(found.ts)) < 0)) {
+		/* In low-latency mode, the job may be run just before it expires. Until it
+		 * has, it is marked as running rather than removed, so that it is not run
+		 * by anyone else, but can still be removed, and the queue is unlocked. */
+		found.running = getpid();
+		found.running_since = process_start(found.running);
+		t (pwriten(STATE_FILENO, &found, sizeof(found), off) < (ssize_t)sizeof(found));
+		flock(STATE_FILENO, LOCK_UN);
+		wait_until(&found);
+		t (lock_state(LOCK_EX));
+		waited = 1;
+		waited_for = found.no, no = &waited_for;
+		goto again;
+	}
+	if (waited)
+		found.running = 0, found.running_since = 0;
+	if (found.cancelled)
+		runjob = 0; /* It was cancelled whilst it ran, or was about to, but was not run. */
+	t (heap = open_heap(O_RDWR), heap == -1);
+	t (errno = EBADMSG, found.size < JOB_SIZE(0));
+	t (!(job_full = malloc(found.size)));
+	t (preadn(heap, job_full, found.size, found.heap_off) < (ssize_t)(found.size));
+	job = &(job_full->job);
+	t (errno = EBADMSG, (found.size != JOB_SIZE(job->n)) || (job->no != found.no));
+	copy_header(job, &found);
+	if (job->script) {
+		/* The script is kept open, so that it can be unlinked before its job number is reused. */
+		t (!(path = script_path(job->no)));
+		if (script = open(path, O_RDONLY | O_CLOEXEC), script == -1) {
+			t (errno != ENOENT);
+			t (script = open("/dev/null", O_RDONLY | O_CLOEXEC), script == -1);
+		}
+	}
+	next = found;
+	next.quiet = 0;
+	/* Missed occurrences are caught up with, by counting from the
+	 * occurrence that expired rather than from now, unless the job
+	 * is skipped, or only shall run once if it is overdue. */
+	from = fired + CLOCK_INDEX(job->clk);
+	if ((runjob == 2) && ((job->stale == 'r') || ((job->stale == 'o') && !is_overdue(job, from))))
+		from = &(job->ts);
+	recurs = (runjob >= 2) && !next_occurrence(job, from, &(next.ts));
+	if (recurs) {
+		/* Reschedule the job in place, its payload and script are kept. */
+		t (pwriten(STATE_FILENO, &next, sizeof(next), off) < (ssize_t)sizeof(next));
+		header_add_job(&header, &next);
+		t (header_remove_job(&header, &found));
+		goto rescheduled;
+	}
+	retries = (runjob == 2) && job->attempts && (job->attempt + 1 < job->attempts);
+	if (retries) {
+		/* The job is kept in place whilst it runs, so that it can be retried if it fails.
+		 * It is marked with our PID, so that it is run again if we die whilst it runs. */
+		next.running = getpid();
+		next.running_since = process_start(next.running);
+		t (pwriten(STATE_FILENO, &next, sizeof(next), off) < (ssize_t)sizeof(next));
+		goto rescheduled;
+	}
+	t (unlink_job(&header, off, &found));
+rescheduled:
+	t (write_header(&header));
 	fsync(STATE_FILENO);
+	if (!recurs && !retries)
+		collect_garbage(&header, heap); /* Failure isn't fatal, the garbage is left for later. */
+	close(heap), heap = -1;
+	if (path && !recurs && !retries)
+		unlink(path); /* Failure isn't fatal. */
+	free(path), path = NULL;
+	log_trace(runjob == 3 ? 's' : runjob == 2 ? 'e' : runjob ? 'f' : 'r', job, 0); /* Failure isn't fatal. */
 
-	if (runjob) {
-		run_job_or_hook(job_full, runjob == 2 ? "expired" : "forced");
-		rc = run_job_or_hook(job_full, NULL);
+	if (runjob == 3) {
+		run_job_or_hook(job_full, "skipped", NULL);
+	} else if (runjob) {
+		memset(&run, 0, sizeof(run));
+		run.fired = fired[CLOCK_INDEX(job->clk)];
+		run.script = script;
+		run_job_or_hook(job_full, runjob == 2 ? "expired" : "forced", NULL);
+		/* Logged whilst the queue is locked, so that it is in order. */
+		log_event(job->no, "started"); /* Failure isn't fatal. */
+		/* If the job runs in one of the queue's slots, the queue
+		 * is unlocked whilst it runs, so that other jobs can run
+		 * too. The job is either no longer in the state file, or
+		 * marked as running, so it is not run again. Otherwise
+		 * the queue is kept locked, so that nothing is done to
+		 * the job, or the queue, behind our back. */
+		if (slotted)
+			flock(STATE_FILENO, LOCK_UN);
+		if ((runjob == 2) && !clock_gettime(job->clk, &now))
+			metrics_record(METRIC(dispatch), &(job->ts), &now);
+		rc = run_job_or_hook(job_full, NULL, &run);
 		saved_errno = errno;
-		run_job_or_hook(job_full, rc ? "failure" : "success");
+		if (slotted)
+			t (lock_state(LOCK_EX));
+		*result = (rc || run.timed_out) ? 'f' : 's';
+		run_job_or_hook(job_full, run.timed_out ? "timeout" : rc ? "failure" : "success", &run);
+		log_history(job_full, &run); /* Failure isn't fatal. */
 		rc = rc == 1 ? 0 : rc;
+		if (retries)
+			t (finish_attempt(job, result, &retried));
+		if (!*result)
+			run_job_or_hook(job_full, "removed", NULL);
 	} else {
-		run_job_or_hook(job_full, "removed");
+		run_job_or_hook(job_full, "removed", NULL);
 	}
+	*finished = !retried && !(runjob == 3 && recurs);
 
 	free(job_full);
-	flock(STATE_FILENO, LOCK_UN); /* Unlock late so that hooks are synchronised. Failure isn't fatal. */
+	if (script >= 0)
+		close(script);
 	errno = saved_errno;
 	return rc;
 
 fail:
-	S(flock(STATE_FILENO, LOCK_UN), free(buf), free(job_full));
+	S(free(js), close(heap), close(script), free(path), free(job_full));
+	return -1;
+}
+
+
+/**
+ * Let the jobs that wait for a job know that it has finished.
+ * 
+ * The jobs that are no longer waiting for any job are
+ * released, and the jobs that required that the job
+ * finished in another way are removed, and so are,
+ * in turn, the jobs that wait for them. This is done
+ * with a worklist rather than recursion, so that a long
+ * chain of jobs does not exhaust the stack, and without
+ * releasing the state file's lock.
+ * 
+ * The caller must be holding the state file's exclusive lock.
+ * 
+ * @param   no      The number of the job that has finished.
+ * @param   result  's' if it succeeded, 'f' if it failed,
+ *                  0 if it was removed without being run.
+ * @return          0 on success, -1 on error.
+ */
+static int
+release_dependents(size_t no, char result)
+{
+	struct job_header *js = NULL;
+	struct job job;
+	size_t i, k, w, *work = NULL, nwork = 1, taken;
+	void *new;
+	ssize_t r;
+	int j, waiting, finished, heap = -1, saved_errno;
+	char ignored;
+
+	t (!(js = malloc(SCAN_CHUNK * sizeof(*js))));
+	t (!(work = malloc(sizeof(*work))));
+	*work = no;
+	for (w = 0; w < nwork; w++, result = 0) {
+		/* Removed jobs are removed before the jobs that wait for them
+		 * are looked for, rather than during the scan, since it shifts
+		 * the jobs. A job may already have been removed, if it waited
+		 * for more than one of the removed jobs. */
+		if (w && take_job(work + w, 0, &taken, &finished, &ignored)) {
+			t (errno);
+			continue;
+		}
+		for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r) {
+			for (k = 0; k < (size_t)r; k++) {
+				if (!js[k].waiting)
+					continue;
+				/* What the job waits for is only in the heap. */
+				if (heap < 0)
+					t (heap = open_heap(O_RDONLY), heap == -1);
+				t (read_job(heap, js + k, &job));
+				for (j = 0, waiting = job.waiting; j < MAX_PREREQUISITES; j++) {
+					if (!(waiting & (1 << j)) || (job.after[j] != work[w]))
+						continue;
+					if (!result || (job.after_on[j] && (job.after_on[j] != result)))
+						break;
+					waiting &= ~(1 << j);
+				}
+				if (j < MAX_PREREQUISITES) {
+					t (!(new = realloc(work, (nwork + 1) * sizeof(*work))));
+					(work = new)[nwork++] = js[k].no;
+					continue;
+				}
+				if (waiting == job.waiting)
+					continue;
+				js[k].waiting = (unsigned char)waiting;
+				t (pwriten(STATE_FILENO, js + k, sizeof(*js), sizeof(struct state_header) + (i + k) * sizeof(*js))
+				   < (ssize_t)sizeof(*js));
+				if (!waiting)
+					log_event(js[k].no, "released"); /* Failure isn't fatal. */
+			}
+		}
+		t (r < 0);
+	}
+	if (heap >= 0)
+		close(heap);
+	free(js);
+	free(work);
+	return 0;
+fail:
+	S(free(js), free(work), (heap >= 0 ? close(heap) : 0));
 	return -1;
 }
 
 
+/**
+ * Removes (and optionally runs) a job.
+ * 
+ * @param   jobno   The job number, `NULL` for any job.
+ * @param   runjob  Shall we run the job too? 2 if its time has expired (not forced),
+ *                  in which case a recurring job is rescheduled rather than removed,
+ *                  and a job that fails is rescheduled if it has attempts left.
+ *                  3 if its time has expired, but it is skipped because it is
+ *                  overdue, in which case it is not run, but a recurring job
+ *                  is still rescheduled.
+ * @return          0 on success, -1 on error.
+ * 
+ * @throws  0  The job is not in the queue.
+ */
+int
+remove_job(const char *jobno, int runjob)
+{
+	char *end;
+	size_t no = 0, taken;
+	int finished = 0, rc, saved_errno;
+	char result = 0;
+
+	if (jobno) {
+		no = (errno = 0, strtoul)(jobno, &end, 10);
+		if (errno || *end || !isdigit(*jobno))
+			return 0;
+	}
+
+	if (lock_state(LOCK_EX))
+		return -1;
+	rc = take_job(jobno ? &no : NULL, runjob, &taken, &finished, &result);
+	saved_errno = errno;
+	if (finished && release_dependents(taken, result) && !rc)
+		rc = -1, saved_errno = errno;
+	flock(STATE_FILENO, LOCK_UN); /* Unlock late so that hooks are synchronised. Failure isn't fatal. */
+	errno = saved_errno;
+	return rc;
+}
+
+
 /**
  * Get a `NULL`-terminated list of all queued jobs.
  * 
+ * The list and the jobs are stored in the same
+ * allocation, so only the list shall be freed.
+ * 
  * @return  A `NULL`-terminated list of all queued jobs. `NULL` on error.
  */
-struct job **
+struct job_full **
 get_jobs(void)
 {
-	size_t off = sizeof(size_t), n, j = 0;
+#define ALIGNMENT  offsetof(struct { char c; struct job_full job; }, job)
+
+	size_t n, h = 0, max, j;
+	struct state_header header;
+	struct job_header job;
 	struct stat attr;
-	struct job **js = NULL;
-	struct job job;
-	int saved_errno;
+	struct job_full **js = NULL;
+	char *headers, *heap_data, *dest;
+	int heap = -1, saved_errno;
 
-	t (flock(STATE_FILENO, LOCK_SH));
+	t (lock_state(LOCK_SH));
+	t (read_header(&header) < 0);
 	t (fstat(STATE_FILENO, &attr));
 	n = (size_t)(attr.st_size);
-	t (!(js = malloc((n / sizeof(**js) + 1) * sizeof(*js))));
-	while (off < n) {
-		t (preadn(STATE_FILENO, &job, sizeof(job), off) < (ssize_t)sizeof(job));
-		off += sizeof(job);
-		t (!(js[j] = malloc(sizeof(job) + job.n)));
-		*(js[j]) = job;
-		t (preadn(STATE_FILENO, js[j++]->payload, job.n, off) < (ssize_t)(job.n));
-		off += job.n;
+	n = n > sizeof(struct state_header) ? n - sizeof(struct state_header) : 0;
+	max = n / sizeof(job);
+	if (max) {
+		t (heap = open_heap(O_RDONLY), heap == -1);
+		t (fstat(heap, &attr));
+		h = (size_t)(attr.st_size);
 	}
+
+	/* The state file and the payload heap are read at once, each,
+	 * to the end of the allocation, and the jobs are then copied,
+	 * aligned, to the beginning. The live jobs can be no larger than
+	 * the heap, so the copied jobs never reach the read data. */
+	t (!(js = malloc((max + 1) * sizeof(*js) + max * ALIGNMENT + h + n + h)));
+	dest = (char *)(js + max + 1);
+	headers = dest + max * ALIGNMENT + h;
+	heap_data = headers + n;
+	t (preadn(STATE_FILENO, headers, n, sizeof(struct state_header)) < (ssize_t)n);
+	t (preadn(heap, heap_data, h, 0) < (ssize_t)h);
 	t (flock(STATE_FILENO, LOCK_UN));
+	if (heap >= 0)
+		close(heap), heap = -1;
+
+	for (j = 0; j < max; j++) {
+		memcpy(&job, headers + j * sizeof(job), sizeof(job));
+		t (errno = EBADMSG, (job.heap_off > h) || (h - job.heap_off < job.size) || (job.size < JOB_SIZE(0)));
+		dest += (ALIGNMENT - (size_t)dest % ALIGNMENT) % ALIGNMENT;
+		memcpy(js[j] = (struct job_full *)dest, heap_data + job.heap_off, job.size);
+		t (errno = EBADMSG, (job.size != JOB_SIZE(js[j]->job.n)) || (js[j]->job.no != job.no));
+		copy_header(&(js[j]->job), &job);
+		dest += job.size;
+	}
 	return js[j] = NULL, js;
 
 fail:
-	saved_errno = errno;
-	flock(STATE_FILENO, LOCK_UN);
-	while (j--)  free(js[j]);
-	free(js);
-	errno = saved_errno;
+	S(flock(STATE_FILENO, LOCK_UN), close(heap), free(js));
+	return NULL;
+}
+
+
+/**
+ * Get the headers of all queued jobs.
+ * 
+ * @param   n  Output parameter for the number of jobs.
+ * @return     The jobs' headers, `NULL` on error.
+ */
+struct job_header *
+get_job_headers(size_t *n)
+{
+	size_t size;
+	struct state_header header;
+	struct stat attr;
+	struct job_header *js = NULL;
+	ssize_t r;
+	int saved_errno;
+
+	t (lock_state(LOCK_SH));
+	t (read_header(&header) < 0);
+	t (fstat(STATE_FILENO, &attr));
+	size = (size_t)(attr.st_size);
+	size = size > sizeof(struct state_header) ? size - sizeof(struct state_header) : 0;
+	t (!(js = malloc(size + sizeof(*js))));
+	t (r = preadn(STATE_FILENO, js, size, sizeof(struct state_header)), r < 0);
+	t (flock(STATE_FILENO, LOCK_UN));
+	*n = (size_t)r / sizeof(*js);
+	return js;
+
+fail:
+	S(flock(STATE_FILENO, LOCK_UN), free(js));
 	return NULL;
 }
 
 
+
+/**
+ * Get a queued job, without its payload.
+ * 
+ * @param   no   The job number.
+ * @param   job  Output parameter for the job.
+ * @return       1 if the job was found, 0 if it is
+ *               no longer queued, -1 on error.
+ */
+int
+get_job(size_t no, struct job *job)
+{
+	struct job_header *js = NULL;
+	size_t i, k;
+	ssize_t r;
+	int heap = -1, saved_errno;
+
+	/* The payload heap is compacted under the exclusive lock. */
+	t (lock_state(LOCK_SH));
+	t (!(js = malloc(SCAN_CHUNK * sizeof(*js))));
+	for (i = 0; (r = read_jobs(js, i, SCAN_CHUNK)) > 0; i += (size_t)r)
+		for (k = 0; k < (size_t)r; k++)
+			if (js[k].no == no)
+				goto found_it;
+	t (r < 0);
+	free(js);
+	flock(STATE_FILENO, LOCK_UN);
+	return 0;
+
+found_it:
+	t (heap = open_heap(O_RDONLY), heap == -1);
+	t (read_job(heap, js + k, job));
+	close(heap);
+	free(js);
+	flock(STATE_FILENO, LOCK_UN);
+	return 1;
+
+fail:
+	S(flock(STATE_FILENO, LOCK_UN), close(heap), free(js));
+	return -1;
+}
+
 /**
  * Duplicate a file descriptor, and
  * open /dev/null to the old file descriptor.
@@ -364,14 +2257,10 @@ fail:
 int
 open_state(int open_flags, char **state_path)
 {
-	const char *dir;
 	char *path;
 	int fd = -1, saved_errno;
 
-	/* Create directory. */
-	dir = getenv("XDG_RUNTIME_DIR"), dir = (dir ? dir : "/run");
-	t (!(path = malloc(strlen(dir) * sizeof(char) + sizeof("/" PACKAGE "/state"))));
-	stpcpy(stpcpy(path, dir), "/" PACKAGE "/state");
+	t (!(path = runtime_path("state")));
 	t (fd = open(path, open_flags, S_IRUSR | S_IWUSR), fd == -1);
 
 	if (state_path)  *state_path = path, path = NULL;
@@ -396,14 +2285,11 @@ int
 poke_daemon(int start, const char *name)
 {
 	char *path = NULL;
-	const char *dir;
 	pid_t pid;
-	int fd = -1, status, saved_errno;
+	int fd = -1, status, running = 0, saved_errno;
 
 	/* Get the lock file's pathname. */
-	dir = getenv("XDG_RUNTIME_DIR"), dir = (dir ? dir : "/run");
-	t (!(path = malloc(strlen(dir) * sizeof(char) + sizeof("/" PACKAGE "/lock"))));
-	stpcpy(stpcpy(path, dir), "/" PACKAGE "/lock");
+	t (!(path = runtime_path("lock")));
 
 	/* Any daemon listening? */
 	fd = open(path, O_RDONLY);
@@ -411,7 +2297,7 @@ poke_daemon(int start, const char *name)
 		t ((errno != ENOENT) && (errno != ENOTDIR));
 	} else {
 		if (flock(fd, LOCK_SH | LOCK_NB /* and LOCK_DRY if that was ever added... */))
-			t (start = 0, errno != EWOULDBLOCK);
+			t (start = 0, running = 1, errno != EWOULDBLOCK);
 		else
 			flock(fd, LOCK_UN);
 		t (read(fd, &pid, sizeof(pid)) < (ssize_t)sizeof(pid));
@@ -433,7 +2319,8 @@ poke_daemon(int start, const char *name)
 			t (errno = 0, status);
 			break;
 		}
-	} else {
+	} else if (running) {
+		/* The PID is stale if the daemon is not running. */
 		t (kill(pid, SIGCHLD));
 	}
 
@@ -478,25 +2365,55 @@ fail:
 
 
 /**
- * Set SAT_HOOK_PATH.
+ * Set an environment variable to the pathname of a
+ * configuration file, unless it is already set.
  * 
- * @return  0 on success, -1 on error.
+ * @param   var   The environment variable.
+ * @param   file  The basename of the configuration file.
+ * @return        0 on success, -1 on error.
  */
-int
-set_hookpath(void)
+static int
+set_configpath(const char *var, const char *file)
 {
 #define HOOKPATH(PRE, SUF)  \
-	t (path = path ? path : hookpath(PRE, SUF), !path && errno)
+	t (path = path ? path : hookpath(PRE, (sprintf(suffix, SUF "%s", file), suffix)), !path && errno)
+	char suffix[sizeof("/.config/sat/") + 16];
 	char *path = NULL;
 	int saved_errno;
-	if (!getenv("SAT_HOOK_PATH")) {
-		HOOKPATH("XDG_CONFIG_HOME", "/sat/hook");
-		HOOKPATH("HOME", "/.config/sat/hook");
-		HOOKPATH(NULL, "/.config/sat/hook");
-		t (setenv("SAT_HOOK_PATH", path ? path : "/etc/sat/hook", 1));
+	if (!getenv(var)) {
+		HOOKPATH("XDG_CONFIG_HOME", "/sat/");
+		HOOKPATH("HOME", "/.config/sat/");
+		HOOKPATH(NULL, "/.config/sat/");
+		if (!path)
+			sprintf(suffix, "/etc/sat/%s", file);
+		t (setenv(var, path ? path : suffix, 1));
 	}
 	return free(path), 0;
 fail:
 	return S(free(path)), -1;
 }
 
+
+/**
+ * Set SAT_HOOK_PATH.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int
+set_hookpath(void)
+{
+	return set_configpath("SAT_HOOK_PATH", "hook");
+}
+
+
+/**
+ * Set SAT_QUEUES_PATH.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int
+set_queuespath(void)
+{
+	return set_configpath("SAT_QUEUES_PATH", "queues");
+}
+
@@ -23,6 +23,8 @@
 # define _DEFAULT_SOURCE
 #endif
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
@@ -32,6 +34,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/timerfd.h>
 
@@ -84,45 +87,797 @@ static const char *failed__ = NULL;
  */
 #define LOCK_FILENO  6
 
+/**
+ * The maximum size of a segment of the history journal, when
+ * it is exceeded, the previous segment is discarded and a new
+ * segment is started.
+ */
+#define HISTORY_SEGMENT_SIZE  (size_t)(512 << 10)
+
+/**
+ * The number of entries in the event log, which is a ring,
+ * when it is full, the oldest entry is overwritten.
+ */
+#define EVENTS_MAX  4096
+
+/**
+ * The first bytes of the state file, see `struct state_header`.
+ */
+#define STATE_MAGIC  "sat"
+
+/**
+ * The version of the state file's format. It shall be increased
+ * whenever `struct state_header` or `struct job` is changed.
+ * A state file of another version is rejected.
+ */
+#define STATE_VERSION  3
+
+/**
+ * The payload heap is compacted when this many of its bytes,
+ * and at least half of it, belong to removed jobs.
+ */
+#define HEAP_COMPACT_MIN  (size_t)(1 << 20)
+
+/**
+ * The maximum number of jobs a job can wait for.
+ */
+#define MAX_PREREQUISITES  4
+
+/**
+ * The number of CPUs that a job's CPU affinity can cover.
+ */
+#define AFFINITY_CPUS  256
+
+/**
+ * The number of seconds a job that has timed out has,
+ * unless specified, to exit after SIGTERM before it
+ * is sent SIGKILL.
+ */
+#define TIMEOUT_GRACE  10
+
+/**
+ * The longest time, in seconds, a failed job is
+ * delayed before it is retried, before jitter.
+ */
+#define RETRY_MAX_DELAY  86400
+
+/**
+ * How long time, in nanoseconds, before a job expires,
+ * the daemon is woken up in low-latency mode, so that
+ * it has started, and read the queue, when the job expires.
+ */
+#define LOW_LATENCY_ADVANCE  5000000L
+
+/**
+ * The real-time priority the daemon runs with in low-latency mode.
+ */
+#define LOW_LATENCY_PRIORITY  50
+
+
+
+/**
+ * A queued job.
+ * 
+ * The job is stored, with its payload, as a `struct job_full`,
+ * in the payload heap, and is only read from there when it is
+ * run or listed. Its record in the state file is a `struct
+ * job_header`, which holds the fields that change whilst the
+ * job is queued, `ts`, `waiting`, `quiet`, `attempt`, `running`,
+ * `running_since`, and `cancelled`. These are not updated in the
+ * heap, but are copied from the header when the job is read.
+ */
+struct job {
+	/**
+	 * The job number.
+	 */
+	size_t no;
+
+	/**
+	 * The number of “argv” elements in `payload`.
+	 */
+	int argc;
+
+	/**
+	 * The clock in which `ts` is measured.
+	 */
+	clockid_t clk;
+
+	/**
+	 * The time when the job shall be executed.
+	 */
+	struct timespec ts;
+
+	/**
+	 * The time when the job was queued, in `clk`.
+	 */
+	struct timespec queued;
+
+	/**
+	 * The number of bytes in `payload`.
+	 */
+	size_t n;
+
+	/**
+	 * The offset of the working directory in `payload`,
+	 * that is, the number of bytes in “argv”.
+	 */
+	size_t wdir_off;
+
+	/**
+	 * The offset of “envp” in `payload`.
+	 */
+	size_t envp_off;
+
+	/**
+	 * The number of bytes in the job's script, 0 if it
+	 * has none. A script is read from sat(1)'s stdin and
+	 * stored out of line, see `script_path`, and is
+	 * given to the job's command as its stdin.
+	 */
+	size_t script;
+
+	/**
+	 * How the job recurs when it expires: 0 if it does not,
+	 * 'i' if it recurs every `interval`, 'c' if it recurs
+	 * whenever the wall-clock time matches `calendar`.
+	 * A recurring job is rescheduled in place by satd(1),
+	 * it is only removed by satr(1) and satrm(1), or when
+	 * it has no more occurrences.
+	 */
+	char recur;
+
+	/**
+	 * The time between occurrences, if `recur` is 'i'.
+	 */
+	struct timespec interval;
+
+	/**
+	 * The year, month (1–12), day (1–31), hour, minute, and
+	 * second, in UTC, of the occurrences, if `recur` is 'c';
+	 * -1 for fields that match any value.
+	 */
+	int calendar[6];
+
+	/**
+	 * The jobs in `after` that the job is waiting for, as a
+	 * bitmask, bit `i` is set if it is waiting for `after[i]`.
+	 * The job is held, even if its time has expired, until
+	 * they have all finished.
+	 */
+	int waiting;
+
+	/**
+	 * The numbers of the jobs that the job waits for.
+	 */
+	size_t after[MAX_PREREQUISITES];
+
+	/**
+	 * For each job in `after`, how it must finish: 0 if either
+	 * way, 's' if it must succeed, 'f' if it must fail. If it
+	 * does not, or if it is removed without being run, the
+	 * job is removed too.
+	 */
+	char after_on[MAX_PREREQUISITES];
+
+	/**
+	 * How much pressure, in percent, there may be on the CPU,
+	 * I/O, and memory, in that order, for the job to run, 0 if
+	 * not limited. If any limit is set, the job is deferred,
+	 * once its time has expired, until its limits have not been
+	 * exceeded for a while, see /proc/pressure and `quiet`.
+	 */
+	unsigned char pressure[3];
+
+	/**
+	 * The highest 1-minute load average, multiplied by 100,
+	 * that the job may run at, 0 if not limited. A deferred
+	 * job also waits for the load average to drop below this.
+	 */
+	unsigned int load;
+
+	/**
+	 * Whether the system has been quiet enough, since the job
+	 * expired, for the job to run. It is reset when the job
+	 * is rescheduled.
+	 */
+	char quiet;
+
+	/**
+	 * The job's cpu.weight (1–10000) in its cgroup, 0 if not set.
+	 * If any of the job's cgroup limits are set, the job runs in
+	 * a cgroup of its own, in the cgroup named by SAT_CGROUP in
+	 * its environment, see `HAS_CGROUP`.
+	 */
+	unsigned int cpu_weight;
+
+	/**
+	 * The job's cpu.max quota and period, in microseconds,
+	 * in its cgroup, zeroes if not set.
+	 */
+	unsigned long int cpu_max[2];
+
+	/**
+	 * The job's memory.max, in bytes, in its cgroup, 0 if not set.
+	 */
+	uint64_t memory_max;
+
+	/**
+	 * The job's io.weight (1–10000) in its cgroup, 0 if not set.
+	 */
+	unsigned int io_weight;
+
+	/**
+	 * The CPUs the job may run on, as a mask in the format
+	 * of sched_setaffinity(2), all zeroes if not set.
+	 */
+	unsigned long int cpus[AFFINITY_CPUS / (CHAR_BIT * sizeof(long int))];
+
+	/**
+	 * Whether the job's niceness is set, otherwise
+	 * it inherits the niceness of its queue.
+	 */
+	char renice;
+
+	/**
+	 * The job's niceness (-20–19), if `renice` is set.
+	 */
+	int nice;
+
+	/**
+	 * The job's I/O priority, as given to ioprio_set(2),
+	 * 0 if not set.
+	 */
+	int ioprio;
+
+	/**
+	 * The job's scheduling policy: 0 if not set, 'o' for
+	 * SCHED_OTHER, 'b' for SCHED_BATCH, 'i' for SCHED_IDLE,
+	 * 'f' for SCHED_FIFO, or 'r' for SCHED_RR.
+	 */
+	char policy;
+
+	/**
+	 * The job's real-time priority (1–99), if `policy` is 'f' or 'r'.
+	 */
+	int rtprio;
+
+	/**
+	 * The longest time the job may run, zero if it may run
+	 * for as long as its queue allows. When the job times out,
+	 * it is sent SIGTERM, and, if it has not exited after
+	 * `grace`, SIGKILL.
+	 */
+	struct timespec timeout;
+
+	/**
+	 * The time the job has to exit after SIGTERM
+	 * when it times out, if `timeout` is set.
+	 */
+	struct timespec grace;
+
+	/**
+	 * The maximum number of times the job is run, 0 if it
+	 * is not retried. A job that fails, and has attempts left,
+	 * is rescheduled in place, `retry_delay` after it exited,
+	 * doubled for each failed attempt, and varied by up to
+	 * `jitter` percent.
+	 */
+	unsigned int attempts;
+
+	/**
+	 * The number of times the job has failed.
+	 */
+	unsigned int attempt;
+
+	/**
+	 * The delay before the job is retried the first time.
+	 */
+	struct timespec retry_delay;
+
+	/**
+	 * How much, in percent, the delay before the job
+	 * is retried is randomly varied, up or down.
+	 */
+	unsigned char jitter;
+
+	/**
+	 * The process that runs the job, 0 if it is not running.
+	 * A job that may be retried stays in the queue whilst it
+	 * runs, but it is not run again until it has failed and
+	 * been rescheduled, or until its process has died without
+	 * finishing it, see `is_running`.
+	 */
+	pid_t running;
+
+	/**
+	 * When the process in `running` was started, in clock
+	 * ticks after boot, as in /proc/PID/stat, so that a process
+	 * that has since been given the same PID is not mistaken
+	 * for it, 0 if it is not known.
+	 */
+	unsigned long long int running_since;
+
+	/**
+	 * Whether the job was removed whilst it ran, in which
+	 * case it is not retried, but removed by the process
+	 * that runs it once the attempt has finished.
+	 */
+	char cancelled;
+
+	/**
+	 * What to do when the job's time has expired long ago,
+	 * for example after the computer has been suspended:
+	 * 'r' to run it, and, if it recurs, every occurrence it
+	 * missed, 's' to skip it, or, if it recurs, the occurrence,
+	 * if it is overdue by more than `overdue`, or 'o' to run
+	 * it, but only once rather than for every occurrence it
+	 * missed, if it is overdue by more than `overdue`. 0 is
+	 * 'o' with `overdue` zero: missed occurrences are skipped.
+	 */
+	char stale;
+
+	/**
+	 * How long time after its time has expired the
+	 * job is overdue, see `stale`.
+	 */
+	struct timespec overdue;
+};
+
+
+/**
+ * A queued job with its payload attached, as it is
+ * stored in the payload heap.
+ */
+struct job_full {
+	/**
+	 * The job.
+	 */
+	struct job job;
+
+	/**
+	 * “argv”, followed by the working directory, followed by “envp”.
+	 */
+	char payload[];
+};
+
+
+/**
+ * A queued job's record in the state file. The records
+ * are scanned whenever the queue is, so they only hold
+ * what is needed to find the jobs that shall run, and
+ * where in the payload heap the rest of each job is.
+ */
+struct job_header {
+	/**
+	 * The job number.
+	 */
+	size_t no;
+
+	/**
+	 * The clock in which `ts` is measured.
+	 */
+	clockid_t clk;
+
+	/**
+	 * The time when the job shall be executed.
+	 */
+	struct timespec ts;
+
+	/**
+	 * The offset of the job, as a `struct job_full`,
+	 * in the payload heap.
+	 */
+	size_t heap_off;
+
+	/**
+	 * The number of bytes of the job in the payload heap,
+	 * that is, the size of its `struct job_full`.
+	 */
+	size_t size;
+
+	/**
+	 * See `struct job`.
+	 */
+	pid_t running;
+
+	/**
+	 * See `struct job`.
+	 */
+	unsigned long long int running_since;
+
+	/**
+	 * See `struct job`.
+	 */
+	unsigned int attempt;
+
+	/**
+	 * See `struct job`.
+	 */
+	unsigned char waiting;
+
+	/**
+	 * See `struct job`.
+	 */
+	char quiet;
+
+	/**
+	 * See `struct job`.
+	 */
+	char cancelled;
+
+	/**
+	 * See `struct job`.
+	 */
+	char recur;
+
+	/**
+	 * See `struct job`.
+	 */
+	char stale;
+
+	/**
+	 * Whether the job waits, when its time has expired, until
+	 * the system is quiet enough, see `HAS_LIMITS`.
+	 */
+	char deferred;
+
+	/**
+	 * Whether the job may be retried, that is,
+	 * whether its `attempts` is set.
+	 */
+	char retries;
+};
+
+
+/**
+ * A launch-rate limit, enforced with a token bucket.
+ */
+struct launch_rate {
+	/**
+	 * The number of jobs that may be started
+	 * per second, 0 if unlimited.
+	 */
+	double rate;
+
+	/**
+	 * The number of jobs that may be started at
+	 * once, after none have been started for a while.
+	 */
+	double burst;
+};
+
+
+/**
+ * Information about a run of a job.
+ * 
+ * All times are measured in the job's clock.
+ */
+struct run {
+	/**
+	 * When `remove_job` started to process the job.
+	 */
+	struct timespec fired;
+
+	/**
+	 * When the job's command was executed.
+	 */
+	struct timespec spawned;
+
+	/**
+	 * When the job's process exited.
+	 */
+	struct timespec exited;
+
+	/**
+	 * The status returned by wait4(3).
+	 */
+	int status;
+
+	/**
+	 * The resource usage returned by wait4(3).
+	 */
+	struct rusage usage;
+
+	/**
+	 * File descriptor for the job's script, -1 if none.
+	 */
+	int script;
+
+	/**
+	 * The CPU time, in microseconds, used by the job, and,
+	 * if it ran in a cgroup, by all processes in the cgroup.
+	 */
+	uint64_t cpu_usage;
+
+	/**
+	 * The peak memory usage, in bytes, of the job, or,
+	 * if it ran in a cgroup, of the cgroup.
+	 */
+	uint64_t memory_peak;
+
+	/**
+	 * 0 if the job did not time out, 't' if it was sent
+	 * SIGTERM because it timed out, 'k' if it was also
+	 * sent SIGKILL.
+	 */
+	char timed_out;
+};
+
+
+/**
+ * An entry in the history journal.
+ * 
+ * All times are measured in the job's clock.
+ */
+struct history {
+	/**
+	 * The job number.
+	 */
+	size_t no;
+
+	/**
+	 * The job's clock.
+	 */
+	clockid_t clk;
+
+	/**
+	 * The status returned by wait4(3), 0 if not started.
+	 */
+	int status;
+
+	/**
+	 * When the job was scheduled to run.
+	 */
+	struct timespec scheduled;
+
+	/**
+	 * When the job's command was executed, zero if not started.
+	 */
+	struct timespec spawned;
+
+	/**
+	 * When the job's process exited, zero if not started.
+	 */
+	struct timespec exited;
+
+	/**
+	 * The job's user CPU time.
+	 */
+	struct timeval utime;
+
+	/**
+	 * The job's system CPU time.
+	 */
+	struct timeval stime;
+
+	/**
+	 * The job's maximum resident set size, in kilobytes.
+	 */
+	long int maxrss;
+
+	/**
+	 * The job's `argv[0]`, truncated and NUL-terminated.
+	 */
+	char argv0[64];
+};
 
 
 /**
- * A queued job.
+ * The header of the state file, the jobs' headers follow
+ * directly, as a dense array of `struct job_header`:s. The
+ * jobs are stored, in the same order, in the payload heap,
+ * which is the file “heap” next to the state file.
+ * 
+ * Per-clock arrays are indexed by `CLOCK_INDEX`.
  */
-struct job {
+struct state_header {
+	/**
+	 * `STATE_MAGIC`, identifies the file as a state file.
+	 */
+	char magic[4];
+
+	/**
+	 * `STATE_VERSION`, the version of the file's format.
+	 */
+	unsigned int version;
+
+	/**
+	 * The number of the most recently queued job.
+	 */
+	size_t no;
+
+	/**
+	 * The number of queued jobs.
+	 */
+	size_t jobs[2];
+
+	/**
+	 * The earliest expiration time of any queued job,
+	 * unspecified if there are not jobs.
+	 */
+	struct timespec earliest[2];
+
+	/**
+	 * The latest expiration time of any queued job,
+	 * unspecified if there are not jobs.
+	 */
+	struct timespec latest[2];
+
+	/**
+	 * The sum of `size` for all queued jobs.
+	 */
+	size_t payload;
+
+	/**
+	 * The number of bytes in the payload heap
+	 * that belong to removed jobs.
+	 */
+	size_t garbage;
+};
+
+
+/**
+ * The header of the event log, the entries follow
+ * directly as a ring of `EVENTS_MAX` `struct event`:s,
+ * see `EVENT_OFFSET`.
+ */
+struct event_log {
+	/**
+	 * The sequence number of the next event, that
+	 * is, the number of events that have been logged.
+	 */
+	size_t seq;
+};
+
+
+/**
+ * An entry in the event log.
+ */
+struct event {
+	/**
+	 * The event's sequence number, a reader that falls more than
+	 * `EVENTS_MAX` events behind detects the gap by it.
+	 */
+	size_t seq;
+
 	/**
 	 * The job number.
 	 */
 	size_t no;
 
 	/**
-	 * The number of “argv” elements in `payload`.
+	 * When the event occurred, in `CLOCK_REALTIME`.
 	 */
-	int argc;
+	struct timespec when;
 
 	/**
-	 * The clock in which `ts` is measured.
+	 * The action, as passed to the hook script, or
+	 * "started" when the job itself is started, or
+	 * "released" when the jobs it waited for have finished, or
+	 * "quiet" when the system has become quiet enough for it, or
+	 * "retry" when it has failed and been rescheduled, or
+	 * "cancelled" when it has been removed whilst it ran.
+	 * NUL-padded, and always NUL-terminated.
 	 */
-	clockid_t clk;
+	char action[16];
+};
+
 
+/**
+ * An entry in the workload trace, recorded when
+ * `$XDG_RUNTIME_DIR/sat/trace` exists.
+ */
+struct trace {
 	/**
-	 * The time when the job shall be executed.
+	 * When the operation was performed, in `CLOCK_REALTIME`.
 	 */
-	struct timespec ts;
+	struct timespec when;
 
 	/**
-	 * The number of bytes in `payload`.
+	 * How long time was left, when the operation was
+	 * performed, until the job expires, measured in
+	 * the job's clock. Negative if it had expired.
+	 * Zero for listings.
+	 */
+	struct timespec left;
+
+	/**
+	 * The job number, zero for listings.
+	 */
+	size_t no;
+
+	/**
+	 * The size of the job's payload, or for
+	 * listings, the number of listed jobs.
 	 */
 	size_t n;
 
 	/**
-	 * “argv” followed by “envp”.
+	 * The job's clock, `CLOCK_REALTIME` for listings.
 	 */
-	char payload[];
+	clockid_t clk;
+
+	/**
+	 * The operation: 'q' if the job was queued,
+	 * 'r' if removed, 'f' if forced to run,
+	 * 'e' if run because it expired, 's' if
+	 * skipped because it was overdue, and 'l'
+	 * if the queue was listed.
+	 */
+	char op;
 };
 
 
 
+/**
+ * Get the index of a clock in the per-clock arrays
+ * in `struct state_header`.
+ * 
+ * @param   CLK:clockid_t  `CLOCK_REALTIME` or `CLOCK_BOOTTIME`.
+ * @return                 0 for `CLOCK_REALTIME`, 1 for `CLOCK_BOOTTIME`.
+ */
+#define CLOCK_INDEX(CLK)  ((CLK) == CLOCK_BOOTTIME)
+
+/**
+ * Get the offset of an event in the event log.
+ * 
+ * @param   SEQ:size_t  The event's sequence number.
+ * @return  :size_t     The offset of the slot the event is stored in.
+ */
+#define EVENT_OFFSET(SEQ)  (sizeof(struct event_log) + (SEQ) % EVENTS_MAX * sizeof(struct event))
+
+/**
+ * Get the size of a job, with its payload, see `struct job_full`.
+ * 
+ * @param   N:size_t  The number of bytes in the job's payload.
+ * @return  :size_t   The number of bytes the job occupies in the payload heap.
+ */
+#define JOB_SIZE(N)  (offsetof(struct job_full, payload) + (N))
+
+/**
+ * Initialiser for the names of the resources in
+ * /proc/pressure, in the order of `struct job.pressure`.
+ */
+#define PRESSURE_RESOURCES  {"cpu", "io", "memory"}
+
+/**
+ * Check whether a job has any limit on how busy the system may be
+ * for it to run, in which case it is deferred, once its time has
+ * expired, until the system is quiet enough.
+ * 
+ * @param   JOB:const struct job *  The job.
+ * @return                          Non-zero if the job has any limit.
+ */
+#define HAS_LIMITS(JOB)  \
+	((JOB)->load || (JOB)->pressure[0] || (JOB)->pressure[1] || (JOB)->pressure[2])
+
+/**
+ * Check whether a job, if its time has expired,
+ * is deferred until the system is quiet enough.
+ * 
+ * @param   JOB:const struct job_header *  The job's header.
+ * @return                                 Non-zero if the job is deferred.
+ */
+#define IS_DEFERRED(JOB)  (!(JOB)->quiet && (JOB)->deferred)
+
+/**
+ * Check whether a job runs in a cgroup of its own.
+ * 
+ * @param   JOB:const struct job *  The job.
+ * @return                          Non-zero if the job has any cgroup limit.
+ */
+#define HAS_CGROUP(JOB)  \
+	((JOB)->cpu_weight || (JOB)->cpu_max[0] || (JOB)->memory_max || (JOB)->io_weight)
+
+/**
+ * Check whether a job has a CPU affinity.
+ * 
+ * @param   JOB:const struct job *  The job.
+ * @return                          Non-zero if any of the job's CPUs are set.
+ */
+#define HAS_AFFINITY(JOB)  \
+	(memcmp((JOB)->cpus, (unsigned long int [sizeof((JOB)->cpus) / sizeof(long int)]){0}, sizeof((JOB)->cpus)))
+
 /**
  * `dup2(OLD, NEW)` and, on success, `close(OLD)`.
  * 
@@ -188,12 +943,30 @@ do {  \
 			usage();  \
 } while (0)
 
+/**
+ * Select the queue, and remove it from the command
+ * line, if the first argument is -q.
+ */
+#define QUEUE_OPTION  \
+do {  \
+	if ((argc > 2) && !strcmp(argv[1], "-q")) {  \
+		if (set_queue(argv[2])) {  \
+			if (errno != EINVAL)  \
+				perror(argv0), exit(1);  \
+			fprintf(stderr, "%s: invalid queue name: %s\n", argv0, argv[2]);  \
+			exit(2);  \
+		}  \
+		argv[2] = argv[0], argv += 2, argc -= 2;  \
+	}  \
+} while (0)
+
 /**
  * Macro to put directly after the variable definitions in `main`.
  */
 #define PROLOGUE(USAGE_ASSUMPTION, ACCESS)  \
 	int state = -1;                     \
 	if (argc > 0)  argv0 = argv[0];     \
+	QUEUE_OPTION;                       \
 	if (!(USAGE_ASSUMPTION))  usage();  \
 	GET_FD(state, STATE_FILENO, open_state(ACCESS, NULL))
 
@@ -237,30 +1010,26 @@ ssize_t preadn(int fildes, void *buf, size_t nbyte, size_t offset);
 ssize_t pwriten(int fildes, const void *buf, size_t nbyte, size_t offset);
 
 /**
- * Unmarshal a `NULL`-terminated string array.
- * 
- * The elements are not actually copied, subpointers
- * to `buf` are stored in the returned list.
+ * Unmarshal a job's command line and environment.
  * 
- * @param   buf  The marshalled array. Must end with a NUL byte.
- * @param   len  The length of `buf`.
- * @param   n    Output parameter for the number of elements. May be `NULL`
- * @return       The list, `NULL` on error.
- * 
- * @throws  Any exception specified for realloc(3).
- */
-char **restore_array(char *buf, size_t len, size_t *n);
-
-/**
- * Create `NULL`-terminate subcopy of an list,
+ * The elements are not actually copied, subpointers to
+ * `full->payload` are stored in the returned list. Both
+ * lists are stored in the same allocation, so only the
+ * returned list shall be freed.
  * 
- * @param   list  The list.
- * @param   n     The number of elements in the new sublist.
- * @return        The sublist, `NULL` on error.
+ * @param   full   The job, with its payload.
+ * @param   skip   The number of unset elements to reserve
+ *                 before the command line.
+ * @param   extra  The number of elements to reserve after
+ *                 the environment's `NULL`-terminator.
+ * @param   envp   Output parameter for the environment, whose
+ *                 first element is the working directory.
+ * @return         The command line, preceded by `skip` unset
+ *                 elements, `NULL` on error.
  * 
  * @throws  Any exception specified for malloc(3).
  */
-char **sublist(char *const *list, size_t n);
+char **restore_job(struct job_full *full, size_t skip, size_t extra, char ***envp);
 
 /**
  * Create a new open file descriptor for an already
@@ -273,20 +1042,330 @@ char **sublist(char *const *list, size_t n);
  */
 int reopen(int fd, int oflag);
 
+/**
+ * Select the queue, by setting SAT_QUEUE, so that it is
+ * inherited by satd(1) if it is started.
+ * 
+ * @param   name  The name of the queue, "default" for
+ *                the queue that is used if none is selected.
+ * @return        0 on success, -1 on error.
+ * 
+ * @throws  EINVAL  `name` is not a valid queue name.
+ * @throws          Any exception specified for setenv(3).
+ */
+int set_queue(const char *name);
+
+/**
+ * Get the pathname of a file in the runtime directory.
+ * 
+ * Each queue, except the default queue, has a runtime
+ * directory of its own, “queues/$SAT_QUEUE” in the
+ * default queue's runtime directory.
+ * 
+ * @param   name  The basename of the file.
+ * @return        The pathname, `NULL` on error.
+ * 
+ * @throws  EINVAL  SAT_QUEUE is not a valid queue name.
+ * @throws          Any exception specified for malloc(3).
+ */
+char *runtime_path(const char *name);
+
+/**
+ * Read the selected queue's settings from the file
+ * named by SAT_QUEUES_PATH, if it exists.
+ * 
+ * Each line in the file is a queue name, followed by the
+ * maximum number of the queue's jobs that may run at the
+ * same time, and optionally by the niceness the queue's
+ * jobs shall run with, and by the timeout, in seconds, of
+ * the queue's jobs, optionally followed by "/" and the grace
+ * period, in seconds, (0 for no timeout,) and by the number
+ * of jobs that may be started per second, optionally followed
+ * by "/" and the number that may be started at once, separated
+ * by blank space. A line whose queue name is "*" is instead
+ * followed only by the latter, and limits the jobs of all
+ * queues together. `#` starts a comment.
+ * 
+ * @param   limit     Output parameter for the maximum number of
+ *                    concurrently running jobs, 1 if not specified.
+ * @param   priority  Output parameter for the niceness, 0 if not
+ *                    specified.
+ * @param   timeout   Output parameter for the timeout, zero if not
+ *                    specified, and the grace period, `TIMEOUT_GRACE`
+ *                    seconds if not specified. May be `NULL`.
+ * @param   rate      Output parameter for the queue's launch-rate
+ *                    limit, and the limit for all queues, unlimited
+ *                    if not specified, the burst is 1 if not specified.
+ *                    May be `NULL`.
+ * @return            0 on success, -1 on error, in which case
+ *                    the defaults are stored.
+ * 
+ * @throws  EINVAL  The queue's entry is malformated.
+ * @throws          Any exception specified for fopen(3) and getline(3).
+ */
+int get_queue_settings(size_t *limit, int *priority, struct timespec timeout[2], struct launch_rate rate[2]);
+
+/**
+ * Get the pathname of a job's script.
+ * 
+ * @param   no  The job number.
+ * @return      The pathname, `NULL` on error.
+ * 
+ * @throws  Any exception specified for malloc(3).
+ */
+char *script_path(size_t no);
+
+/**
+ * Add an entry to the event log.
+ * 
+ * The caller should be holding the state file's lock
+ * so that events are logged in the correct order.
+ * 
+ * @param   no      The job number.
+ * @param   action  The action, see `struct event`.
+ * @return          0 on success, -1 on error.
+ */
+int log_event(size_t no, const char *action);
+
+/**
+ * Add an entry to the workload trace, if tracing is enabled.
+ * 
+ * The caller should be holding the state file's lock
+ * so that operations are traced in the correct order.
+ * 
+ * @param   op   The operation, see `struct trace`.
+ * @param   job  The job, `NULL` for listings.
+ * @param   n    The number of listed jobs, ignored unless `job` is `NULL`.
+ * @return       0 on success, -1 on error.
+ */
+int log_trace(char op, const struct job *job, size_t n);
+
+/**
+ * Add an entry to the history journal.
+ * 
+ * The caller must be holding the state file's
+ * exclusive lock, as the journal may be rotated.
+ * 
+ * @param   full  The job, with its payload.
+ * @param   run   Information about the job's run.
+ * @return        0 on success, -1 on error.
+ */
+int log_history(const struct job_full *full, const struct run *run);
+
+/**
+ * Apply a job's CPU affinity, niceness, I/O priority,
+ * and scheduling policy to the calling process.
+ * 
+ * This is done in the job's process before it is
+ * executed, and by sat(1), in a child process, to
+ * check that the job can be run as requested.
+ * 
+ * @param   job  The job.
+ * @return       0 on success, -1 on error.
+ */
+int apply_attributes(const struct job *job);
+
 /**
  * Run a job or a hook.
  * 
- * @param   job   The job.
+ * @param   full  The job, with its payload.
  * @param   hook  The hook, `NULL` to run the job.
+ * @param   run   If `hook` is `NULL`: output parameter for information
+ *                about the run, `fired` is not modified. Otherwise:
+ *                information about the run to pass to the hook, via
+ *                the environment. May be `NULL`.
  * @return        0 on success, -1 on error, 1 if the child failed.
  */
-int run_job_or_hook(struct job *job, const char *hook);
+int run_job_or_hook(struct job_full *full, const char *hook, struct run *run);
+
+/**
+ * Read the state file's header.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   header  Output parameter for the header. If the state
+ *                  file is new, it will be filled with zeroes.
+ * @return          1 if the file has a header, 0 if it is new, -1 on error.
+ */
+int read_header(struct state_header *header);
+
+/**
+ * Write the state file's header.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   header  The header.
+ * @return          0 on success, -1 on error.
+ */
+int write_header(const struct state_header *header);
+
+/**
+ * Lock the state file, and record how long we had to wait.
+ * 
+ * @param   operation  `LOCK_SH` or `LOCK_EX`.
+ * @return             0 on success, -1 on error.
+ */
+int lock_state(int operation);
+
+/**
+ * Account for a job in the state file's header.
+ * 
+ * @param  header  The header.
+ * @param  job     The header of the job that has been queued.
+ */
+void header_add_job(struct state_header *header, const struct job_header *job);
+
+/**
+ * Open the payload heap.
+ * 
+ * @param   open_flags  Flags (the second parameter) for `open`.
+ * @return              A file descriptor to the payload heap, -1 on error.
+ */
+int open_heap(int open_flags);
+
+/**
+ * Create the header of a job that is being queued.
+ * 
+ * @param  job       The job.
+ * @param  heap_off  The offset of the job in the payload heap.
+ * @param  header    Output parameter for the job's header.
+ */
+void make_job_header(const struct job *job, size_t heap_off, struct job_header *header);
+
+/**
+ * Append a job to the payload heap, and its header to the state file.
+ * 
+ * The caller must be holding the state file's exclusive
+ * lock, and shall write the header afterwards.
+ * 
+ * @param   header  The state file's header, will be updated.
+ * @param   full    The job, with its payload.
+ * @return          0 on success, -1 on error.
+ */
+int add_job(struct state_header *header, const struct job_full *full);
+
+/**
+ * Read a job, without its payload, from the payload heap.
+ * 
+ * @param   heap    The payload heap.
+ * @param   header  The job's header.
+ * @param   job     Output parameter for the job, with the
+ *                  fields that are kept in `header` copied.
+ * @return          0 on success, -1 on error.
+ */
+int read_job(int heap, const struct job_header *header, struct job *job);
+
+/**
+ * Timespec comparison.
+ * 
+ * @param   a  The left-hand operand.
+ * @param   b  The right-hand operand.
+ * @return     -1 if `a` is earlier, +1 if `b` is earlier, 0 if equal.
+ */
+#ifdef __GNUC__
+__attribute__((__pure__))
+#endif
+static inline int
+timecmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec  != b->tv_sec)   return (a->tv_sec  < b->tv_sec  ? -1 : +1);
+	if (a->tv_nsec != b->tv_nsec)  return (a->tv_nsec < b->tv_nsec ? -1 : +1);
+	return 0;
+}
+
+/**
+ * Check whether a job is queued.
+ * 
+ * The caller must be holding the state file's lock.
+ * 
+ * @param   no  The job number.
+ * @return      1 if the job is queued, 0 if it is not, -1 on error.
+ */
+int is_queued(size_t no);
+
+/**
+ * Let a deferred job run, now that the system is quiet enough.
+ * 
+ * @param   no  The job number.
+ * @return      0 on success, even if the job is not queued, -1 on error.
+ */
+int mark_quiet(size_t no);
+
+/**
+ * Calculate when a recurring job shall run next.
+ * 
+ * Occurrences are calculated from the job's expiration
+ * time, rather than from when it ran, so that they do not
+ * drift. Occurrences that have already passed are skipped.
+ * 
+ * @param   job   The job, `ts` is the time of the occurrence that expired.
+ * @param   now   The current time, in the job's clock.
+ * @param   next  Output parameter for the next occurrence.
+ * @return        0 on success, -1 if the job has no more occurrences.
+ */
+int next_occurrence(const struct job *job, const struct timespec *now, struct timespec *next);
+
+/**
+ * Check whether a job is overdue by more than
+ * its `overdue`, see `struct job`'s `stale`.
+ * 
+ * @param   job  The job.
+ * @param   now  The current time, in the job's clock.
+ * @return       1 if the job is overdue, 0 otherwise.
+ */
+int is_overdue(const struct job *job, const struct timespec *now);
+
+/**
+ * Check whether a job is running, that is, whether
+ * it is marked as running by a process that is alive.
+ * A job whose process was killed, or crashed, whilst
+ * it ran is not, so that it is run again.
+ * 
+ * @param   running  The job's `running`.
+ * @param   since    The job's `running_since`.
+ * @return           1 if the job is running, 0 otherwise.
+ */
+int is_running(pid_t running, unsigned long long int since);
+
+/**
+ * Check whether a job is running, see `is_running`.
+ * 
+ * @param   JOB:const struct job *         The job, or
+ *          JOB:const struct job_header *  its header.
+ * @return                                 1 if the job is running, 0 otherwise.
+ */
+#define IS_RUNNING(JOB)  is_running((JOB)->running, (JOB)->running_since)
+
+/**
+ * Enter low-latency mode, if the daemon runs in it,
+ * that is, if satd(1) was started with -l: the process's
+ * memory is locked, so that it is never paged out, and it
+ * is run with a real-time scheduling policy. The policy
+ * is reset in child processes, so jobs and hooks run
+ * with the normal policy.
+ * 
+ * @return  How long time, in nanoseconds, to spin, rather than
+ *          sleep, before a job expires, 0 if the daemon does not
+ *          run in low-latency mode, -1 on error.
+ */
+long int low_latency(void);
+
+/**
+ * Let `remove_job` unlock the queue whilst the job runs,
+ * because the process holds one of the queue's slots.
+ */
+void hold_slot(void);
 
 /**
  * Removes (and optionally runs) a job.
  * 
  * @param   jobno   The job number, `NULL` for any job.
- * @param   runjob  Shall we run the job too? 2 if its time has expired (not forced).
+ * @param   runjob  Shall we run the job too? 2 if its time has expired (not forced),
+ *                  in which case a recurring job is rescheduled rather than removed,
+ *                  and a job that fails is rescheduled if it has attempts left.
+ *                  3 if its time has expired, but it is skipped because it is
+ *                  overdue, in which case it is not run, but a recurring job
+ *                  is still rescheduled.
  * @return          0 on success, -1 on error.
  * 
  * @throws  0  The job is not in the queue.
@@ -296,9 +1375,30 @@ int remove_job(const char *jobno, int runjob);
 /**
  * Get a `NULL`-terminated list of all queued jobs.
  * 
+ * The list and the jobs are stored in the same
+ * allocation, so only the list shall be freed.
+ * 
  * @return  A `NULL`-terminated list of all queued jobs. `NULL` on error.
  */
-struct job **get_jobs(void);
+struct job_full **get_jobs(void);
+
+/**
+ * Get the headers of all queued jobs.
+ * 
+ * @param   n  Output parameter for the number of jobs.
+ * @return     The jobs' headers, `NULL` on error.
+ */
+struct job_header *get_job_headers(size_t *n);
+
+/**
+ * Get a queued job, without its payload.
+ * 
+ * @param   no   The job number.
+ * @param   job  Output parameter for the job.
+ * @return       1 if the job was found, 0 if it is
+ *               no longer queued, -1 on error.
+ */
+int get_job(size_t no, struct job *job);
 
 /**
  * Duplicate a file descriptor, and
@@ -341,6 +1441,27 @@ int poke_daemon(int start, const char *name);
  */
 int set_hookpath(void);
 
+/**
+ * Set SAT_QUEUES_PATH.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int set_queuespath(void);
+
+
+
+/**
+ * When compiled with VIRTUAL_CLOCK=1, the clocks that jobs
+ * are measured in are replaced with a simulated clock, that
+ * the daemon advances instantly to the next expiration,
+ * see virtual_clock.h. `CLOCK_MONOTONIC` is not affected.
+ */
+#ifdef VIRTUAL_CLOCK
+int virtual_clock_gettime(clockid_t clk, struct timespec *ts);
+int virtual_timerfd_settime(int fd, int flags, const struct itimerspec *new, struct itimerspec *old);
+# define clock_gettime(clk, ts)  virtual_clock_gettime(clk, ts)
+# define timerfd_settime(fd, flags, new, old)  virtual_timerfd_settime(fd, flags, new, old)
+#endif
 
 
 /**
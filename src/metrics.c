@@ -0,0 +1,244 @@
+/**
+ * Copyright © 2015, 2016  Mattias Andrée <maandree@member.fsf.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "common.h"
+#include "metrics.h"
+#include <sys/mman.h>
+
+
+
+/**
+ * Atomically add to a value in the metrics file.
+ * 
+ * @param  P:uint64_t *  The value.
+ * @param  V:uint64_t    The addend.
+ */
+#ifdef __GNUC__
+# define ADD(P, V)  ((void) __atomic_fetch_add(P, V, __ATOMIC_RELAXED))
+#else
+# define ADD(P, V)  ((void)(*(P) += (V)))
+#endif
+
+/**
+ * Atomically set a value in the metrics file.
+ * 
+ * @param  P:uint64_t *  The value.
+ * @param  V:uint64_t    The new value.
+ */
+#ifdef __GNUC__
+# define SET(P, V)  __atomic_store_n(P, V, __ATOMIC_RELAXED)
+#else
+# define SET(P, V)  ((void)(*(P) = (V)))
+#endif
+
+
+
+/**
+ * The mapped metrics file, `NULL` if not mapped yet.
+ */
+static struct metrics *metrics = NULL;
+
+/**
+ * Have we tried to map the metrics file?
+ */
+static int metrics_tried = 0;
+
+
+
+/**
+ * Map the metrics file to memory.
+ * 
+ * @param   prot  The protection of the mapping, see mmap(3).
+ * @return        The metrics, `NULL` if the file does not exist,
+ *                is of another version, or on error.
+ */
+static struct metrics *
+metrics_map(int prot)
+{
+	struct metrics *rc = NULL;
+	char *path = NULL;
+	struct stat attr;
+	void *map;
+	int fd = -1, saved_errno = errno;
+
+	t (!(path = runtime_path("metrics")));
+	t (fd = open(path, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY), fd == -1);
+	t (fstat(fd, &attr));
+	t (attr.st_size < (off_t)sizeof(*rc));
+	t (map = mmap(NULL, sizeof(*rc), prot, MAP_SHARED, fd, (off_t)0), map == MAP_FAILED);
+	if (((struct metrics *)map)->version != METRICS_VERSION)
+		munmap(map, sizeof(*rc));
+	else
+		rc = map;
+fail:
+	close(fd), free(path);
+	errno = saved_errno; /* Failure isn't fatal, and it should not be reported. */
+	return rc;
+}
+
+
+/**
+ * Create the metrics file, unless it already exists
+ * and is up to date.
+ * 
+ * The file is written under a temporary name and
+ * renamed into place, rather than truncated, because
+ * other processes may have the old file mapped.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int
+metrics_create(void)
+{
+	char *path = NULL, *tmp = NULL;
+	struct metrics m;
+	ssize_t r;
+	int fd = -1, saved_errno;
+
+	t (!(path = runtime_path("metrics")));
+	fd = open(path, O_RDONLY);
+	t ((fd == -1) && (errno != ENOENT));
+	if (fd >= 0) {
+		t (r = preadn(fd, &m, sizeof(m), (size_t)0), r < 0);
+		close(fd), fd = -1;
+		if ((r == (ssize_t)sizeof(m)) && (m.version == METRICS_VERSION))
+			goto done; /* Keep the counters if we are restarted. */
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.version = METRICS_VERSION;
+	t (!(tmp = malloc(strlen(path) + sizeof(".") + 3 * sizeof(pid_t))));
+	sprintf(tmp, "%s.%ji", path, (intmax_t)getpid());
+	t (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR), fd == -1);
+	t (pwriten(fd, &m, sizeof(m), (size_t)0) < (ssize_t)sizeof(m));
+	t (rename(tmp, path));
+	close(fd), fd = -1;
+done:
+	free(tmp);
+	free(path);
+	return 0;
+fail:
+	S(close(fd), tmp ? unlink(tmp) : 0, free(tmp), free(path));
+	return -1;
+}
+
+
+/**
+ * Map the metrics file to memory.
+ * 
+ * @return  The metrics, `NULL` if the file does not exist,
+ *          is of another version, or on error.
+ */
+struct metrics *
+metrics_get(void)
+{
+	if (!metrics_tried) {
+		metrics_tried = 1;
+		metrics = metrics_map(PROT_READ | PROT_WRITE);
+	}
+	return metrics;
+}
+
+
+/**
+ * Read the metrics file.
+ * 
+ * The file is mapped read-only, only for the copy,
+ * so that the reader cannot modify the metrics.
+ * 
+ * @param   m  Output parameter for the metrics.
+ * @return     0 on success, -1 if the file does not
+ *             exist, is of another version, or on error.
+ */
+int
+metrics_read(struct metrics *m)
+{
+	struct metrics *map = metrics_map(PROT_READ);
+	if (!map)
+		return -1;
+	*m = *map; /* It does not matter that the copy is not atomic. */
+	munmap(map, sizeof(*map));
+	return 0;
+}
+
+
+/**
+ * Record a duration.
+ * 
+ * Nothing happens if the metrics file is not available.
+ * 
+ * @param  histogram  `METRIC(histogram)`.
+ * @param  start      The start of the duration.
+ * @param  end        The end of the duration, `NULL` for
+ *                    the current time in `CLOCK_MONOTONIC`.
+ */
+void
+metrics_record(size_t histogram, const struct timespec *start, const struct timespec *end)
+{
+	struct histogram *h;
+	struct timespec now;
+	uint64_t ns, us;
+	size_t i;
+
+	if (!metrics_get())
+		return;
+	if (!end) {
+		if (clock_gettime(CLOCK_MONOTONIC, &now))
+			return;
+		end = &now;
+	}
+	if (timecmp(end, start) < 0)
+		return;
+
+	ns  = (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL;
+	ns += (uint64_t)(end->tv_nsec + 1000000000L - start->tv_nsec);
+	ns -= 1000000000ULL;
+	for (us = ns / 1000, i = 0; us && (i < HISTOGRAM_BUCKETS - 1); us >>= 1, i++);
+
+	h = (struct histogram *)((char *)metrics + histogram);
+	ADD(&(h->count), 1);
+	ADD(&(h->sum), ns);
+	ADD(h->buckets + i, 1);
+}
+
+
+/**
+ * Add a value to a counter, or set a gauge.
+ * 
+ * Nothing happens if the metrics file is not available.
+ * 
+ * @param  counter  `METRIC(counter)`.
+ * @param  value    The value to add or set.
+ * @param  set      Set rather than add?
+ */
+void
+metrics_count(size_t counter, uint64_t value, int set)
+{
+	uint64_t *p;
+	if (!metrics_get())
+		return;
+	p = (uint64_t *)((char *)metrics + counter);
+	if (set)
+		SET(p, value);
+	else
+		ADD(p, value);
+}
+
@@ -0,0 +1,213 @@
+/**
+ * Copyright © 2015, 2016  Mattias Andrée <maandree@member.fsf.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+
+/**
+ * The version of `struct metrics`, increase when
+ * the structure is changed.
+ */
+#define METRICS_VERSION  4
+
+/**
+ * The number of buckets in a histogram.
+ */
+#define HISTOGRAM_BUCKETS  32
+
+/**
+ * Get the argument for `metrics_record` or `metrics_count`
+ * that selects a metric.
+ * 
+ * @param  NAME  The name of the member in `struct metrics`,
+ *               with an index if it is a per-clock array.
+ */
+#define METRIC(NAME)  offsetof(struct metrics, NAME)
+
+
+
+/**
+ * A histogram of durations.
+ * 
+ * Bucket 0 counts durations shorter than one microsecond,
+ * bucket i (0 < i < HISTOGRAM_BUCKETS - 1) counts durations
+ * of at least 2↑(i - 1) but less than 2↑i microseconds, and
+ * the last bucket counts all longer durations.
+ */
+struct histogram {
+	/**
+	 * The number of recorded durations.
+	 */
+	uint64_t count;
+
+	/**
+	 * The sum of all recorded durations, in nanoseconds.
+	 */
+	uint64_t sum;
+
+	/**
+	 * The number of durations per bucket.
+	 */
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+
+/**
+ * The daemon's metrics. This is stored in a file in the
+ * runtime directory which is mapped to the memory of all
+ * processes that update it. It is only updated with atomic
+ * operations, so it can be read without any locking.
+ * 
+ * Per-clock arrays are indexed by `CLOCK_INDEX`.
+ */
+struct metrics {
+	/**
+	 * Should be `METRICS_VERSION`.
+	 */
+	uint64_t version;
+
+	/**
+	 * The time between a job's expiration and its
+	 * command being executed. Not recorded for
+	 * jobs run before their time.
+	 */
+	struct histogram lateness;
+
+	/**
+	 * The time between a job's expiration and
+	 * the daemon starting to run it, that is,
+	 * `lateness` without the time it takes to
+	 * run the hook and spawn the job.
+	 */
+	struct histogram dispatch;
+
+	/**
+	 * The time between forking and `exec`:ing,
+	 * for jobs and hooks.
+	 */
+	struct histogram spawn;
+
+	/**
+	 * The time it took to run the hook script.
+	 */
+	struct histogram hook;
+
+	/**
+	 * The time the jobs' commands ran.
+	 */
+	struct histogram runtime;
+
+	/**
+	 * The time spent waiting for the state file's lock.
+	 */
+	struct histogram lock_wait;
+
+	/**
+	 * The number of times the daemon has been woken
+	 * up by an expired timer.
+	 */
+	uint64_t wakeups[2];
+
+	/**
+	 * The number of queued jobs, as of the last change.
+	 */
+	uint64_t depth[2];
+
+	/**
+	 * The number of jobs that have been sent
+	 * SIGTERM because they timed out.
+	 */
+	uint64_t terminated;
+
+	/**
+	 * The number of jobs that have been sent SIGKILL
+	 * because they had not exited after the grace
+	 * period when they timed out.
+	 */
+	uint64_t killed;
+
+	/**
+	 * The number of times an expired job has been
+	 * held back by a launch-rate limit.
+	 */
+	uint64_t throttled;
+
+	/**
+	 * The number of jobs, or occurrences of recurring
+	 * jobs, that have been skipped because they were
+	 * overdue.
+	 */
+	uint64_t skipped;
+};
+
+
+
+/**
+ * Create the metrics file, unless it already exists
+ * and is up to date.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int metrics_create(void);
+
+/**
+ * Map the metrics file to memory.
+ * 
+ * @return  The metrics, `NULL` if the file does not exist,
+ *          is of another version, or on error.
+ */
+struct metrics *metrics_get(void);
+
+/**
+ * Read the metrics file, without mapping it writable.
+ * 
+ * @param   m  Output parameter for the metrics.
+ * @return     0 on success, -1 if the file does not
+ *             exist, is of another version, or on error.
+ */
+int metrics_read(struct metrics *m);
+
+/**
+ * Record a duration.
+ * 
+ * Nothing happens if the metrics file is not available.
+ * 
+ * @param  histogram  `METRIC(histogram)`.
+ * @param  start      The start of the duration.
+ * @param  end        The end of the duration, `NULL` for
+ *                    the current time in `CLOCK_MONOTONIC`.
+ */
+void metrics_record(size_t histogram, const struct timespec *start, const struct timespec *end);
+
+/**
+ * Add a value to a counter, or set a gauge.
+ * 
+ * Nothing happens if the metrics file is not available.
+ * 
+ * @param  counter  `METRIC(counter)`.
+ * @param  value    The value to add or set.
+ * @param  set      Set rather than add?
+ */
+void metrics_count(size_t counter, uint64_t value, int set);
+
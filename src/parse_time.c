@@ -181,6 +181,138 @@ parse_time_seconds(const char **str, struct timespec *ts)
 }
 
 
+/**
+ * Parse the fraction of a second, if any, with
+ * up to nanosecond resolution.
+ * 
+ * @param  str  Pointer to time string, will be updated to the end
+ *              of the parsing of it.
+ * @param  ts   The time, `tv_nsec` will be set, and `tv_sec` may
+ *              be incremented if the fraction is rounded up.
+ */
+static void
+parse_time_nanoseconds(const char **str, struct timespec *ts)
+{
+	int points;
+	ts->tv_nsec = 0;
+	if (**str != '.')
+		return;
+	for (points = 0, (*str)++; isdigit(**str); points++, (*str)++) {
+		if (points < 9) {
+			ts->tv_nsec *= 10;
+			ts->tv_nsec += **str & 15;
+		} else if ((points == 9) && (**str >= '5')) {
+			ts->tv_nsec += 1;
+		}
+	}
+	while (points++ < 9)  ts->tv_nsec *= 10;
+	if (ts->tv_nsec >= 1000000000L)
+		ts->tv_sec += 1, ts->tv_nsec -= 1000000000L;
+}
+
+
+/**
+ * Parse a field in a calendar pattern.
+ * 
+ * @param   str    Pointer to the pattern, will be updated to the end
+ *                 of the parsing of the field.
+ * @param   min    The lowest allowed value.
+ * @param   max    The highest allowed value.
+ * @param   value  Output parameter for the value, -1 for any.
+ * @return         0 on success, -1 on error.
+ * 
+ * @throws  EINVAL  The field could not be parsed.
+ */
+static int
+parse_calendar_field(const char **str, int min, int max, int *value)
+{
+	time_t v;
+	if (**str == '*') {
+		(*str)++;
+		return *value = -1, 0;
+	}
+	t (v = strtotime(*str, str), errno);
+	REQUIRE((v >= min) && (v <= max));
+	return *value = (int)v, 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Parse a duration.
+ * 
+ * @param   str       The duration, on the format S[.NNNNNNNNN].
+ * @param   duration  Output parameter for the duration.
+ * @return            0 on success, -1 on error.
+ * 
+ * @throws  EINVAL  `str` could not be parsed.
+ * @throws  ERANGE  The duration is too long.
+ */
+int
+parse_duration(const char *str, struct timespec *duration)
+{
+	t (parse_time_seconds(&str, duration));
+	parse_time_nanoseconds(&str, duration);
+	REQUIRE(!*str);
+	/* Keep the duration, in nanoseconds, well within 64 bits. */
+	if (duration->tv_sec > (time_t)1 << 32)
+		FAIL(ERANGE);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Parse a recurrence specification.
+ * 
+ * @param   str       The specification, either an interval, on the
+ *                    format [+]S[.NNNNNNNNN], or a calendar pattern,
+ *                    on the format [YYYY-MM-DD ]hh:mm[:ss], in UTC,
+ *                    where any field may be `*` to match any value.
+ * @param   interval  Output parameter for the interval.
+ * @param   calendar  Output parameter for the calendar pattern: the
+ *                    year, month, day, hour, minute, and second,
+ *                    -1 for any.
+ * @return            'i' if `str` is an interval, 'c' if it is a
+ *                    calendar pattern, -1 on error.
+ * 
+ * @throws  EINVAL  `str` could not be parsed.
+ * @throws  ERANGE  The interval is too long.
+ */
+int
+parse_recurrence(const char *str, struct timespec *interval, int calendar[6])
+{
+	int i;
+
+	if (!strchr(str, ':')) {
+		t (parse_duration(str + (*str == '+'), interval));
+		REQUIRE(interval->tv_sec || interval->tv_nsec);
+		return 'i';
+	}
+
+	for (i = 0; i < 6; i++)
+		calendar[i] = -1;
+	if (strchr(str, '-')) {
+		t (parse_calendar_field(&str, 0, INT_MAX, calendar + 0));  REQUIRE(*str++ == '-');
+		t (parse_calendar_field(&str, 1, 12, calendar + 1));       REQUIRE(*str++ == '-');
+		t (parse_calendar_field(&str, 1, 31, calendar + 2));       REQUIRE(*str++ == ' ');
+	}
+	t (parse_calendar_field(&str, 0, 23, calendar + 3));  REQUIRE(*str++ == ':');
+	t (parse_calendar_field(&str, 0, 59, calendar + 4));
+	calendar[5] = 0;
+	if (*str == ':') {
+		str++;
+		t (parse_calendar_field(&str, 0, 59, calendar + 5));
+	}
+	REQUIRE(!*str);
+	return 'c';
+fail:
+	return -1;
+}
+
+
 /**
  * Trivial time-parsing.
  * 
@@ -209,7 +341,7 @@ parse_time(const char *str, struct timespec *ts, clockid_t *clk)
 #define FIX_NSEC(T)  (((T)->tv_nsec >= 1000000000L) ? ((T)->tv_sec += 1, (T)->tv_nsec -= 1000000000L) : 0L)
 
 	struct timespec now;
-	int points, plus = *str == '+';
+	int plus = *str == '+';
 	const char *start = str;
 	time_t adj;
 
@@ -236,21 +368,7 @@ parse_time(const char *str, struct timespec *ts, clockid_t *clk)
 	}
 
 	/* Parse up to nanosecond resolution. */
-	if (*str != '.')
-		goto no_nanoseconds;
-	for (points = 0, str++; isdigit(*str); points++, str++) {
-		if (points < 9) {
-			ts->tv_nsec *= 10;
-			ts->tv_nsec += *str & 15;
-		} else if ((points == 9) && (*str >= '5')) {
-			ts->tv_nsec += 1;
-			/* I would like to have FIX_NSEC here, but the
-			 * compile will complain and it is not worth it. */
-		}
-	}
-	while (points++ < 9)  ts->tv_nsec *= 10;
-	FIX_NSEC(ts);
-no_nanoseconds:
+	parse_time_nanoseconds(&str, ts);
 
 	/* Check for error at end, and missing explicit UTC. */
 	if (*str) {
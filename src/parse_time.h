@@ -51,3 +51,36 @@
 int
 parse_time(const char *str, struct timespec *ts, clockid_t *clk);
 
+/**
+ * Parse a duration.
+ * 
+ * @param   str       The duration, on the format S[.NNNNNNNNN].
+ * @param   duration  Output parameter for the duration.
+ * @return            0 on success, -1 on error.
+ * 
+ * @throws  EINVAL  `str` could not be parsed.
+ * @throws  ERANGE  The duration is too long.
+ */
+int
+parse_duration(const char *str, struct timespec *duration);
+
+/**
+ * Parse a recurrence specification.
+ * 
+ * @param   str       The specification, either an interval, on the
+ *                    format [+]S[.NNNNNNNNN], or a calendar pattern,
+ *                    on the format [YYYY-MM-DD ]hh:mm[:ss], in UTC,
+ *                    where any field may be `*` to match any value.
+ * @param   interval  Output parameter for the interval.
+ * @param   calendar  Output parameter for the calendar pattern: the
+ *                    year, month, day, hour, minute, and second,
+ *                    -1 for any.
+ * @return            'i' if `str` is an interval, 'c' if it is a
+ *                    calendar pattern, -1 on error.
+ * 
+ * @throws  EINVAL  `str` could not be parsed.
+ * @throws  ERANGE  The interval is too long.
+ */
+int
+parse_recurrence(const char *str, struct timespec *interval, int calendar[6]);
+
@@ -0,0 +1,1402 @@
+/**
+ * Copyright © 2015, 2016  Mattias Andrée <maandree@member.fsf.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#define _XOPEN_SOURCE  700 /* For nftw. */
+#include "common.h"
+#include "metrics.h"
+#include "virtual_clock.h"
+#include <ctype.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+
+
+COMMAND("sat-bench")
+USAGE("[-a [-w WINDOW] [-l LOAD] | -p TRACE [-s SPEED] | -c CLIENTS] [-n SAMPLES] [-e ENV-SIZE] QUEUE-SIZE...")
+
+
+
+/**
+ * The version of the output format, increase when
+ * the format is changed.
+ */
+#define OUTPUT_VERSION  2
+
+/**
+ * How far in the future the queued jobs expire, in seconds.
+ * This must be longer than the window, when measuring the
+ * scheduling accuracy, as the virtual clock may be used.
+ */
+#define HORIZON  (366 * 24 * 60 * 60)
+
+/**
+ * The number of bytes to write at a time when populating the queue.
+ */
+#define POPULATE_CHUNK  (1 << 20)
+
+/**
+ * Placeholder for the job number in a job's command line,
+ * it has room for any job number.
+ */
+#define JOBNO_PLACEHOLDER  "00000000000000000000"
+
+/**
+ * How long after they are queued the first jobs expire,
+ * when measuring the scheduling accuracy, in nanoseconds.
+ */
+#define ACCURACY_LEAD  500000000ULL
+
+/**
+ * How long to wait, after the last job should have
+ * run, for all jobs to run, in seconds.
+ */
+#define ACCURACY_TIMEOUT  60
+
+/**
+ * The operations that are benchmarked.
+ */
+enum operation {
+	ENQUEUE,
+	LIST,
+	REMOVE_FIRST,
+	REMOVE_LAST,
+	RUN,
+	OPERATIONS
+};
+
+
+
+/**
+ * The names of the operations, as printed.
+ */
+static const char *const operation_names[] = {
+	[ENQUEUE]      = "enqueue",
+	[LIST]         = "list",
+	[REMOVE_FIRST] = "remove-first",
+	[REMOVE_LAST]  = "remove-last",
+	[RUN]          = "run",
+};
+
+/**
+ * The private runtime directory.
+ */
+static char rundir[] = "/tmp/sat-bench.XXXXXX";
+
+/**
+ * The environment of the clients, and of the queued jobs.
+ */
+static char **client_env = NULL;
+
+/**
+ * The job that is used to populate the queue,
+ * its number and expiration time are set
+ * when it is written.
+ */
+static struct job_full *template = NULL;
+
+/**
+ * Where in `template` its job number is stored, `NULL`
+ * if the job number is not in the job's command line.
+ */
+static char *template_jobno = NULL;
+
+/**
+ * The number of the first job in the queue.
+ */
+static size_t first_job;
+
+
+
+/**
+ * The time at which a job, run when measuring the
+ * scheduling accuracy, started.
+ */
+struct record {
+	/**
+	 * The job number.
+	 */
+	size_t no;
+
+	/**
+	 * The time in `CLOCK_REALTIME`.
+	 */
+	struct timespec real;
+
+	/**
+	 * The time in `CLOCK_BOOTTIME`.
+	 */
+	struct timespec boot;
+};
+
+
+
+/**
+ * Construct the environment of the clients.
+ * 
+ * The environment contains what the clients need, and is padded
+ * with variables until it is about `env_size` bytes large.
+ * 
+ * @param   env_size  The number of bytes in the environment.
+ * @return            0 on success, -1 on error.
+ */
+static int
+setup(size_t env_size)
+{
+	char *var, **env;
+	size_t i, n, len = 0, vars = 3;
+	int saved_errno;
+
+	for (env = client_env; env && *env; env++)
+		free(*env);
+	free(client_env);
+
+	vars += env_size / 64 + 1;
+	t (!(client_env = calloc(vars + 1, sizeof(char *))));
+	env = client_env;
+	t (!(*env = malloc(sizeof("XDG_RUNTIME_DIR=") + strlen(rundir))));
+	stpcpy(stpcpy(*env, "XDG_RUNTIME_DIR="), rundir);
+	len += strlen(*env++) + 1;
+	t (!(*env = malloc(sizeof("SAT_HOOK_PATH=/hook") + strlen(rundir))));
+	stpcpy(stpcpy(stpcpy(*env, "SAT_HOOK_PATH="), rundir), "/hook");
+	len += strlen(*env++) + 1;
+	t (!(*env = strdup("PATH=/usr/local/bin:/usr/bin:/bin")));
+	len += strlen(*env++) + 1;
+	for (i = 0; len < env_size; i++) {
+		n = env_size - len < 64 ? env_size - len : 64;
+		n = n < sizeof("BENCH_0000=") ? sizeof("BENCH_0000=") : n;
+		t (!(var = *env++ = malloc(n)));
+		sprintf(var, "BENCH_%04zu=", i % 10000);
+		memset(var + sizeof("BENCH_0000=") - 1, 'x', n - sizeof("BENCH_0000="));
+		var[n - 1] = '\0';
+		len += n;
+	}
+
+	return 0;
+fail:
+	saved_errno = errno;
+	for (env = client_env; env && *env; env++)
+		free(*env);
+	free(client_env), client_env = NULL;
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Construct the job that is used to populate the queue.
+ * 
+ * @param   argv  The job's command line, `JOBNO_PLACEHOLDER` is
+ *                replaced by the job number.
+ * @param   clk   The job's clock.
+ * @return        0 on success, -1 on error.
+ */
+static int
+make_template(char *const argv[], clockid_t clk)
+{
+	char cwd[PATH_MAX];
+	char *p, *const *arg, **env;
+	size_t n;
+
+	t (!getcwd(cwd, sizeof(cwd)));
+
+	n = strlen(cwd) + 1;
+	for (arg = argv; *arg; arg++)
+		n += strlen(*arg) + 1;
+	for (env = client_env; *env; env++)
+		n += strlen(*env) + 1;
+	free(template), template_jobno = NULL;
+	t (!(template = calloc(1, sizeof(*template) + n)));
+	template->job.argc = (int)(arg - argv);
+	template->job.clk = clk;
+	template->job.n = n;
+	p = template->payload;
+	for (arg = argv; *arg; arg++) {
+		if (!strcmp(*arg, JOBNO_PLACEHOLDER))
+			template_jobno = p;
+		p = stpcpy(p, *arg) + 1;
+	}
+	template->job.wdir_off = (size_t)(p - template->payload);
+	p = stpcpy(p, cwd) + 1;
+	template->job.envp_off = (size_t)(p - template->payload);
+	for (env = client_env; *env; env++)
+		p = stpcpy(p, *env) + 1;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Append jobs to the queue.
+ * 
+ * @param   count  The number of jobs to append.
+ * @param   first  The expiration time of the first job.
+ * @param   step   The time between the jobs' expiration times, in nanoseconds.
+ * @param   no     Output parameter for the number of the first job, may be `NULL`.
+ * @return         0 on success, -1 on error.
+ */
+static int
+append_jobs(size_t count, const struct timespec *first, uint64_t step, size_t *no)
+{
+	struct state_header header;
+	struct timespec ts = *first;
+	struct stat attr, heap_attr;
+	size_t size = JOB_SIZE(template->job.n);
+	size_t per_chunk = POPULATE_CHUNK / size + 1, i = 0;
+	struct job_header *headers = NULL;
+	char *payloads = NULL;
+	int heap = -1, r, saved_errno;
+
+	t (!(headers = malloc(per_chunk * sizeof(*headers))));
+	t (!(payloads = malloc(per_chunk * size)));
+	t (clock_gettime(template->job.clk, &(template->job.queued)));
+
+	t (lock_state(LOCK_EX));
+	t (heap = open_heap(O_RDWR | O_CREAT), heap == -1);
+	t (fstat(STATE_FILENO, &attr));
+	t (fstat(heap, &heap_attr));
+	t (r = read_header(&header), r < 0);
+	if (attr.st_size < (off_t)sizeof(header))
+		attr.st_size = (off_t)sizeof(header);
+	if (no)
+		*no = r ? header.no + 1 : 0;
+	while (count--) {
+		template->job.no = header.no = r ? header.no + 1 : 0, r = 1;
+		template->job.ts = ts;
+		ts.tv_sec += (time_t)(step / 1000000000ULL);
+		ts.tv_nsec += (long int)(step % 1000000000ULL);
+		if (ts.tv_nsec >= 1000000000L)
+			ts.tv_sec += 1, ts.tv_nsec -= 1000000000L;
+		if (template_jobno)
+			sprintf(template_jobno, "%0*zu", (int)(sizeof(JOBNO_PLACEHOLDER) - 1), template->job.no);
+		make_job_header(&(template->job), (size_t)(heap_attr.st_size) + i * size, headers + i);
+		header_add_job(&header, headers + i);
+		memcpy(payloads + i * size, template, size);
+		if (++i == per_chunk || !count) {
+			t (pwriten(heap, payloads, i * size, (size_t)(heap_attr.st_size)) < (ssize_t)(i * size));
+			t (pwriten(STATE_FILENO, headers, i * sizeof(*headers), (size_t)(attr.st_size)) < (ssize_t)(i * sizeof(*headers)));
+			heap_attr.st_size += (off_t)(i * size);
+			attr.st_size += (off_t)(i * sizeof(*headers)), i = 0;
+		}
+	}
+	t (write_header(&header));
+	t (flock(STATE_FILENO, LOCK_UN));
+
+	close(heap);
+	free(headers);
+	free(payloads);
+	return 0;
+fail:
+	saved_errno = errno;
+	flock(STATE_FILENO, LOCK_UN);
+	if (heap >= 0)
+		close(heap);
+	free(headers);
+	free(payloads);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Append jobs, that will not expire during the benchmark, to the queue.
+ * 
+ * @param   count  The number of jobs to append.
+ * @return         0 on success, -1 on error.
+ */
+static int
+append_idle_jobs(size_t count)
+{
+	struct timespec first;
+	t (clock_gettime(template->job.clk, &first));
+	first.tv_sec += HORIZON;
+	return append_jobs(count, &first, 1000000000ULL, NULL);
+fail:
+	return -1;
+}
+
+
+/**
+ * Run a client, and measure how long it takes.
+ * 
+ * @param   command  The name of the command.
+ * @param   arg1     The first argument, `NULL` if none.
+ * @param   arg2     The second argument, `NULL` if none.
+ * @param   elapsed  Output parameter for the time it took, in nanoseconds.
+ * @return           0 on success, -1 on error.
+ */
+static int
+run_client(const char *command, const char *arg1, const char *arg2, uint64_t *elapsed)
+{
+	char path[sizeof(BINDIR "/") + 16];
+	char *argv[] = {path, (char *)arg1, (char *)arg2, NULL};
+	struct timespec start, end;
+	pid_t pid;
+	int status, fd;
+
+	stpcpy(stpcpy(path, BINDIR "/"), command);
+
+	t (clock_gettime(CLOCK_MONOTONIC, &start));
+	t (pid = fork(), pid == -1);
+	if (!pid) {
+		if (fd = open("/dev/null", O_RDWR), fd != -1)
+			dup2(fd, STDIN_FILENO), dup2(fd, STDOUT_FILENO), close(fd);
+		execve(path, argv, client_env);
+		perror(path);
+		exit(1);
+	}
+	t (waitpid(pid, &status, 0) != pid);
+	t (clock_gettime(CLOCK_MONOTONIC, &end));
+
+	if (status) {
+		fprintf(stderr, "%s: %s failed\n", argv0, command);
+		return errno = 0, -1;
+	}
+	*elapsed  = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL;
+	*elapsed += (uint64_t)(end.tv_nsec);
+	*elapsed -= (uint64_t)(start.tv_nsec);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Perform one operation, and restore the queue's size afterwards.
+ * 
+ * @param   op       The operation.
+ * @param   elapsed  Output parameter for the time it took, in nanoseconds.
+ * @return           0 on success, -1 on error.
+ */
+static int
+perform(enum operation op, uint64_t *elapsed)
+{
+	char jobno[3 * sizeof(size_t) + 1];
+	struct state_header header;
+	struct stat attr, heap_attr;
+	int heap = -1, saved_errno;
+
+	switch (op) {
+	case ENQUEUE:
+		t (lock_state(LOCK_SH));
+		t (heap = open_heap(O_RDWR), heap == -1);
+		t (fstat(STATE_FILENO, &attr));
+		t (fstat(heap, &heap_attr));
+		t (read_header(&header) < 0);
+		t (flock(STATE_FILENO, LOCK_UN));
+		t (run_client("sat", "+604800", "true", elapsed));
+		/* Remove the job, it is the last one, and its payload is the last one. */
+		t (lock_state(LOCK_EX));
+		t (ftruncate(STATE_FILENO, attr.st_size));
+		t (ftruncate(heap, heap_attr.st_size));
+		t (write_header(&header));
+		t (flock(STATE_FILENO, LOCK_UN));
+		close(heap);
+		return 0;
+
+	case LIST:
+		t (run_client("satq", NULL, NULL, elapsed));
+		return 0;
+
+	case REMOVE_FIRST:
+	case RUN:
+		sprintf(jobno, "%zu", first_job++);
+		t (run_client(op == RUN ? "satr" : "satrm", jobno, NULL, elapsed));
+		return append_idle_jobs(1);
+
+	case REMOVE_LAST:
+		t (lock_state(LOCK_SH));
+		t (read_header(&header) < 0);
+		t (flock(STATE_FILENO, LOCK_UN));
+		sprintf(jobno, "%zu", header.no);
+		t (run_client("satrm", jobno, NULL, elapsed));
+		return append_idle_jobs(1);
+
+	default:
+		abort();
+	}
+fail:
+	if (heap >= 0)
+		S(close(heap));
+	return -1;
+}
+
+
+/**
+ * Comparison function for `qsort`.
+ * 
+ * @param   a  The left-hand operand.
+ * @param   b  The right-hand operand.
+ * @return     Negative if `a` is less, positive if `b` is less, 0 if equal.
+ */
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Start the daemon.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+start_daemon(void)
+{
+	uint64_t _elapsed;
+	return run_client("satd", NULL, NULL, &_elapsed);
+}
+
+
+/**
+ * Stop the daemon, and wait for it to exit.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+stop_daemon(void)
+{
+	char *path = NULL;
+	pid_t pid;
+	int fd = -1, saved_errno;
+
+	t (!(path = runtime_path("lock")));
+	t (fd = open(path, O_RDONLY), fd == -1);
+	t (read(fd, &pid, sizeof(pid)) < (ssize_t)sizeof(pid));
+	if (flock(fd, LOCK_SH | LOCK_NB)) {
+		t (errno != EWOULDBLOCK);
+		t (kill(pid, SIGTERM) && (errno != ESRCH));
+		t (flock(fd, LOCK_SH));
+	}
+	close(fd);
+	free(path);
+	return 0;
+fail:
+	return S(close(fd), free(path)), -1;
+}
+
+
+/**
+ * Get how much CPU time the daemon and its reaped children have used.
+ * 
+ * @param   ns  Output parameter for the CPU time, in nanoseconds.
+ * @return      0 on success, -1 on error.
+ */
+static int
+daemon_cpu(uint64_t *ns)
+{
+	char *path = NULL, buf[1024], *p;
+	unsigned long int utime, stime;
+	long int cutime, cstime, tick;
+	ssize_t r;
+	pid_t pid;
+	int fd = -1, saved_errno;
+
+	t (!(path = runtime_path("lock")));
+	t (fd = open(path, O_RDONLY), fd == -1);
+	t (read(fd, &pid, sizeof(pid)) < (ssize_t)sizeof(pid));
+	close(fd);
+	sprintf(buf, "/proc/%lli/stat", (long long int)pid);
+	t (fd = open(buf, O_RDONLY), fd == -1);
+	t (r = read(fd, buf, sizeof(buf) - 1), r < 0);
+	buf[r] = '\0';
+	t (errno = EINVAL, !(p = strrchr(buf, ')')));
+	t (sscanf(p, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %li %li",
+	          &utime, &stime, &cutime, &cstime) != 4);
+	t (tick = sysconf(_SC_CLK_TCK), tick <= 0);
+	*ns = (uint64_t)(utime + stime + (unsigned long int)(cutime + cstime)) * (1000000000ULL / (uint64_t)tick);
+	close(fd);
+	free(path);
+	return 0;
+fail:
+	return S(close(fd), free(path)), -1;
+}
+
+
+/**
+ * Callback for `nftw` that removes a file.
+ * 
+ * @param   path  The file's pathname.
+ * @return        0 on success, -1 on error.
+ */
+static int
+remove_file(const char *path, const struct stat *_attr, int _type, struct FTW *_ftw)
+{
+	return remove(path);
+	(void) _attr, (void) _type, (void) _ftw;
+}
+
+
+/**
+ * Create a queue in the private runtime directory,
+ * populate it, and start the daemon.
+ * 
+ * @param   size  The number of jobs in the queue.
+ * @return        0 on success, -1 on error.
+ */
+static int
+create_queue(size_t size)
+{
+	static char *const job_argv[] = {"true", NULL};
+	char dir[sizeof(rundir) + sizeof("/" PACKAGE)];
+	int fd;
+
+	stpcpy(stpcpy(dir, rundir), "/" PACKAGE);
+	t (mkdir(dir, S_IRWXU));
+
+	GET_FD(fd, STATE_FILENO, open_state(O_RDWR | O_CREAT, NULL));
+	t (fcntl(STATE_FILENO, F_SETFD, FD_CLOEXEC));
+	t (make_template(job_argv, CLOCK_BOOTTIME));
+	t (append_idle_jobs(size));
+	first_job = 0;
+#ifdef VIRTUAL_CLOCK
+	/* Keep the daemon from skipping ahead to these jobs. */
+	t (virtual_clock_allow(0));
+#endif
+	t (start_daemon());
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Stop the daemon, and remove the queue.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+remove_queue(void)
+{
+	int r = stop_daemon();
+	close(STATE_FILENO);
+	t (r);
+	t (nftw(rundir, remove_file, 8, FTW_DEPTH | FTW_PHYS));
+	t (mkdir(rundir, S_IRWXU));
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Enable tracing of the operations on the queue.
+ * 
+ * @return  The pathname of the trace, `NULL` on error.
+ */
+static char *
+start_trace(void)
+{
+	char *path;
+	int fd;
+
+	t (!(path = runtime_path("trace")));
+	t (fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR), fd == -1);
+	close(fd);
+	return path;
+fail:
+	free(path);
+	return NULL;
+}
+
+
+/**
+ * Benchmark all operations with a queue of a specific size,
+ * and print the results.
+ * 
+ * @param   size     The number of jobs in the queue.
+ * @param   samples  The number of samples per operation.
+ * @param   env      The size of the environment.
+ * @return           0 on success, -1 on error.
+ */
+static int
+bench(size_t size, size_t samples, size_t env)
+{
+	uint64_t *times = NULL;
+	enum operation op;
+	size_t i;
+	int saved_errno;
+
+	t (!(times = malloc(samples * sizeof(*times))));
+	t (create_queue(size));
+
+	for (op = 0; op < OPERATIONS; op++) {
+		/* Warm up. */
+		t (perform(op, times));
+		for (i = 0; i < samples; i++)
+			t (perform(op, times + i));
+		qsort(times, samples, sizeof(*times), cmp_u64);
+		printf("%s\t%zu\t%zu\t%zu\t%llu\t%llu\n", operation_names[op], size, env, samples,
+		       (unsigned long long int)times[(samples - 1) * 50 / 100],
+		       (unsigned long long int)times[(samples - 1) * 99 / 100]);
+		fflush(stdout);
+	}
+
+	t (remove_queue());
+	free(times);
+	return 0;
+fail:
+	saved_errno = errno;
+	remove_queue();
+	free(times);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Record when this process started, this is
+ * the job that is run when measuring the
+ * scheduling accuracy.
+ * 
+ * @param   jobno  The job number.
+ * @return         0 on success, -1 on error.
+ */
+static int
+record(const char *jobno)
+{
+	struct record rec;
+	char *path = NULL;
+	int fd = -1, saved_errno;
+
+	clock_gettime(CLOCK_REALTIME, &(rec.real));
+	clock_gettime(CLOCK_BOOTTIME, &(rec.boot));
+	rec.no = (size_t)strtoull(jobno, NULL, 10);
+
+	t (!(path = runtime_path("accuracy")));
+	t (fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR), fd == -1);
+	t (write(fd, &rec, sizeof(rec)) < (ssize_t)sizeof(rec));
+	close(fd);
+	free(path);
+	return 0;
+fail:
+	return S(close(fd), free(path)), -1;
+}
+
+
+/**
+ * Comparison function for `qsort`.
+ * 
+ * @param   a  The left-hand operand.
+ * @param   b  The right-hand operand.
+ * @return     Negative if `a` is less, positive if `b` is less, 0 if equal.
+ */
+static int
+cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Measure how late jobs are run, with a queue of a specific
+ * size, and print the results.
+ * 
+ * Half of the jobs use `CLOCK_REALTIME`, the other half use
+ * `CLOCK_BOOTTIME`, their expiration times are spread evenly
+ * over a window, and are interleaved between the clocks.
+ * 
+ * @param   size     The number of jobs in the queue, that do not expire.
+ * @param   samples  The number of jobs that expire.
+ * @param   window   The length of the window, in nanoseconds.
+ * @param   load     The number of processes that keep the CPU busy.
+ * @return           0 on success, -1 on error.
+ */
+static int
+accuracy(size_t size, size_t samples, uint64_t window, size_t load)
+{
+	static char *const job_argv[] = {BINDIR "/sat-bench", "-r", JOBNO_PLACEHOLDER, NULL};
+	static const clockid_t clocks[] = {CLOCK_REALTIME, CLOCK_BOOTTIME};
+	static const char *const clock_names[] = {"walltime", "boottime"};
+	struct timespec first[2], deadline, now;
+	uint64_t cpu[2];
+	struct record *recs = NULL;
+	int64_t *lateness[2] = {NULL, NULL};
+	size_t i, c, count[2], n[2] = {0, 0}, no[2];
+	pid_t *loaders = NULL;
+	char *path = NULL;
+	struct stat attr;
+	const struct timespec *ts;
+	uint64_t step, offset;
+	int fd = -1, saved_errno;
+
+	count[0] = (samples + 1) / 2;
+	count[1] = samples / 2;
+	step = window / (count[0] ? count[0] : 1);
+
+	t (!(recs = malloc(samples * sizeof(*recs))));
+	t (!(lateness[0] = malloc(count[0] * sizeof(**lateness))));
+	t (!(lateness[1] = malloc((count[1] + 1) * sizeof(**lateness))));
+	t (!(loaders = calloc(load + 1, sizeof(*loaders))));
+	t (!(path = runtime_path("accuracy")));
+
+	t (create_queue(size));
+
+	/* Keep the CPU busy. */
+	for (i = 0; i < load; i++) {
+		t (loaders[i] = fork(), loaders[i] == -1);
+		if (!loaders[i])
+			for (;;);
+	}
+
+	/* Queue the jobs, and let the daemon know. */
+	t (daemon_cpu(cpu));
+	for (c = 0; c < 2; c++) {
+		t (clock_gettime(clocks[c], first + c));
+		offset = ACCURACY_LEAD + c * (step / 2);
+		first[c].tv_sec += (time_t)(offset / 1000000000ULL);
+		first[c].tv_nsec += (long int)(offset % 1000000000ULL);
+		if (first[c].tv_nsec >= 1000000000L)
+			first[c].tv_sec += 1, first[c].tv_nsec -= 1000000000L;
+		t (make_template(job_argv, clocks[c]));
+		t (count[c] && append_jobs(count[c], first + c, step, no + c));
+	}
+#ifdef VIRTUAL_CLOCK
+	t (virtual_clock_allow((int64_t)(ACCURACY_LEAD + window) + 1000000000LL));
+#endif
+	t (poke_daemon(0, argv0));
+
+	/* Wait for all jobs to run. */
+	t (clock_gettime(CLOCK_MONOTONIC, &deadline));
+	deadline.tv_sec += (time_t)(window / 1000000000ULL) + ACCURACY_TIMEOUT + 1;
+	for (;;) {
+		if (fd == -1)
+			fd = open(path, O_RDONLY);
+		if (fd >= 0) {
+			t (fstat(fd, &attr));
+			if ((size_t)(attr.st_size) >= samples * sizeof(*recs))
+				break;
+		}
+		t (clock_gettime(CLOCK_MONOTONIC, &now));
+		if (timecmp(&now, &deadline) > 0) {
+			fprintf(stderr, "%s: not all jobs were run\n", argv0);
+			errno = 0;
+			goto fail;
+		}
+		now.tv_sec = 0, now.tv_nsec = 10000000L;
+		nanosleep(&now, NULL);
+	}
+	t (preadn(fd, recs, samples * sizeof(*recs), 0) < (ssize_t)(samples * sizeof(*recs)));
+
+	/* The last job is finished when we can get the lock. */
+	t (lock_state(LOCK_EX));
+	t (flock(STATE_FILENO, LOCK_UN));
+	t (daemon_cpu(cpu + 1));
+	cpu[1] = (cpu[1] - cpu[0]) / samples;
+
+	/* Calculate the lateness. */
+	for (i = 0; i < samples; i++) {
+		c = count[1] && (recs[i].no >= no[1]);
+		ts = c ? &(recs[i].boot) : &(recs[i].real);
+		offset = (uint64_t)(recs[i].no - no[c]) * step;
+		lateness[c][n[c]]  = (int64_t)(ts->tv_sec - first[c].tv_sec) * 1000000000LL;
+		lateness[c][n[c]] += (int64_t)(ts->tv_nsec - first[c].tv_nsec);
+		lateness[c][n[c]] -= (int64_t)offset;
+		n[c]++;
+	}
+	for (c = 0; c < 2; c++) {
+		if (!n[c])
+			continue;
+		qsort(lateness[c], n[c], sizeof(**lateness), cmp_i64);
+		printf("lateness-%s\t%zu\t%llu\t%zu\t%zu\t%lli\t%lli\t%lli\t%llu\n", clock_names[c], size,
+		       (unsigned long long int)(window / 1000000ULL), load, n[c],
+		       (long long int)lateness[c][(n[c] - 1) * 50 / 100],
+		       (long long int)lateness[c][(n[c] - 1) * 99 / 100],
+		       (long long int)lateness[c][n[c] - 1],
+		       (unsigned long long int)cpu[1]);
+	}
+	fflush(stdout);
+
+	errno = 0;
+fail:
+	saved_errno = errno;
+	for (i = 0; i < load && loaders[i] > 0; i++)
+		kill(loaders[i], SIGKILL), waitpid(loaders[i], NULL, 0);
+	if (fd >= 0)
+		close(fd);
+	remove_queue();
+	free(recs), free(lateness[0]), free(lateness[1]);
+	free(loaders), free(path);
+	errno = saved_errno;
+	return -!!errno;
+}
+
+
+/**
+ * Find the job, in the replay, that corresponds to a job in the trace.
+ * 
+ * @param   orig  The numbers of the jobs in the trace, in ascending order.
+ * @param   repl  The numbers of the corresponding jobs in the replay.
+ * @param   n     The number of elements in `orig` and `repl`.
+ * @param   no    The number of the job in the trace.
+ * @param   out   Output parameter for the number of the job in the replay.
+ * @return        1 if found, 0 if the job was queued before the trace started.
+ */
+static int
+find_job(const size_t *orig, const size_t *repl, size_t n, size_t no, size_t *out)
+{
+	size_t lo = 0, hi = n, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (orig[mid] < no)
+			lo = mid + 1;
+		else if (orig[mid] > no)
+			hi = mid;
+		else
+			return *out = repl[mid], 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Get the number of nanoseconds between two points in time.
+ * 
+ * @param   a  The earlier point in time.
+ * @param   b  The later point in time.
+ * @return     `b` minus `a`, in nanoseconds.
+ */
+#ifdef __GNUC__
+__attribute__((__pure__))
+#endif
+static int64_t
+diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (int64_t)(b->tv_sec - a->tv_sec) * 1000000000LL + (int64_t)(b->tv_nsec - a->tv_nsec);
+}
+
+
+/**
+ * Replay a workload trace against a queue of a specific
+ * size, and print the results.
+ * 
+ * The jobs in the trace are replaced by jobs that run true(1),
+ * with environments padded so that their payloads are about
+ * as large as in the trace. Operations on jobs that were
+ * queued before the trace started are skipped.
+ * 
+ * @param   trace  The pathname of the trace.
+ * @param   size   The number of jobs in the queue, that do not expire.
+ * @param   speed  The rate of the replay, in percent of the original
+ *                 rate, 0 to perform the operations back to back.
+ * @return         0 on success, -1 on error.
+ */
+static int
+replay(const char *trace, size_t size, size_t speed)
+{
+	static const char ops[] = "qrfl";
+	static const char *const names[] = {"replay-enqueue", "replay-remove", "replay-run",
+	                                    "replay-list", "replay-lag", "replay-lateness"};
+	static const char *const commands[] = {"sat", "satrm", "satr", "satq"};
+	char timearg[3 * sizeof(long long int) + sizeof("+.000000000Z")];
+	char jobno[3 * sizeof(size_t) + 1];
+	char cwd[PATH_MAX];
+	struct trace *recs = NULL;
+	int64_t *times[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+	size_t count[6] = {0, 0, 0, 0, 0, 0};
+	size_t *orig = NULL, *repl = NULL, mapped = 0, i, k, n, overhead;
+	struct timespec start, target, now;
+	struct state_header header;
+	struct stat attr;
+	uint64_t elapsed;
+	int64_t left;
+	const char *op;
+	char *path = NULL;
+	int fd = -1, r, queued = 0, saved_errno;
+
+#ifdef VIRTUAL_CLOCK
+	/* The daemon would skip ahead of the replay. */
+	fprintf(stderr, "%s: traces cannot be replayed with the virtual clock\n", argv0);
+	return errno = 0, -1;
+#endif
+
+	/* Read the trace. */
+	t (fd = open(trace, O_RDONLY), fd == -1);
+	t (fstat(fd, &attr));
+	n = (size_t)(attr.st_size) / sizeof(*recs);
+	t (!(recs = malloc((n + 1) * sizeof(*recs))));
+	t (preadn(fd, recs, n * sizeof(*recs), 0) < (ssize_t)(n * sizeof(*recs)));
+	close(fd), fd = -1;
+	for (k = 0; k < 6; k++)
+		t (!(times[k] = malloc((n + 1) * sizeof(**times))));
+	t (!(orig = malloc((n + 1) * sizeof(*orig))));
+	t (!(repl = malloc((n + 1) * sizeof(*repl))));
+	t (!getcwd(cwd, sizeof(cwd)));
+	overhead = sizeof("true") + strlen(cwd) + 1;
+
+	t (create_queue(size));
+	queued = 1;
+
+	/* Trace the replay too, to find out how late the jobs are run. */
+	t (!(path = start_trace()));
+
+	t (clock_gettime(CLOCK_MONOTONIC, &start));
+	for (i = 0; i < n; i++) {
+		/* Jobs expire by themselves. */
+		if (!recs[i].op || !(op = strchr(ops, recs[i].op)))
+			continue;
+		k = (size_t)(op - ops);
+
+		if (speed) {
+			left = diff_ns(&(recs[0].when), &(recs[i].when)) / (int64_t)speed * 100;
+			target = start;
+			target.tv_sec += (time_t)(left / 1000000000LL);
+			target.tv_nsec += (long int)(left % 1000000000LL);
+			if (target.tv_nsec >= 1000000000L)
+				target.tv_sec += 1, target.tv_nsec -= 1000000000L;
+			while ((r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL)) == EINTR);
+			t (errno = r);
+			t (clock_gettime(CLOCK_MONOTONIC, &now));
+			times[4][count[4]++] = diff_ns(&target, &now);
+		}
+
+		switch (recs[i].op) {
+		case 'q':
+			left = diff_ns(&(struct timespec){0, 0}, &(recs[i].left));
+			left = left < 0 ? 0 : speed ? left / (int64_t)speed * 100 : left;
+			if (recs[i].clk == CLOCK_BOOTTIME) {
+				sprintf(timearg, "+%lli.%09li", (long long int)(left / 1000000000LL),
+				        (long int)(left % 1000000000LL));
+			} else {
+				t (clock_gettime(CLOCK_REALTIME, &now));
+				now.tv_sec += (time_t)(left / 1000000000LL);
+				now.tv_nsec += (long int)(left % 1000000000LL);
+				if (now.tv_nsec >= 1000000000L)
+					now.tv_sec += 1, now.tv_nsec -= 1000000000L;
+				sprintf(timearg, "%lli.%09liZ", (long long int)(now.tv_sec), now.tv_nsec);
+			}
+			t (setup(recs[i].n > overhead ? recs[i].n - overhead : 0));
+			t (run_client("sat", timearg, "true", &elapsed));
+			t (lock_state(LOCK_SH));
+			t (read_header(&header) < 0);
+			t (flock(STATE_FILENO, LOCK_UN));
+			/* The job numbers restart when the queue is emptied. */
+			if (mapped && (orig[mapped - 1] >= recs[i].no))
+				mapped = 0;
+			orig[mapped] = recs[i].no;
+			repl[mapped++] = header.no;
+			break;
+
+		case 'r':
+		case 'f':
+			if (!find_job(orig, repl, mapped, recs[i].no, &(header.no)))
+				continue;
+			sprintf(jobno, "%zu", header.no);
+			t (run_client(commands[k], jobno, NULL, &elapsed));
+			break;
+
+		default:
+			t (run_client(commands[k], NULL, NULL, &elapsed));
+			break;
+		}
+		times[k][count[k]++] = (int64_t)elapsed;
+	}
+
+	/* Get how late the jobs, that expired during the replay, were run. */
+	t (fd = open(path, O_RDONLY), fd == -1);
+	t (fstat(fd, &attr));
+	n = (size_t)(attr.st_size) / sizeof(*recs);
+	free(recs);
+	t (!(recs = malloc((n + 1) * sizeof(*recs))));
+	free(times[5]);
+	t (!(times[5] = malloc((n + 1) * sizeof(**times))));
+	t (preadn(fd, recs, n * sizeof(*recs), 0) < (ssize_t)(n * sizeof(*recs)));
+	for (i = 0; i < n; i++)
+		if (recs[i].op == 'e')
+			times[5][count[5]++] = -diff_ns(&(struct timespec){0, 0}, &(recs[i].left));
+
+	for (k = 0; k < 6; k++) {
+		if (!count[k])
+			continue;
+		qsort(times[k], count[k], sizeof(**times), cmp_i64);
+		printf("%s\t%zu\t%zu\t%zu\t%lli\t%lli\t%lli\n", names[k], size, speed, count[k],
+		       (long long int)times[k][(count[k] - 1) * 50 / 100],
+		       (long long int)times[k][(count[k] - 1) * 99 / 100],
+		       (long long int)times[k][count[k] - 1]);
+	}
+	fflush(stdout);
+
+	errno = 0;
+fail:
+	saved_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	if (queued)
+		remove_queue();
+	for (k = 0; k < 6; k++)
+		free(times[k]);
+	free(recs), free(orig), free(repl), free(path);
+	errno = saved_errno;
+	return -!!errno;
+}
+
+
+/**
+ * Perform operations, as one of many concurrent clients, and exit.
+ * 
+ * Every fourth operation queues a job, and the others list the
+ * queue, and remove and run jobs. The jobs to remove and run are
+ * picked at random, among those that may have been queued, so
+ * some of them will not be in the queue.
+ * 
+ * @param  worker   The index of the client.
+ * @param  clients  The number of concurrent clients.
+ * @param  size     The number of jobs in the queue, that do not expire.
+ * @param  ops      The number of operations to perform.
+ */
+static void
+stress_client(size_t worker, size_t clients, size_t size, size_t ops)
+{
+	char jobno[3 * sizeof(size_t) + 1];
+	unsigned int seed = (unsigned int)worker + 1;
+	uint64_t elapsed;
+	size_t i;
+
+	for (i = 0; i < ops; i++) {
+		switch (i % 4) {
+		case 0:
+			t (run_client("sat", "+604800", "true", &elapsed));
+			break;
+		case 1:
+			t (run_client("satq", NULL, NULL, &elapsed));
+			break;
+		default:
+			sprintf(jobno, "%zu", size + (size_t)rand_r(&seed) % (clients * (i / 4 + 1)));
+			t (run_client(i % 4 == 2 ? "satrm" : "satr", jobno, NULL, &elapsed));
+			break;
+		}
+	}
+	_exit(0);
+fail:
+	if (errno)
+		perror(argv0);
+	_exit(1);
+}
+
+
+/**
+ * Get an upper bound of a percentile of a histogram.
+ * 
+ * @param   hist     The histogram.
+ * @param   percent  The percentile.
+ * @return           The upper bound of the bucket the percentile is in,
+ *                   in nanoseconds, the lower bound for the last bucket.
+ */
+#ifdef __GNUC__
+__attribute__((__pure__))
+#endif
+static uint64_t
+histogram_percentile(const struct histogram *hist, uint64_t percent)
+{
+	uint64_t rank, seen = 0;
+	size_t i;
+	if (!hist->count)
+		return 0;
+	rank = (hist->count - 1) * percent / 100;
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+		if ((seen += hist->buckets[i]) > rank)
+			break;
+	return 1000ULL << (i < HISTOGRAM_BUCKETS - 1 ? i : i - 1);
+}
+
+
+/**
+ * Comparison function for `qsort`.
+ * 
+ * @param   a  The left-hand operand.
+ * @param   b  The right-hand operand.
+ * @return     Negative if `a` is less, positive if `b` is less, 0 if equal.
+ */
+static int
+cmp_size(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Run clients concurrently against a queue of a specific
+ * size, and print the results.
+ * 
+ * Afterwards, the job numbers are checked: each queued job
+ * must have got a number no other job got, and must either
+ * still be queued, or have been removed or run.
+ * 
+ * @param   size     The number of jobs in the queue, that do not expire.
+ * @param   clients  The number of concurrent clients.
+ * @param   ops      The number of operations per client.
+ * @return           0 on success, -1 on error.
+ */
+static int
+stress(size_t size, size_t clients, size_t ops)
+{
+	struct timespec start, end;
+	struct metrics metrics;
+	struct trace *recs = NULL;
+	struct job_header *jobs = NULL;
+	struct stat attr;
+	int64_t elapsed;
+	size_t *queued = NULL, *seen = NULL, nqueued = 0, nseen = 0, i, n, njobs;
+	size_t enqueued = clients * ((ops + 3) / 4), duplicated = 0, distinct = 0;
+	pid_t *pids = NULL;
+	char *path = NULL;
+	int fd = -1, status, failed = 0, created = 0, saved_errno;
+
+	t (!(pids = calloc(clients, sizeof(*pids))));
+	t (create_queue(size));
+	created = 1;
+	t (!(path = start_trace()));
+
+	/* Run the clients. */
+	fflush(stdout);
+	t (clock_gettime(CLOCK_MONOTONIC, &start));
+	for (i = 0; i < clients; i++) {
+		t (pids[i] = fork(), pids[i] == -1);
+		if (!pids[i])
+			stress_client(i, clients, size, ops);
+	}
+	for (i = 0; i < clients; i++) {
+		t (waitpid(pids[i], &status, 0) != pids[i]);
+		failed |= !!status, pids[i] = 0;
+	}
+	t (clock_gettime(CLOCK_MONOTONIC, &end));
+	elapsed = diff_ns(&start, &end);
+	if (failed) {
+		fprintf(stderr, "%s: a client failed\n", argv0);
+		errno = 0;
+		goto fail;
+	}
+
+	/* Get the lock-wait distribution. */
+	free(path);
+	t (!(path = runtime_path("metrics")));
+	t (fd = open(path, O_RDONLY), fd == -1);
+	t (preadn(fd, &metrics, sizeof(metrics), 0) < (ssize_t)sizeof(metrics));
+	close(fd), fd = -1;
+
+	/* Get the queued jobs, and the removed and run jobs, from the trace. */
+	free(path);
+	t (!(path = runtime_path("trace")));
+	t (fd = open(path, O_RDONLY), fd == -1);
+	t (fstat(fd, &attr));
+	n = (size_t)(attr.st_size) / sizeof(*recs);
+	t (!(recs = malloc((n + 1) * sizeof(*recs))));
+	t (preadn(fd, recs, n * sizeof(*recs), 0) < (ssize_t)(n * sizeof(*recs)));
+	close(fd), fd = -1;
+	t (!(queued = malloc((n + 1) * sizeof(*queued))));
+	t (!(seen = malloc((n + enqueued + 1) * sizeof(*seen))));
+	for (i = 0; i < n; i++) {
+		if (recs[i].op == 'q')
+			queued[nqueued++] = recs[i].no;
+		else if (recs[i].no >= size)
+			seen[nseen++] = recs[i].no;
+	}
+
+	/* Add the jobs that are still queued. */
+	t (!(jobs = get_job_headers(&njobs)));
+	for (i = 0; i < njobs; i++)
+		if ((jobs[i].no >= size) && (nseen < n + enqueued))
+			seen[nseen++] = jobs[i].no;
+
+	/* Count the duplicated and the lost job numbers. */
+	qsort(queued, nqueued, sizeof(*queued), cmp_size);
+	for (i = 1; i < nqueued; i++)
+		duplicated += queued[i] == queued[i - 1];
+	qsort(seen, nseen, sizeof(*seen), cmp_size);
+	for (i = 0; i < nseen; i++)
+		distinct += !i || (seen[i] != seen[i - 1]);
+
+	printf("stress\t%zu\t%zu\t%zu\t%llu\t%llu\t%llu\t%llu\t%zu\t%zu\n", size, clients, clients * ops,
+	       (unsigned long long int)((uint64_t)(clients * ops) * 1000000000ULL / (uint64_t)(elapsed ? elapsed : 1)),
+	       (unsigned long long int)histogram_percentile(&(metrics.lock_wait), 50),
+	       (unsigned long long int)histogram_percentile(&(metrics.lock_wait), 99),
+	       (unsigned long long int)(metrics.lock_wait.count ? metrics.lock_wait.sum / metrics.lock_wait.count : 0),
+	       enqueued > distinct + duplicated ? enqueued - distinct - duplicated : (size_t)0, duplicated);
+	fflush(stdout);
+
+	errno = 0;
+fail:
+	saved_errno = errno;
+	for (i = 0; pids && i < clients; i++)
+		if (pids[i] > 0)
+			kill(pids[i], SIGKILL), waitpid(pids[i], NULL, 0);
+	if (fd >= 0)
+		close(fd);
+	if (created)
+		remove_queue();
+	free(pids), free(recs), free(jobs), free(queued), free(seen), free(path);
+	errno = saved_errno;
+	return -!!errno;
+}
+
+
+/**
+ * Parse a non-negative integer.
+ * 
+ * @param   str  The string to parse.
+ * @param   min  The smallest allowed value.
+ * @return       The value, `usage` is called if invalid.
+ */
+static size_t
+parse_size(const char *str, size_t min)
+{
+	char *end;
+	size_t r = (errno = 0, (size_t)strtoull(str, &end, 10));
+	if (errno || *end || !isdigit(*str) || (r < min))
+		usage();
+	return r;
+}
+
+
+/**
+ * Benchmark the commands against queues of different sizes.
+ * 
+ * The commands and the daemon are those in BINDIR and LIBEXECDIR,
+ * so this program should be built with them pointing to the
+ * commands that shall be benchmarked, `make bench` does this.
+ * 
+ * The results are printed as tab-separated lines with the fields:
+ * operation, queue size, environment size, number of samples,
+ * median in nanoseconds, and 99th percentile in nanoseconds.
+ * 
+ * With -a, the scheduling accuracy is measured instead, and the
+ * fields are: "lateness-" followed by the clock's name, queue
+ * size, window length in milliseconds, number of processes that
+ * load the CPU, number of samples, the median, 99th percentile,
+ * and maximum lateness in nanoseconds, and the CPU time the daemon
+ * used per job in nanoseconds. If compiled with VIRTUAL_CLOCK=1,
+ * the jobs are run against a simulated clock, that skips ahead
+ * to the next expiration, so the window can be long.
+ * 
+ * With -p, a workload trace is replayed instead, at the rate
+ * selected with -s, in percent of the original rate (0 to replay
+ * as fast as possible), and the fields are: "replay-" followed by
+ * the operation, queue size before the replay, rate, number of
+ * samples, and the median, 99th percentile, and maximum in
+ * nanoseconds. For "replay-lag", this is how far behind the
+ * original schedule the operations were performed, and for
+ * "replay-lateness", how late the jobs that expired were run.
+ * 
+ * With -c, 1, 2, 4, ... up to the selected number of clients (0 for
+ * twice the number of CPUs), run concurrently, each performing the
+ * selected number of operations, and the fields are: "stress", queue
+ * size, number of clients, total number of operations, operations
+ * per second, the median and 99th percentile (as upper bounds) and
+ * mean time spent waiting for the state file's lock in nanoseconds,
+ * and the numbers of lost and of duplicated job numbers.
+ * 
+ * @param   argc  The number of elements in `argv`.
+ * @param   argv  The command line.
+ * @return  0     The process was successful.
+ * @return  1     The process failed.
+ * @return  2     User error, you do not know what you are doing.
+ */
+int
+main(int argc, char *argv[])
+{
+	size_t samples = 50, env = 2048, window = 1000, load = 0, speed = 100, clients = 0, size, n;
+	long int cpus;
+	const char *trace = NULL;
+	int created = 0, accurate = 0, stressed = 0;
+	char opt;
+
+	if (argc > 0)  argv0 = argv[0];
+
+	/* Are we a job that records when it was run? */
+	if ((argc == 3) && !strcmp(argv[1], "-r"))
+		return -record(argv[2]);
+
+	for (argv++, argc--; argc && argv[0][0] == '-'; argv++, argc--) {
+		if (!strcmp(*argv, "--")) {
+			argv++, argc--;
+			break;
+		}
+		if ((strlen(*argv) != 2) || !strchr("anewlpsc", opt = argv[0][1]))
+			usage();
+		if (opt == 'a') {
+			accurate = 1;
+			continue;
+		}
+		if (argc < 2)
+			usage();
+		argv++, argc--;
+		if (opt == 'n')  samples = parse_size(*argv, 1);
+		if (opt == 'e')  env     = parse_size(*argv, 0);
+		if (opt == 'w')  window  = parse_size(*argv, 0);
+		if ((uint64_t)window >= (uint64_t)HORIZON * 1000)
+			usage();
+		if (opt == 'l')  load    = parse_size(*argv, 0);
+		if (opt == 'p')  trace   = *argv;
+		if (opt == 's')  speed   = parse_size(*argv, 0);
+		if (opt == 'c')  clients = parse_size(*argv, 0), stressed = 1;
+	}
+	if (!argc || (accurate + !!trace + stressed > 1))
+		usage();
+	if (stressed && !clients)
+		clients = (cpus = sysconf(_SC_NPROCESSORS_ONLN), cpus > 0) ? 2 * (size_t)cpus : 2;
+
+	t (!mkdtemp(rundir));
+	created = 1;
+	t (setenv("XDG_RUNTIME_DIR", rundir, 1));
+	t (setup(env));
+
+	printf("# %s %i\n", "sat-bench", OUTPUT_VERSION);
+	if (accurate)
+		printf("# operation\tjobs\twindow-ms\tload\tsamples\tp50-ns\tp99-ns\tmax-ns\tcpu-ns\n");
+	else if (trace)
+		printf("# operation\tjobs\tspeed\tsamples\tp50-ns\tp99-ns\tmax-ns\n");
+	else if (stressed)
+		printf("# operation\tjobs\tclients\tops\tops-per-s\tlock-p50-ns\tlock-p99-ns\tlock-mean-ns\tlost\tduplicated\n");
+	else
+		printf("# operation\tjobs\tenv\tsamples\tp50-ns\tp99-ns\n");
+	for (; *argv; argv++) {
+		size = parse_size(*argv, !accurate && !trace && !stressed);
+		if (accurate)
+			t (accuracy(size, samples, (uint64_t)window * 1000000ULL, load));
+		else if (trace)
+			t (replay(trace, size, speed));
+		else if (stressed)
+			for (n = 1;; n = 2 * n < clients ? 2 * n : clients) {
+				t (stress(size, n, samples));
+				if (n == clients)
+					break;
+			}
+		else
+			t (bench(size, samples, env));
+	}
+
+	nftw(rundir, remove_file, 8, FTW_DEPTH | FTW_PHYS);
+	return 0;
+fail:
+	if (errno)
+		perror(argv0);
+	if (created)
+		nftw(rundir, remove_file, 8, FTW_DEPTH | FTW_PHYS);
+	return 1;
+}
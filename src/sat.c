@@ -21,11 +21,15 @@
  */
 #include "common.h"
 #include "parse_time.h"
+#include <ctype.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <linux/ioprio.h>
 
 
 
 COMMAND("sat")
-USAGE("TIME COMMAND...")
+USAGE("[-q QUEUE] [-r RECURRENCE] [-a JOB-ID[:success | :failure]]... [-b LIMIT[,LIMIT]...] [-c CONTROL[,CONTROL]...] [-s ATTRIBUTE[,ATTRIBUTE]...] [-t TIMEOUT[/GRACE]] [-R ATTEMPTS[/DELAY[/JITTER]]] [-m POLICY[:OVERDUE]] TIME [COMMAND...]")
 
 
 
@@ -63,6 +67,49 @@ store_array(char *restrict storage, char *array[])
 }
 
 
+/**
+ * Copy stdin to a new file in the directory for scripts.
+ * 
+ * @param   path  Output parameter for the file's pathname.
+ * @param   size  Output parameter for the number of bytes in the script.
+ * @return        0 on success, -1 on error.
+ */
+static int
+read_script(char **path, size_t *size)
+{
+	char buf[4096];
+	ssize_t r, w, off;
+	int fd = -1, saved_errno;
+
+	*size = 0;
+	t (!(*path = runtime_path("scripts/new.XXXXXX")));
+	*strrchr(*path, '/') = '\0';
+	t (mkdir(*path, S_IRWXU) && (errno != EEXIST));
+	(*path)[strlen(*path)] = '/';
+	t (fd = mkstemp(*path), fd == -1);
+	for (;;) {
+		if (r = read(STDIN_FILENO, buf, sizeof(buf)), r <= 0) {
+			t (r && (errno != EINTR));
+			if (!r)
+				break;
+			continue;
+		}
+		for (off = 0; off < r; off += w)
+			t (w = write(fd, buf + off, (size_t)(r - off)), w < 0);
+		*size += (size_t)r;
+	}
+	t (close(fd));
+	return 0;
+fail:
+	saved_errno = errno;
+	if (fd >= 0)
+		close(fd), unlink(*path);
+	free(*path), *path = NULL;
+	errno = saved_errno;
+	return -1;
+}
+
+
 /**
  * Construct the job specifications, as a storable unit.
  * 
@@ -71,7 +118,7 @@ store_array(char *restrict storage, char *array[])
  * @param   envp  `envp` from `main`, see `main` for descriptor.
  * @return        The job (sans serial number) on success, `NULL` on error.
  */
-static struct job *
+static struct job_full *
 construct_job(int argc, char *argv[], char *envp[])
 {
 #define E(CASE, DESC)       case CASE: fprintf(stderr, "%s: %s: %s\n", argv0, DESC, argv[1]), exit(2)
@@ -81,7 +128,7 @@ construct_job(int argc, char *argv[], char *envp[])
 	void *new;
 	size_t size = 64;
 	struct job job = { .no = 0 };
-	struct job *job_full = NULL;
+	struct job_full *job_full = NULL;
 	int saved_errno;
 
 	timearg = argv[1];
@@ -96,6 +143,7 @@ construct_job(int argc, char *argv[], char *envp[])
 		default: goto fail;
 		}
 	}
+	t (clock_gettime(job.clk, &(job.queued)));
 
 retry:
 	/* Get the size of the current working directory's pathname. */
@@ -107,9 +155,11 @@ retry:
 	size = strlen(getcwd(dummy, size)) + 1;
 
 	/* Construct full specification. */
-	job.n = measure_array(argv) + size + measure_array(envp);
+	job.wdir_off = measure_array(argv);
+	job.envp_off = job.wdir_off + size;
+	job.n = job.envp_off + measure_array(envp);
 	t (!(job_full = malloc(sizeof(job) + job.n)));
-	memcpy(job_full, &job, sizeof(job));
+	job_full->job = job;
 	store_array(getcwd(store_array(job_full->payload, argv), size) + size, envp);
 
 fail:
@@ -117,16 +167,451 @@ fail:
 }
 
 
+/**
+ * Make a job recurring.
+ * 
+ * @param   job   The job, its clock must be set.
+ * @param   spec  The recurrence specification, see `parse_recurrence`.
+ * @return        0 on success, -1 if `spec` is invalid,
+ *                in which case an error message is printed.
+ */
+static int
+set_recurrence(struct job *job, const char *spec)
+{
+	const char *error = NULL;
+	int r = parse_recurrence(spec, &(job->interval), job->calendar);
+
+	if (r < 0)
+		error = errno == ERANGE ? "the specified interval is beyond the limit of what can be stored"
+		                        : "recurrence could not be parsed";
+	else if ((r == 'c') && (job->clk != CLOCK_REALTIME))
+		error = "calendar recurrence requires a wall-clock time";
+	if (error)
+		return fprintf(stderr, "%s: %s: %s\n", argv0, error, spec), -1;
+	job->recur = (char)r;
+	return 0;
+}
+
+
+/**
+ * Set the longest time a job may run.
+ * 
+ * @param   job   The job.
+ * @param   spec  The timeout, in seconds, optionally followed
+ *                by "/" and the grace period, in seconds.
+ * @return        0 on success, -1 if `spec` is invalid,
+ *                in which case an error message is printed.
+ */
+static int
+set_timeout(struct job *job, char *spec)
+{
+	char *grace = strchr(spec, '/');
+	int r;
+
+	if (grace)
+		*grace++ = '\0';
+	job->grace.tv_sec = TIMEOUT_GRACE;
+	r = parse_duration(spec, &(job->timeout)) || (grace && parse_duration(grace, &(job->grace)));
+	if (grace)
+		*--grace = '/';
+	if (!r && (job->timeout.tv_sec || job->timeout.tv_nsec))
+		return 0;
+	return fprintf(stderr, "%s: %s: %s\n", argv0, errno == ERANGE ? "the specified timeout is too long"
+	               : "timeout could not be parsed", spec), -1;
+}
+
+
+/**
+ * Make a job be retried when it fails.
+ * 
+ * @param   job   The job, its recurrence must be set.
+ * @param   spec  The maximum number of times to run the job,
+ *                optionally followed by "/" and the delay, in
+ *                seconds, before the first retry, optionally
+ *                followed by "/" and the jitter, in percent.
+ * @return        0 on success, -1 if `spec` is invalid,
+ *                in which case an error message is printed.
+ */
+static int
+set_retries(struct job *job, char *spec)
+{
+	char *delay = strchr(spec, '/');
+	char *jitter = delay ? strchr(delay + 1, '/') : NULL;
+	char *end;
+	unsigned long int n;
+	const char *error = NULL;
+
+	if (job->recur)
+		return fprintf(stderr, "%s: a recurring job cannot be retried\n", argv0), -1;
+	if (delay)   *delay++ = '\0';
+	if (jitter)  *jitter++ = '\0';
+	job->retry_delay.tv_sec = 1;
+	n = (errno = 0, strtoul)(spec, &end, 10);
+	if (errno || *end || !isdigit(*spec) || !n || (n > UINT_MAX))
+		error = "the number of attempts could not be parsed";
+	else if (job->attempts = (unsigned int)n, delay && parse_duration(delay, &(job->retry_delay)))
+		error = errno == ERANGE ? "the specified delay is too long" : "the delay could not be parsed";
+	else if (jitter && (n = (errno = 0, strtoul)(jitter, &end, 10), errno || *end || !isdigit(*jitter) || (n > 100)))
+		error = "the jitter could not be parsed";
+	else if (jitter)
+		job->jitter = (unsigned char)n;
+	if (jitter)  *--jitter = '/';
+	if (delay)   *--delay = '/';
+	if (error)
+		return fprintf(stderr, "%s: %s: %s\n", argv0, error, spec), -1;
+	return 0;
+}
+
+
+/**
+ * Set what to do with a job that has been overdue for long.
+ * 
+ * @param   job   The job.
+ * @param   spec  "run", "skip", or "once", optionally followed by
+ *                ":" and the time, in seconds, after which the job
+ *                is overdue, which is zero unless specified. "run"
+ *                cannot be followed by a time.
+ * @return        0 on success, -1 if `spec` is invalid,
+ *                in which case an error message is printed.
+ */
+static int
+set_staleness(struct job *job, char *spec)
+{
+	char *overdue = strchr(spec, ':');
+	int r = 0;
+
+	if (overdue)
+		*overdue++ = '\0';
+	if (!strcmp(spec, "run") && !overdue)  job->stale = 'r';
+	else if (!strcmp(spec, "skip"))        job->stale = 's';
+	else if (!strcmp(spec, "once"))        job->stale = 'o';
+	else                                   r = -1, errno = 0;
+	r = r || (overdue && parse_duration(overdue, &(job->overdue)));
+	if (overdue)
+		*--overdue = ':';
+	if (!r)
+		return 0;
+	return fprintf(stderr, "%s: %s: %s\n", argv0, errno == ERANGE ? "the specified time is too long"
+	               : "overdue policy could not be parsed", spec), -1;
+}
+
+
+/**
+ * Make a job wait for another job.
+ * 
+ * @param   job   The job.
+ * @param   spec  The other job's number, optionally followed
+ *                by ":success" or ":failure".
+ * @return        0 on success, -1 if `spec` is invalid,
+ *                in which case an error message is printed.
+ */
+static int
+add_prerequisite(struct job *job, const char *spec)
+{
+	char *end;
+	size_t no = (errno = 0, strtoul)(spec, &end, 10);
+	int i = 0;
+	char on;
+
+	if (errno || !isdigit(*spec))       goto invalid;
+	if (!*end)                          on = 0;
+	else if (!strcmp(end, ":success"))  on = 's';
+	else if (!strcmp(end, ":failure"))  on = 'f';
+	else                                goto invalid;
+
+	while (job->waiting & (1 << i))
+		i++;
+	job->after[i] = no;
+	job->after_on[i] = on;
+	job->waiting |= 1 << i;
+	return 0;
+invalid:
+	return fprintf(stderr, "%s: job dependency could not be parsed: %s\n", argv0, spec), -1;
+}
+
+
+/**
+ * Defer a job, once its time has expired, until the system is quiet enough.
+ * 
+ * @param   job   The job.
+ * @param   spec  Comma-separated limits: "cpu=", "io=", or "memory="
+ *                followed by the highest pressure, in percent, or
+ *                "load=" followed by the highest load average.
+ * @return        0 on success, -1 if `spec` is invalid, or if
+ *                the pressure stall information is not available,
+ *                in which case an error message is printed.
+ */
+static int
+set_limits(struct job *job, char *spec)
+{
+	const char *resources[] = PRESSURE_RESOURCES;
+	char path[sizeof("/proc/pressure/memory")];
+	char *limit, *value, *end;
+	double load;
+	long int pct;
+	size_t i;
+
+	for (limit = strtok(spec, ","); limit; limit = strtok(NULL, ",")) {
+		if (!(value = strchr(limit, '=')) || !isdigit(value[1]))
+			goto invalid;
+		*value = '\0';
+		if (!strcmp(limit, "load")) {
+			load = (errno = 0, strtod)(value + 1, &end);
+			if (errno || *end || (load <= 0) || (load * 100 >= (double)UINT_MAX))
+				goto invalid;
+			job->load = (unsigned int)(load * 100 + 0.5);
+			job->load += !job->load;
+			continue;
+		}
+		for (i = 0; (i < 3) && strcmp(limit, resources[i]); i++);
+		pct = (errno = 0, strtol)(value + 1, &end, 10);
+		if ((i == 3) || errno || *end || (pct < 1) || (pct > 100))
+			goto invalid;
+		sprintf(path, "/proc/pressure/%s", resources[i]);
+		if (access(path, R_OK | W_OK))
+			return fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno)), -1;
+		job->pressure[i] = (unsigned char)pct;
+	}
+	return 0;
+invalid:
+	if (value)
+		*value = '=';
+	return fprintf(stderr, "%s: limit could not be parsed: %s\n", argv0, limit), -1;
+}
+
+
+/**
+ * Check that a cgroup controller is available in SAT_CGROUP.
+ * 
+ * @param   controller  The controller.
+ * @return              0 if available, -1 otherwise, in
+ *                      which case an error message is printed.
+ */
+static int
+check_controller(const char *controller)
+{
+	const char *cgroup = getenv("SAT_CGROUP");
+	char buf[1024], *path = NULL, *word;
+	ssize_t r = -1;
+	int fd;
+
+	if (!cgroup || !*cgroup)
+		return fprintf(stderr, "%s: SAT_CGROUP must be set to use cgroup controls\n", argv0), -1;
+	if ((path = malloc(strlen(cgroup) + sizeof("/cgroup.controllers")))) {
+		stpcpy(stpcpy(path, cgroup), "/cgroup.controllers");
+		if (fd = open(path, O_RDONLY), fd >= 0)
+			r = read(fd, buf, sizeof(buf) - 1), close(fd);
+	}
+	if (r < 0)
+		return fprintf(stderr, "%s: %s: %s\n", argv0, path ? path : cgroup, strerror(errno)), free(path), -1;
+	free(path);
+	buf[r] = '\0';
+	for (word = strtok(buf, " \n"); word; word = strtok(NULL, " \n"))
+		if (!strcmp(word, controller))
+			return 0;
+	return fprintf(stderr, "%s: the %s controller is not available in %s\n", argv0, controller, cgroup), -1;
+}
+
+
+/**
+ * Set the limits that a job's cgroup shall have.
+ * 
+ * @param   job   The job.
+ * @param   spec  Comma-separated controls: "cpu.weight=" or "io.weight="
+ *                followed by a weight, "cpu.max=" followed by a quota,
+ *                and optionally by "/" and a period, in microseconds,
+ *                or "memory.max=" followed by a number of bytes,
+ *                optionally suffixed by "K", "M", or "G".
+ * @return        0 on success, -1 if `spec` is invalid, or if
+ *                a controller is not available, in which case
+ *                an error message is printed.
+ */
+static int
+set_controls(struct job *job, char *spec)
+{
+	char *control, *value, *end, *state = NULL;
+	unsigned long long int n;
+
+	for (control = strtok_r(spec, ",", &state); control; control = strtok_r(NULL, ",", &state)) {
+		if (!(value = strchr(control, '=')) || !isdigit(value[1]))
+			goto invalid;
+		*value = '\0';
+		n = (errno = 0, strtoull)(value + 1, &end, 10);
+		if (errno || !n)
+			goto invalid;
+		if (!strcmp(control, "cpu.weight") || !strcmp(control, "io.weight")) {
+			if (*end || (n > 10000))
+				goto invalid;
+			if (*control == 'c')
+				job->cpu_weight = (unsigned int)n;
+			else
+				job->io_weight = (unsigned int)n;
+		} else if (!strcmp(control, "cpu.max")) {
+			job->cpu_max[0] = (unsigned long int)n;
+			job->cpu_max[1] = 100000;
+			if ((*end == '/') && isdigit(end[1]))
+				job->cpu_max[1] = (errno = 0, strtoul)(end + 1, &end, 10);
+			if (errno || *end || (n > 1000000) || (job->cpu_max[1] < 1000) || (job->cpu_max[1] > 1000000))
+				goto invalid;
+		} else if (!strcmp(control, "memory.max")) {
+			if ((*end && end[1]) || (n > (ULLONG_MAX >> 30)))
+				goto invalid;
+			switch (*end) {
+			case 'G':  n <<= 10; /* fall through */
+			case 'M':  n <<= 10; /* fall through */
+			case 'K':  n <<= 10; /* fall through */
+			case '\0':  break;
+			default:   goto invalid;
+			}
+			job->memory_max = (uint64_t)n;
+		} else {
+			goto invalid;
+		}
+		if (check_controller(control[0] == 'c' ? "cpu" : control[0] == 'i' ? "io" : "memory"))
+			return -1;
+	}
+	return 0;
+invalid:
+	if (value)
+		*value = '=';
+	return fprintf(stderr, "%s: cgroup control could not be parsed: %s\n", argv0, control), -1;
+}
+
+
+/**
+ * Set the CPU affinity, niceness, I/O priority,
+ * and scheduling policy that a job shall run with.
+ * 
+ * @param   job   The job.
+ * @param   spec  Comma-separated attributes: "cpus=" followed by a list of
+ *                CPUs and ranges of CPUs, which continues until the next
+ *                attribute, "nice=" followed by a niceness, "ioprio=" followed
+ *                by "idle", "best-effort", or "realtime", and optionally,
+ *                except for "idle", by ":" and a level, or "policy=" followed
+ *                by "other", "batch", "idle", or by "fifo" or "rr", ":",
+ *                and a real-time priority.
+ * @return        0 on success, -1 if `spec` is invalid, in
+ *                which case an error message is printed.
+ */
+static int
+set_attributes(struct job *job, char *spec)
+{
+	const unsigned long int bits = CHAR_BIT * sizeof(long int);
+	char *attribute, *value, *end, *state = NULL;
+	unsigned long int first, last;
+	long int n;
+	int cpus = 0, class;
+
+	for (attribute = strtok_r(spec, ",", &state); attribute; attribute = strtok_r(NULL, ",", &state)) {
+		if ((value = strchr(attribute, '=')))
+			cpus = !strncmp(attribute, "cpus=", 5), value++;
+		else if (cpus)
+			value = attribute;
+		else
+			goto invalid;
+		errno = 0;
+		if (cpus) {
+			if (!isdigit(*value))
+				goto invalid;
+			first = last = strtoul(value, &end, 10);
+			if ((*end == '-') && isdigit(end[1]))
+				last = strtoul(end + 1, &end, 10);
+			if (errno || *end || (first > last) || (last >= AFFINITY_CPUS))
+				goto invalid;
+			for (; first <= last; first++)
+				job->cpus[first / bits] |= 1UL << (first % bits);
+		} else if (!strncmp(attribute, "nice=", 5)) {
+			if (!isdigit(value[*value == '-']))
+				goto invalid;
+			n = strtol(value, &end, 10);
+			if (errno || *end || (n < -20) || (n > 19))
+				goto invalid;
+			job->renice = 1;
+			job->nice = (int)n;
+		} else if (!strncmp(attribute, "ioprio=", 7)) {
+			n = 4;
+			if ((end = strchr(value, ':'))) {
+				if (!isdigit(end[1]) || end[2] || ((n = end[1] - '0') > 7))
+					goto invalid;
+				*end = '\0';
+			}
+			class = (!strcmp(value, "idle") && !end) ? IOPRIO_CLASS_IDLE :
+			        !strcmp(value, "best-effort")     ? IOPRIO_CLASS_BE   :
+			        !strcmp(value, "realtime")        ? IOPRIO_CLASS_RT   : IOPRIO_CLASS_NONE;
+			if (end)
+				*end = ':';
+			if (class == IOPRIO_CLASS_NONE)
+				goto invalid;
+			job->ioprio = IOPRIO_PRIO_VALUE(class, class == IOPRIO_CLASS_IDLE ? 0 : n);
+		} else if (!strncmp(attribute, "policy=", 7)) {
+			end = strchr(value, ':');
+			if (!strcmp(value, "other") || !strcmp(value, "batch") || !strcmp(value, "idle")) {
+				job->policy = *value;
+			} else if (end && (!strncmp(value, "fifo:", 5) || !strncmp(value, "rr:", 3)) && isdigit(end[1])) {
+				n = strtol(end + 1, &end, 10);
+				if (errno || *end || (n < 1) || (n > 99))
+					goto invalid;
+				job->policy = *value == 'f' ? 'f' : 'r';
+				job->rtprio = (int)n;
+			} else {
+				goto invalid;
+			}
+		} else {
+			goto invalid;
+		}
+	}
+	return 0;
+invalid:
+	return fprintf(stderr, "%s: scheduling attribute could not be parsed: %s\n", argv0, attribute), -1;
+}
+
+
+/**
+ * Check that a job's scheduling attributes can be
+ * applied, by applying them in a child process, so that
+ * a job that cannot be run as requested, is not queued.
+ * 
+ * @param   job  The job.
+ * @return       0 on success, -1 if they cannot be applied,
+ *               in which case an error message is printed.
+ */
+static int
+check_attributes(const struct job *job)
+{
+	int status;
+	pid_t pid;
+
+	if (pid = fork(), !pid)
+		_exit(apply_attributes(job) ? errno : 0);
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid))
+		return fprintf(stderr, "%s: %s\n", argv0, strerror(errno)), -1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return fprintf(stderr, "%s: the scheduling attributes cannot be applied: %s\n", argv0,
+		               strerror(WIFEXITED(status) ? WEXITSTATUS(status) : EINTR)), -1;
+	return 0;
+}
+
+
 /**
  * Queue a job for later execution.
  * 
  * @param   argc  You guess!
  * @param   argv  The first element should be the name of the process,
- *                the second argument should be the POSIX time (seconds
+ *                optionally followed by "-q" and a queue, by "-r" and a recurrence
+ *                specification, by "-a" and a job the job
+ *                shall wait for (repeatable), by "-b" and
+ *                the limits the job is deferred by, and by "-c" and
+ *                the limits of the job's cgroup, and by "-s" and
+ *                the job's scheduling attributes, and by "-t" and
+ *                the longest time the job may run, and by "-R" and
+ *                how the job is retried if it fails, and by "-m" and
+ *                what to do if the job is overdue, the next argument
+ *                should be the POSIX time (seconds
  *                since Epoch (1970-01-01 00:00:00 UTC), disregarding
  *                leap seconds) the job shall be executed. The rest of
- *                the arguments (being at least one) shoul be the
- *                command line arguments for the job the run.
+ *                the arguments shoul be the command line arguments
+ *                for the job the run. If there are none, the job
+ *                is a script, read from stdin, that is run by sh(1).
  * @param   envp  The environment.
  * @return  0     The process was successful.
  * @return  1     The process failed queuing the job.
@@ -136,33 +621,105 @@ fail:
 int
 main(int argc, char *argv[], char *envp[])
 {
-#define WRITE(MSG, N, OFF)  t (pwriten(STATE_FILENO, MSG, (size_t)(N), (size_t)(OFF)) < (ssize_t)(N))
-
-	struct job *job = NULL;
-	struct stat attr;
-	ssize_t r;
-	PROLOGUE((argc > 2) && (argv[1][0] != '-'), O_RDWR);
+	struct job_full *job_full = NULL;
+	struct job *job;
+	struct state_header header;
+	char *script_argv[4];
+	char *script = NULL, *path = NULL, *recurrence = NULL, *limits = NULL, *controls = NULL;
+	char *attributes = NULL, *timeout = NULL, *retries = NULL, *staleness = NULL, *name;
+	char *after[MAX_PREREQUISITES];
+	size_t size = 0;
+	int r, i, nafter = 0, locked = 0;
+	PROLOGUE(argc > 1, O_RDWR);
 	t (set_hookpath());
 
-	t (!(job = construct_job(argc, argv, envp)));
+	/* Parse options, and keep the process name just before TIME. */
+	for (name = *argv++, argc--; (argc > 1) && (argv[0][0] == '-'); argv += 2, argc -= 2) {
+		if (!strcmp(argv[0], "-r") && !recurrence)
+			recurrence = argv[1];
+		else if (!strcmp(argv[0], "-a") && (nafter < MAX_PREREQUISITES))
+			after[nafter++] = argv[1];
+		else if (!strcmp(argv[0], "-b") && !limits)
+			limits = argv[1];
+		else if (!strcmp(argv[0], "-c") && !controls)
+			controls = argv[1];
+		else if (!strcmp(argv[0], "-s") && !attributes)
+			attributes = argv[1];
+		else if (!strcmp(argv[0], "-t") && !timeout)
+			timeout = argv[1];
+		else if (!strcmp(argv[0], "-R") && !retries)
+			retries = argv[1];
+		else if (!strcmp(argv[0], "-m") && !staleness)
+			staleness = argv[1];
+		else
+			usage();
+	}
+	if (!argc || (argv[0][0] == '-'))
+		usage();
+	*--argv = name, argc++;
+
+	if (argc == 2) {
+		t (read_script(&script, &size));
+		if (!size) {
+			fprintf(stderr, "%s: the script is empty\n", argv0);
+			unlink(script), free(script);
+			exit(2);
+		}
+		script_argv[0] = argv[0], script_argv[1] = argv[1];
+		script_argv[2] = "sh", script_argv[3] = NULL;
+		argc = 3, argv = script_argv;
+	}
+	t (!(job_full = construct_job(argc, argv, envp)));
+	job = &(job_full->job);
+	job->script = size;
+	for (i = 0, r = 0; !r && (i < nafter); i++)
+		r = add_prerequisite(job, after[i]);
+	if (r || (recurrence && set_recurrence(job, recurrence)) || (limits && set_limits(job, limits)) ||
+	    (controls && set_controls(job, controls)) ||
+	    (attributes && (set_attributes(job, attributes) || check_attributes(job))) ||
+	    (timeout && set_timeout(job, timeout)) || (retries && set_retries(job, retries)) ||
+	    (staleness && set_staleness(job, staleness)))
+		goto user_error;
 
 	/* Update state file and run hook. */
-	t (flock(STATE_FILENO, LOCK_EX));
-	t (fstat(STATE_FILENO, &attr));
-	t (r = preadn(STATE_FILENO, &(job->no), sizeof(job->no), (size_t)0), r < 0);
-	if (r < (ssize_t)sizeof(job->no))  job->no = 0;
-	else                               job->no += 1;
-	WRITE(&(job->no), sizeof(job->no), (size_t)0);
-	if (attr.st_size < (off_t)sizeof(job->no))
-		attr.st_size = (off_t)sizeof(job->no);
-	WRITE(job, sizeof(*job) + job->n, (size_t)(attr.st_size));
+	t (lock_state(LOCK_EX));
+	locked = 1;
+	for (i = 0; job->waiting >> i; i++) {
+		t (r = is_queued(job->after[i]), r < 0);
+		if (!r) {
+			fprintf(stderr, "%s: job %zu is not queued\n", argv0, job->after[i]);
+			goto user_error;
+		}
+	}
+	t (r = read_header(&header), r < 0);
+	job->no = header.no = r ? header.no + 1 : 0;
+	if (script) {
+		t (!(path = script_path(job->no)));
+		t (rename(script, path));
+		free(script), script = NULL;
+	}
+	t (add_job(&header, job_full));
+	t (write_header(&header));
 	fsync(STATE_FILENO);
-	run_job_or_hook(job, "queued");
+	free(path), path = NULL;
+	log_trace('q', job, 0); /* Failure isn't fatal. */
+	run_job_or_hook(job_full, "queued", NULL);
 	t (flock(STATE_FILENO, LOCK_UN));
+	locked = 0;
 
 	t (poke_daemon(1, argv0));
 	CLEANUP_START;
-	free(job);
+	if (script)  unlink(script);
+	if (path)    unlink(path);
+	if (locked)  flock(STATE_FILENO, LOCK_UN);
+	free(script);
+	free(path);
+	free(job_full);
 	CLEANUP_END;
+
+user_error:
+	if (script)
+		unlink(script);
+	exit(2);
 }
 
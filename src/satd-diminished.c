@@ -20,7 +20,10 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include "common.h"
+#include "metrics.h"
+#include "virtual_clock.h"
 #include <sys/wait.h>
+#include <dirent.h>
 
 
 
@@ -56,6 +59,13 @@ static volatile pid_t timer_pid = NO_TIMER_SPAWNED;
  */
 static volatile pid_t child_count = 0;
 
+/**
+ * The signal mask to wait with, the signals we
+ * handle are blocked whilst we do not wait, so
+ * that none is received just before we wait.
+ */
+static sigset_t unblocked;
+
 /**
  * Timer specification for an unset timer.
  */
@@ -119,6 +129,7 @@ spawn(char *argv[], char *envp[])
 
 	/* Child. */
 	close(LOCK_FILENO);
+	sigprocmask(SIG_SETMASK, &unblocked, NULL);
 	execve(DAEMON_IMAGE("timer"), argv, envp);
 	perror(argv[0]);
 	exit(1);
@@ -155,11 +166,53 @@ test_timer(int fd, const fd_set *fdset)
 	int64_t _overrun;
 	if (!FD_ISSET(fd, fdset))                return 0;
 	if (read(fd, &_overrun, (size_t)8) < 8)  return -1;
+	metrics_count(fd == BOOT_FILENO ? METRIC(wakeups[CLOCK_INDEX(CLOCK_BOOTTIME)])
+	                                : METRIC(wakeups[CLOCK_INDEX(CLOCK_REALTIME)]), 1, 0);
 	if (timer_pid == NO_TIMER_SPAWNED)       return 1;
 	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &nilspec, NULL) * 2 + 1;
 }
 
 
+/**
+ * Determine whether a job is running in one of the queue's slots.
+ * 
+ * The processes that run jobs in slots are not our children,
+ * and the job is removed from the state file before it runs,
+ * unless it can be retried, so this is how we know about it.
+ * 
+ * @return  1 if any slot is held, 0 otherwise, -1 on error.
+ */
+static int
+is_slot_held(void)
+{
+	char *path;
+	DIR *dir;
+	struct dirent *f;
+	int fd, r = 0, saved_errno;
+
+	if (!(path = runtime_path("slots")))
+		return -1;
+	dir = opendir(path);
+	free(path);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+	while (!r && (errno = 0, f = readdir(dir))) {
+		if (*(f->d_name) == '.')
+			continue;
+		t (fd = openat(dirfd(dir), f->d_name, O_RDONLY | O_CLOEXEC), fd == -1);
+		if (flock(fd, LOCK_SH | LOCK_NB))
+			r = errno == EWOULDBLOCK ? 1 : -1;
+		close(fd);
+	}
+	t ((r < 0) || (!r && errno));
+	closedir(dir);
+	return r;
+fail:
+	S(closedir(dir));
+	return -1;
+}
+
+
 /**
  * The sat daemon.
  * 
@@ -172,13 +225,23 @@ test_timer(int fd, const fd_set *fdset)
 int
 main(int argc, char *argv[], char *envp[])
 {
-	int fd = -1, rc = 0, r, expired = 0;
+	int fd = -1, rc = 0, r, expired = 0, fired = 0, poked = 0;
 	fd_set fdset;
 	struct stat attr;
+	sigset_t blocked;
+
+	t (low_latency() < 0);
 
 	/* Set up signal handlers. */
 	t (signal(SIGHUP,  sighandler) == SIG_ERR);
 	t (signal(SIGCHLD, sighandler) == SIG_ERR);
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGHUP);
+	sigaddset(&blocked, SIGCHLD);
+	t (sigprocmask(SIG_BLOCK, &blocked, &unblocked));
+	/* They are still blocked if we were re-executed on SIGHUP. */
+	sigdelset(&unblocked, SIGHUP);
+	sigdelset(&unblocked, SIGCHLD);
 
 	/* The magnificent loop. */
 again:
@@ -187,34 +250,46 @@ again:
 		execve(DAEMON_IMAGE("diminished"), argv, envp);
 		perror(argv[0]);
 	}
-	/* Need to set new timer values? */
-	if ((received_signo == SIGCHLD) && !child_count)
+	/* Need to set new timer values, or run expired jobs? A poke is kept until
+	 * it can be served, the running "timer" may have read the queue too early. */
+	poked |= (received_signo == SIGCHLD);
+	if ((poked || fired) && !child_count) {
 		t (spawn(argv, envp));
+		poked = fired = 0;
+	}
 	received_signo = 0;
 #if 1 || !defined(DEBUG)
 	/* Can we quit yet? */
 	if (expired && !child_count) {
 		t (r = is_timer_set(BOOT_FILENO), r < 0);  if (r) goto not_done;
 		t (r = is_timer_set(REAL_FILENO), r < 0);  if (r) goto not_done;
+		/* A job that is running, and can be retried, is kept in the state file. */
 		t (fstat(STATE_FILENO, &attr));
-		if (attr.st_size > (off_t)sizeof(size_t))
-			t (spawn(argv, envp));
-		else
+		t (r = is_slot_held(), r < 0);
+		if (!r && (attr.st_size <= (off_t)sizeof(struct state_header)))
 			goto done;
+		/* The jobs that are left without a timer are waiting for other
+		 * jobs, or for a slot, and we are poked when they can run. */
 	 }
 #endif
 not_done:
+#ifdef VIRTUAL_CLOCK
+	/* Skip ahead to the next expiration, unless something is going on. */
+	if (!child_count && !received_signo)
+		t (virtual_clock_advance());
+#endif
 	/* Wait for something to happen. */
 	FD_ZERO(&fdset);
 	FD_SET(BOOT_FILENO, &fdset);
 	FD_SET(REAL_FILENO, &fdset); /* This is the highest one. */
-	if (select(REAL_FILENO + 1, &fdset, NULL, NULL, NULL) == -1) {
+	if (pselect(REAL_FILENO + 1, &fdset, NULL, NULL, NULL, &unblocked) == -1) {
 		t (errno != EINTR);
 		goto again;
 	}
 	/* Was any jobs expired? */
-	t ((expired |= test_timer(BOOT_FILENO, &fdset)) < 0);
-	t ((expired |= test_timer(REAL_FILENO, &fdset)) < 0);
+	t ((fired |= test_timer(BOOT_FILENO, &fdset)) < 0);
+	t ((fired |= test_timer(REAL_FILENO, &fdset)) < 0);
+	expired |= fired;
 	goto again;
 
 fail:
@@ -20,21 +20,334 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include "common.h"
+#include "metrics.h"
+#include <poll.h>
 
 
 
 /**
- * Pretty self-explanatory.
+ * The window, in microseconds, in which the pressure on
+ * a resource must stay below a deferred job's limits for
+ * the job to run. Unprivileged processes can only use
+ * multiples of 2 seconds.
  */
-#ifdef __GNUC__
-__attribute__((__pure__))
-#endif
-static inline int
-timecmp(const struct timespec *a, const struct timespec *b)
+#define PRESSURE_WINDOW  2000000L
+
+/**
+ * How often, in seconds, we check whether the process
+ * that runs a job that may be retried is still alive.
+ */
+#define RUNNING_RECHECK  5
+
+
+
+/**
+ * A token bucket for a launch-rate limit, stored
+ * in a file in the runtime directory, so that it
+ * is kept between runs.
+ */
+struct bucket {
+	/**
+	 * The number of jobs that may be started, it is
+	 * negative if more jobs than allowed have been started.
+	 */
+	double tokens;
+
+	/**
+	 * When `tokens` was last updated, in `CLOCK_BOOTTIME`.
+	 */
+	struct timespec when;
+};
+
+
+
+/**
+ * Wait until the system is quiet enough for a deferred job.
+ * 
+ * The pressure is watched with triggers, which are notified
+ * when the pressure exceeds the limit within a window, so the
+ * system is quiet enough once a whole window has passed without
+ * a notification. Notifications are sent at most once per window,
+ * so we wait half a window more than that. The load average cannot
+ * be watched, so it is checked at the end of such wait.
+ * 
+ * @param   job  The job.
+ * @return       0 when the system is quiet enough, or if the
+ *               job has been removed, -1 on error.
+ */
+static int
+wait_for_quiet(const struct job *job)
 {
-	if (a->tv_sec  != b->tv_sec)   return (a->tv_sec  < b->tv_sec  ? -1 : +1);
-	if (a->tv_nsec != b->tv_nsec)  return (a->tv_nsec < b->tv_nsec ? -1 : +1);
+	const char *resources[] = PRESSURE_RESOURCES;
+	char path[sizeof("/proc/pressure/memory")];
+	char trigger[sizeof("some  ") + 2 * 3 * sizeof(long int)];
+	struct pollfd fds[3];
+	double load;
+	nfds_t i, n = 0;
+	int r, queued, saved_errno;
+	FILE *f;
+
+	for (i = 0; i < 3; i++) {
+		if (!job->pressure[i])
+			continue;
+		sprintf(path, "/proc/pressure/%s", resources[i]);
+		sprintf(trigger, "some %li %li", job->pressure[i] * (PRESSURE_WINDOW / 100), PRESSURE_WINDOW);
+		t (fds[n].fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC), fds[n].fd == -1);
+		fds[n++].events = POLLPRI;
+		t (write(fds[n - 1].fd, trigger, strlen(trigger) + 1) < 0);
+	}
+
+	for (;;) {
+		if (r = poll(fds, n, (int)(PRESSURE_WINDOW * 3 / 2000)), r < 0) {
+			t (errno != EINTR);
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			t (errno = EIO, fds[i].revents & (POLLERR | POLLNVAL));
+		t (lock_state(LOCK_SH));
+		queued = is_queued(job->no);
+		S(flock(STATE_FILENO, LOCK_UN));
+		t (queued < 0);
+		if (!queued)
+			break;
+		if (r)
+			continue; /* A limit was exceeded, wait for another whole window. */
+		if (job->load) {
+			t (!(f = fopen("/proc/loadavg", "r")));
+			r = fscanf(f, "%lf", &load);
+			fclose(f);
+			t (errno = EIO, r != 1);
+			if (load * 100 > job->load)
+				continue;
+		}
+		break;
+	}
+
+	while (n--)
+		close(fds[n].fd);
+	return 0;
+fail:
+	saved_errno = errno;
+	while (n--)
+		close(fds[n].fd);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Start a process, unless one is already running, that waits
+ * until the system is quiet enough for a deferred job, marks
+ * the job, and pokes satd(1) so that the job is run.
+ * 
+ * @param   job  The job's header.
+ * @return       0 on success, -1 on error.
+ */
+static int
+defer(const struct job_header *job)
+{
+	char name[sizeof("deferred/") + 3 * sizeof(size_t)];
+	char *path = NULL;
+	struct job attrs;
+	int fd = -1, r, saved_errno;
+	pid_t pid;
+
+	sprintf(name, "deferred/%zu", job->no);
+	t (!(path = runtime_path(name)));
+	*strrchr(path, '/') = '\0';
+	t (mkdir(path, S_IRWXU) && (errno != EEXIST));
+	path[strlen(path)] = '/';
+	/* The file is kept locked by the process, so that only one is started. */
+	t (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR), fd == -1);
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		t (errno != EWOULDBLOCK);
+		goto done;
+	}
+	t (pid = fork(), pid == -1);
+	if (!pid) {
+		/* A lock of our own, the one we inherited is shared with the parent. */
+		close(BOOT_FILENO), close(REAL_FILENO);
+		if (reopen(STATE_FILENO, O_RDWR) || (r = get_job(job->no, &attrs), r < 0))
+			perror("satd-timer"), exit(1);
+		/* The limits are not in the header, and the job may have been removed. */
+		if (r && (wait_for_quiet(&attrs) || mark_quiet(job->no)))
+			perror("satd-timer"), exit(1);
+		unlink(path);
+		poke_daemon(0, "satd-timer");
+		exit(0);
+	}
+done:
+	free(path);
+	close(fd);
 	return 0;
+fail:
+	S(free(path), close(fd));
+	return -1;
+}
+
+
+/**
+ * Take a token from the queue's launch-rate bucket, and
+ * the bucket for all queues, or give one back.
+ * 
+ * The buckets are refilled in `CLOCK_BOOTTIME`, so they
+ * are full, rather than empty, after the computer has been
+ * suspended, and jobs that expired whilst it was suspended
+ * are started at the limited rate once the burst is used.
+ * 
+ * @param   rate  The queue's and all queues' launch-rate limits.
+ * @param   take  1 to take a token, if there is one in both buckets,
+ *                -1 to give back a token that was taken.
+ * @param   when  Output parameter for when, in `CLOCK_BOOTTIME`,
+ *                there will be a token in both buckets, if there
+ *                is not one now.
+ * @return        0 on success, 1 if there is not a token in
+ *                both buckets, -1 on error.
+ */
+static int
+take_token(const struct launch_rate rate[2], int take, struct timespec *when)
+{
+	struct bucket buckets[2];
+	struct timespec now;
+	const char *dir;
+	char *path = NULL;
+	double elapsed, wait = 0;
+	int fds[2] = {-1, -1}, i, rc = 0, saved_errno;
+	ssize_t r;
+
+	t (clock_gettime(CLOCK_BOOTTIME, &now));
+	for (i = 0; i < 2; i++) {
+		if (!rate[i].rate)
+			continue;
+		if (i) {
+			/* The bucket for all queues is in the default queue's runtime directory. */
+			dir = getenv("XDG_RUNTIME_DIR"), dir = (dir ? dir : "/run");
+			t (!(path = malloc(strlen(dir) + sizeof("/" PACKAGE "/launches.all"))));
+			stpcpy(stpcpy(path, dir), "/" PACKAGE "/launches.all");
+		} else {
+			t (!(path = runtime_path("launches")));
+		}
+		t (fds[i] = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR), fds[i] == -1);
+		free(path), path = NULL;
+		t (flock(fds[i], LOCK_EX));
+		t (r = preadn(fds[i], buckets + i, sizeof(*buckets), 0), r < 0);
+		elapsed = (double)(now.tv_sec - buckets[i].when.tv_sec) + (now.tv_nsec - buckets[i].when.tv_nsec) / 1e9;
+		if ((r < (ssize_t)sizeof(*buckets)) || (elapsed < 0))
+			buckets[i].tokens = rate[i].burst; /* New, or left from before a reboot. */
+		else
+			buckets[i].tokens += elapsed * rate[i].rate;
+		if (buckets[i].tokens > rate[i].burst)
+			buckets[i].tokens = rate[i].burst;
+		buckets[i].when = now;
+		if ((take > 0) && (buckets[i].tokens < 1) && ((1 - buckets[i].tokens) / rate[i].rate > wait))
+			wait = (1 - buckets[i].tokens) / rate[i].rate;
+	}
+
+	if (wait > 0) {
+		when->tv_sec = now.tv_sec + (time_t)wait;
+		when->tv_nsec = now.tv_nsec + (long int)((wait - (double)(time_t)wait) * 1e9);
+		if (when->tv_nsec >= 1000000000L)
+			when->tv_sec += 1, when->tv_nsec -= 1000000000L;
+		rc = 1;
+	} else {
+		for (i = 0; i < 2; i++) {
+			if (fds[i] == -1)
+				continue;
+			buckets[i].tokens -= take;
+			t (pwriten(fds[i], buckets + i, sizeof(*buckets), 0) < (ssize_t)sizeof(*buckets));
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return rc;
+fail:
+	S(free(path), (fds[0] >= 0 ? close(fds[0]) : 0), (fds[1] >= 0 ? close(fds[1]) : 0));
+	return -1;
+}
+
+
+/**
+ * Get how long time is left until a job expires.
+ * 
+ * @param   job  The job's header.
+ * @param   now  The current time, in the job's clock.
+ * @return       The time left, in nanoseconds, negative if it has expired.
+ */
+static int64_t
+time_left(const struct job_header *job, const struct timespec *now)
+{
+	return (int64_t)(job->ts.tv_sec - now->tv_sec) * 1000000000LL + (job->ts.tv_nsec - now->tv_nsec);
+}
+
+
+/**
+ * Run an expired job. If the queue may run more than one
+ * job at a time, it is run in a new process that holds
+ * one of the queue's slots, in which case we continue as
+ * soon as the job has been removed or rescheduled, and
+ * the process pokes satd(1) when the job has finished,
+ * so that the jobs that did not get a slot can run.
+ * 
+ * @param   jobno  The job number.
+ * @param   limit  The maximum number of jobs to run at the same time.
+ * @return         1 if the job was run, 0 if all slots are
+ *                 in use, -1 on error.
+ */
+static int
+run_expired(const char *jobno, size_t limit)
+{
+	char name[sizeof("slots/") + 3 * sizeof(size_t)];
+	char *path = NULL;
+	size_t i;
+	int fd = -1, fds[2] = {-1, -1}, saved_errno;
+	pid_t pid;
+	char c;
+
+	if (limit == 1)
+		return remove_job(jobno, 2), 1; /* Failure isn't fatal. */
+
+	/* Find a free slot, it is kept locked until the process running the job exits. */
+	for (i = 0; i < limit; i++, close(fd), fd = -1) {
+		sprintf(name, "slots/%zu", i);
+		t (!(path = runtime_path(name)));
+		if (!i) {
+			*strrchr(path, '/') = '\0';
+			t (mkdir(path, S_IRWXU) && (errno != EEXIST));
+			path[strlen(path)] = '/';
+		}
+		t (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR), fd == -1);
+		free(path), path = NULL;
+		if (!flock(fd, LOCK_EX | LOCK_NB))
+			break;
+		t (errno != EWOULDBLOCK);
+	}
+	if (i == limit)
+		return 0;
+
+	t (pipe(fds));
+	t (pid = fork(), pid == -1);
+	if (!pid) {
+		/* A lock of our own, the one we inherited is shared with the parent. */
+		close(fds[0]);
+		if (reopen(STATE_FILENO, O_RDWR) || lock_state(LOCK_EX) || (low_latency() < 0))
+			perror("satd-timer"), exit(1);
+		/* `remove_job` keeps the lock until the job has been removed. */
+		close(fds[1]);
+		hold_slot();
+		remove_job(jobno, 2); /* Failure isn't fatal. */
+		poke_daemon(0, "satd-timer");
+		exit(0);
+	}
+	close(fds[1]), fds[1] = -1;
+	while ((read(fds[0], &c, (size_t)1) < 0) && (errno == EINTR));
+	close(fds[0]);
+	close(fd);
+	return 1;
+fail:
+	S(free(path), close(fd), close(fds[0]), close(fds[1]));
+	return -1;
 }
 
 
@@ -56,27 +369,116 @@ main(int argc, char *argv[])
 	struct itimerspec realspec;
 	struct timespec bootnow;
 	struct timespec realnow;
-	struct job **jobs = NULL;
-	struct job **job;
-	int rc = 0;
+	struct timespec when;
+	struct timespec due;
+	struct launch_rate rate[2];
+	struct job_header *jobs = NULL;
+	struct job_header *job, *soon;
+	struct job attrs;
+	size_t i, n, limit;
+	int64_t left, soonest = 0;
+	long int spin;
+	int rc = 0, r, rescheduled, held, priority;
 
 	t (reopen(STATE_FILENO, O_RDWR));
+	t (spin = low_latency(), spin < 0);
+
+	/* The settings are reread each time, so that changes take effect without restarting satd. */
+	if (get_queue_settings(&limit, &priority, NULL, rate))
+		perror(argv[0]); /* The defaults are used. */
+	if (priority && setpriority(PRIO_PROCESS, 0, priority))
+		perror(argv[0]); /* Failure isn't fatal. */
 
-	/* Get current expiration time. */
-	t (timerfd_gettime(BOOT_FILENO, &bootspec));
-	t (timerfd_gettime(REAL_FILENO, &realspec));
+again:
+	/* The timers are unset unless there are jobs left. */
+	memset(&bootspec, 0, sizeof(bootspec));
+	memset(&realspec, 0, sizeof(realspec));
 
-	/* Run expired jobs, and find new expiration times. */
+	/* Run expired jobs, and find the earliest expiration times. */
 	t (clock_gettime(CLOCK_BOOTTIME, &bootnow));
 	t (clock_gettime(CLOCK_REALTIME, &realnow));
-	t (!(jobs = get_jobs()));
-	for (job = jobs; *job; job++) {
-		if (timecmp(&(job[0]->ts), TIME(*job, now)) <= 0) {
-			sprintf(jobno, "%zu", job[0]->no);
-			remove_job(jobno, 2);
-		} else if (timecmp(&(job[0]->ts), &(TIME(*job, spec)->it_value)) > 0) {
-			TIME(*job, spec)->it_value = job[0]->ts;
+	/* Only the headers are needed, the payload is read when a job is run. */
+	t (!(jobs = get_job_headers(&n)));
+	for (i = held = 0, soon = NULL; i < n; i++) {
+		job = jobs + i;
+		held |= !!job->waiting;
+		/* In low-latency mode, the timers are set early, and the job
+		 * that expires first, if it is soon, is run early, `remove_job`
+		 * waits until it expires before its process is started. */
+		if (!spin || job->waiting || IS_RUNNING(job) || IS_DEFERRED(job))
+			continue;
+		left = time_left(job, TIME(job, now));
+		if ((left > 0) && (left <= LOW_LATENCY_ADVANCE) && (!soon || (left < soonest)))
+			soon = job, soonest = left;
+	}
+	/* The job that expires soon is run last, after the jobs that have
+	 * already expired, so that they do not wait whilst we spin for it. */
+	for (i = rescheduled = 0; i <= n; i++) {
+		job = i < n ? jobs + i : soon;
+		if (!job || ((i < n) && (job == soon)))
+			continue;
+		if (job->waiting)
+			continue; /* Released by `remove_job` when the jobs it waits for have finished. */
+		if (IS_RUNNING(job)) {
+			/* Rescheduled by `remove_job` if it fails, but if the process that runs
+			 * it dies, we are not told, so we look again later, and run it again. */
+			when = bootnow;
+			when.tv_sec += RUNNING_RECHECK;
+			if ((!bootspec.it_value.tv_sec && !bootspec.it_value.tv_nsec) ||
+			    (timecmp(&when, &(bootspec.it_value)) < 0))
+				bootspec.it_value = when;
+			continue;
+		}
+		if ((job == soon) || (timecmp(&(job->ts), TIME(job, now)) <= 0)) {
+			if (IS_DEFERRED(job)) {
+				t (defer(job));
+				continue;
+			}
+			sprintf(jobno, "%zu", job->no);
+			if ((job->stale == 's') && (r = get_job(job->no, &attrs), r <= 0)) {
+				/* It has been removed, so the times we have are out of date. */
+				t (r < 0);
+				rescheduled = 1;
+				continue;
+			}
+			if ((job->stale == 's') && is_overdue(&attrs, TIME(job, now))) {
+				remove_job(jobno, 3); /* Failure isn't fatal. */
+				metrics_count(METRIC(skipped), 1, 0);
+				rescheduled |= job->recur || held;
+				continue;
+			}
+			t (r = take_token(rate, 1, &when), r < 0);
+			if (r) {
+				/* The job is started when the launch-rate limits allow it. */
+				metrics_count(METRIC(throttled), 1, 0);
+				if ((!bootspec.it_value.tv_sec && !bootspec.it_value.tv_nsec) ||
+				    (timecmp(&when, &(bootspec.it_value)) < 0))
+					bootspec.it_value = when;
+				continue;
+			}
+			t (r = run_expired(jobno, limit), r < 0);
+			if (!r)
+				t (take_token(rate, -1, NULL) < 0); /* It did not get a slot. */
+			/* Other jobs may expire soon too, and the times we have are out of date. */
+			rescheduled |= r && (job->recur || held || job->retries || (job == soon));
+			continue;
+		}
+		due = job->ts;
+		if (spin) {
+			due.tv_nsec -= LOW_LATENCY_ADVANCE;
+			while (due.tv_nsec < 0)
+				due.tv_sec -= 1, due.tv_nsec += 1000000000L;
 		}
+		if ((!TIME(job, spec)->it_value.tv_sec && !TIME(job, spec)->it_value.tv_nsec) ||
+		    (timecmp(&due, &(TIME(job, spec)->it_value)) < 0)) {
+			TIME(job, spec)->it_value = due;
+		}
+	}
+	if (rescheduled) {
+		/* The rescheduled jobs' new expiration times, and the
+		 * jobs that have been released, are not in `jobs`. */
+		free(jobs), jobs = NULL;
+		goto again;
 	}
 
 	/* Update expiration time. */
@@ -84,8 +486,6 @@ main(int argc, char *argv[])
 	t (timerfd_settime(REAL_FILENO, TFD_TIMER_ABSTIME, &realspec, NULL));
 
 done:
-	for (job = jobs; *job; job++)
-		free(*job);
 	free(jobs);
 	close(STATE_FILENO);
 	return rc;
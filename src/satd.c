@@ -21,11 +21,12 @@
  */
 #include "common.h"
 #include "daemonise.h"
+#include "metrics.h"
 
 
 
 COMMAND("satd")
-USAGE("[-f]")
+USAGE("[-q QUEUE] [-f] [-l]")
 
 
 
@@ -43,14 +44,15 @@ create_lock(void)
 	pid_t pid = getpid();
 	int fd = -1, saved_errno = 0;
 
-	/* Create directory. */
+	/* Create directory, and for a named queue, the directories it is in. */
 	dir = getenv("XDG_RUNTIME_DIR"), dir = (dir ? dir : "/run");
-	t (!(path = malloc(strlen(dir) * sizeof(char) + sizeof("/" PACKAGE "/lock"))));
-	p = stpcpy(stpcpy(path, dir), "/" PACKAGE);
-	t (mkdir(path, S_IRWXU) && (errno != EEXIST));
+	t (!(path = runtime_path("lock")));
+	for (p = path + strlen(dir) + 1; (p = strchr(p, '/')); *p++ = '/') {
+		*p = '\0';
+		t (mkdir(path, S_IRWXU) && (errno != EEXIST));
+	}
 
 	/* Open file. */
-	stpcpy(p, "/lock");
 	t (fd = open(path, O_RDWR | O_CREAT /* but not O_EXCL or O_TRUNC */, S_IRUSR | S_IWUSR), fd == -1);
 
 	/* Check that the daemon is not running, and mark it as running. */
@@ -74,12 +76,60 @@ done:
 }
 
 
+/**
+ * The number of sleeps that are measured when
+ * the spin in low-latency mode is calibrated.
+ */
+#define CALIBRATION_ROUNDS  64
+
+
+
+/**
+ * Calibrate how long time before a job expires the daemon
+ * shall stop sleeping and start spinning, in low-latency mode.
+ * 
+ * Short sleeps are measured, in the mode, and the spin
+ * is twice the longest time a sleep overshot its end,
+ * so that a sleep that ends late still ends before
+ * the job expires.
+ * 
+ * @return  The spin, in nanoseconds, -1 on error.
+ */
+static long int
+calibrate_spin(void)
+{
+	struct timespec end, now;
+	long int late, max = 0;
+	int i, r;
+
+	for (i = 0; i < CALIBRATION_ROUNDS; i++) {
+		t (clock_gettime(CLOCK_MONOTONIC, &end));
+		end.tv_nsec += 100000L;
+		if (end.tv_nsec >= 1000000000L)
+			end.tv_sec += 1, end.tv_nsec -= 1000000000L;
+		while ((r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL)) == EINTR);
+		t (errno = r);
+		t (clock_gettime(CLOCK_MONOTONIC, &now));
+		late = (long int)(now.tv_sec - end.tv_sec) * 1000000000L + (now.tv_nsec - end.tv_nsec);
+		max = late > max ? late : max;
+	}
+	max = 2 * max + 10000L;
+	return max < LOW_LATENCY_ADVANCE / 2 ? max : LOW_LATENCY_ADVANCE / 2;
+fail:
+	return -1;
+}
+
+
 /**
  * The sat daemon initialisation.
  * 
- * @param   argc  Any value in [0, 2] is accepted.
- * @param   argv  The name of the process, and -f if the process
- *                shall not be daemonised.
+ * @param   argc  Any value in [0, 5] is accepted.
+ * @param   argv  The name of the process, optionally followed by
+ *                "-q" and the queue, -f if the process
+ *                shall not be daemonised, and -l if it
+ *                shall run in low-latency mode, which it
+ *                also does if SAT_LOW_LATENCY is set and
+ *                not empty.
  * @return  0     The process was successful.
  * @return  1     The process failed queuing the job.
  * @return  2     User error, you do not know what you are doing.
@@ -87,22 +137,48 @@ done:
 int
 main(int argc, char *argv[])
 {
-	int state = -1, boot = -1, real = -1, lock = -1, foreground = 0;
+	int state = -1, boot = -1, real = -1, lock = -1, foreground = 0, lowlatency = 0;
 	char *path = NULL;
+	char spin[3 * sizeof(long int) + 1];
 	struct itimerspec spec;
+	pid_t pid;
+	long int ns;
+	int i;
 
 	/* Parse command line. */
 	if (argc > 0)  argv0 = argv[0];
-	if (argc > 2)  usage();
-	if ((argc == 2) && (!(foreground = !strcmp(argv[1], "-f"))))
-		usage();
+	QUEUE_OPTION;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-f") && !foreground)
+			foreground = 1;
+		else if (!strcmp(argv[i], "-l") && !lowlatency)
+			lowlatency = 1;
+		else
+			usage();
+	}
 
-	/* Get hook-script pathname. */
+	/* Enter low-latency mode, to find out whether we may, and to calibrate the spin in it.
+	 * The daemon's processes enter it themselves, only the environment variable is inherited.
+	 * The daemon exits when the queue is empty, so the mode can also be selected with the
+	 * environment variable, which is inherited when sat(1) starts the daemon. */
+	if (lowlatency || (getenv("SAT_LOW_LATENCY") && *getenv("SAT_LOW_LATENCY"))) {
+		t (setenv("SAT_LOW_LATENCY", "0", 1));
+		t (low_latency() < 0);
+		t (ns = calibrate_spin(), ns < 0);
+		sprintf(spin, "%li", ns);
+		t (setenv("SAT_LOW_LATENCY", spin, 1));
+	} else {
+		t (unsetenv("SAT_LOW_LATENCY"));
+	}
+
+	/* Get hook-script and queue-settings pathnames. */
 	t (set_hookpath());
+	t (set_queuespath());
 
 	/* Open/create lock file and state file. */
 	GET_FD(lock,  LOCK_FILENO,  create_lock());
 	GET_FD(state, STATE_FILENO, open_state(O_RDWR | O_CREAT, &path));
+	t (metrics_create());
 
 	/* Create timers. */
 	GET_FD(boot, BOOT_FILENO, timerfd_create(CLOCK_BOOTTIME, 0));
@@ -116,6 +192,10 @@ main(int argc, char *argv[])
 	/* Daemonise. */
 	t (foreground ? 0 : daemonise("satd", /*DAEMONISE_KEEP_FDS | DAEMONISE_NEW_PID,*/ 3, 4, 5, 6, -1));
 
+	/* Daemonisation forks, so the PID in the lock file is our parent's. */
+	pid = getpid();
+	t (pwrite(lock, &pid, sizeof(pid), (off_t)0) < (ssize_t)sizeof(pid));
+
 	/* Change to a process image without all this initialisation text. */
 	execl(LIBEXECDIR "/" PACKAGE "/satd-diminished", argv0, path, NULL);
 
@@ -20,15 +20,68 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include "common.h"
+#include "metrics.h"
 #include <stdarg.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <linux/ioprio.h>
 
 
 
 COMMAND("satq")
-USAGE(NULL)
+USAGE("[-q QUEUE] [--watch | --stats | --metrics | --history]")
 
 
 
+/**
+ * The size of the buffer `quote` needs for a string.
+ * 
+ * @param   N:size_t  The length of the string.
+ * @return  :size_t   The size of the buffer.
+ */
+#define QUOTE_SIZE(N)  (4 * (N) + 4)
+
+
+
+/**
+ * Byte classes, see `byte_class`.
+ */
+#define END         1 /* = '\0'       */
+#define INVISIBLE   2 /* < ' ' or 127 */
+#define UNSAFE      4 /* in " \"$()[]{};|&^#!?*~`<>" */
+#define BACKSLASH   8 /* = '\\'       */
+#define APOSTROPHE 16 /* = '\''       */
+
+
+
+/**
+ * The class of each byte, for `quote`, so that a string can be
+ * classified with one lookup per byte. Set by `init_byte_class`.
+ */
+static unsigned char byte_class[256];
+
+
+
+/**
+ * Fill in `byte_class`.
+ */
+static void
+init_byte_class(void)
+{
+	const char *s;
+	int c;
+	for (c = 1; c < ' '; c++)
+		byte_class[c] = INVISIBLE;
+	byte_class[127] = INVISIBLE;
+	for (s = " \"$()[]{};|&^#!?*~`<>"; *s; s++)
+		byte_class[(unsigned char)*s] = UNSAFE;
+	byte_class['\\'] = BACKSLASH;
+	byte_class['\''] = APOSTROPHE;
+	byte_class[0] = END;
+}
+
+
 /**
  * Quote a string, in shell (Bash-only if necessary) compatible
  * format, if necessary. Here, just adding quotes around all not
@@ -38,40 +91,31 @@ USAGE(NULL)
  * ugliness.
  * 
  * @param   str  The string.
+ * @param   buf  Output buffer, of at least `QUOTE_SIZE(strlen(str))` bytes.
  * @return       Return a safe representation of the string,
- *               `NULL` on error.
+ *               either `str` or `buf`.
  */
-static char *
-quote(const char *str)
+static const char *
+quote(const char *str, char *buf)
 {
-#define UNSAFE(c)      strchr(" \"$()[]{};|&^#!?*~`<>", c)
-#define N(I, S, B, Q)  (I*in + S*sn + B*bn + Q*qn + rn)
-
-	size_t in = 0; /* < ' ' or 127 */
-	size_t sn = 0; /* in UNSAFE    */
-	size_t bn = 0; /* = '\\'       */
-	size_t qn = 0; /* = '\''       */
-	size_t rn = 0; /* other        */
-	size_t n, i = 0;
 	const unsigned char *s;
-	char *rc = NULL;
-
-	for (s = (const unsigned char *)str; *s; s++) {
-		if      (*s <  ' ')   in++;
-		else if (*s == 127)   in++;
-		else if (UNSAFE(*s))  sn++;
-		else if (*s == '\\')  bn++;
-		else if (*s == '\'')  qn++;
-		else                  rn++;
-	}
-	if (N(1, 1, 1, 1) == rn)
-		return strdup(rn ? str : "''");
-
-	n = in ? (N(4, 1, 2, 2) + 3) : (N(0, 1, 1, 4) + 2);
-	t (!(rc = malloc((n + 1) * sizeof(char))));
-	rc[i += !!in] = '$';
-	rc[i += 1]    = '\'';
-	if (in == 0) {
+	unsigned char c, seen = 0;
+	char *rc = buf;
+	size_t i = 0;
+
+	if (!byte_class[0])
+		init_byte_class();
+
+	/* Classify the string. */
+	for (s = (const unsigned char *)str; !((c = byte_class[*s]) & END); s++)
+		seen |= c;
+	if (!seen)
+		return *str ? str : "''";
+
+	if (seen & INVISIBLE)
+		rc[i++] = '$';
+	rc[i++] = '\'';
+	if (!(seen & INVISIBLE)) {
 		for (s = (const unsigned char *)str; *s; s++) {
 			rc[i++] = (char)*s;
 			if (*s == '\'')
@@ -79,19 +123,19 @@ quote(const char *str)
 		}
 	} else {
 		for (s = (const unsigned char *)str; *s; s++) {
-			if ((*s <  ' ') || (*s == 127)) {
+			c = byte_class[*s];
+			if (c & INVISIBLE) {
 				rc[i++] = '\\';
 				rc[i++] = 'x';
 				rc[i++] = "0123456789ABCDEF"[(*s >> 4) & 15];
 				rc[i++] = "0123456789ABCDEF"[(*s >> 0) & 15];
 			}
-			else if (strchr("\\'", *s))  rc[i++] = '\\', rc[i++] = (char)*s;
-			else                         rc[i++] = (char)*s;
+			else if (c & (BACKSLASH | APOSTROPHE))  rc[i++] = '\\', rc[i++] = (char)*s;
+			else                                    rc[i++] = (char)*s;
 		}
 	}
 	rc[i++] = '\'';
 	rc[i] = '\0';
-fail:
 	return rc;
 }
 
@@ -143,38 +187,173 @@ print(const char *s, ...)
 
 
 /**
- * Dump a job to stdout.
+ * Print how a job recurs, if it does, without a terminating newline.
  * 
  * @param   job  The job.
  * @return       0 on success, -1 on error.
  */
 static int
-print_job(struct job *job)
+print_recurrence(const struct job *job)
 {
-#define FIX_NSEC(T)  (((T)->tv_nsec < 0L) ? ((T)->tv_sec -= 1, (T)->tv_nsec += 1000000000L) : 0L)
-#define ARRAY(LIST)  \
-	for (arg = LIST; *arg; arg++) {  \
-		free(qstr);  \
-		t (!(qstr = quote(*arg)));  \
-		t (print(" ", qstr, NULL));  \
+	char line[sizeof("\n  recur: --- ::") + 6 * 3 * sizeof(int) + 3 * sizeof(time_t)];
+	char *p = line;
+	int i;
+
+	switch (job->recur) {
+	case 'i':
+		sprintf(line, "\n  recur: %lli.%09li", (long long int)(job->interval.tv_sec), job->interval.tv_nsec);
+		break;
+	case 'c':
+		p = stpcpy(p, "\n  recur: ");
+		for (i = 0; i < 6; i++) {
+			if (job->calendar[i] < 0)
+				p = stpcpy(p, "*");
+			else
+				p += sprintf(p, i ? "%02i" : "%04i", job->calendar[i]);
+			if (i < 5)
+				*p++ = "-- ::"[i];
+		}
+		*p = '\0';
+		break;
+	default:
+		return 0;
 	}
+	return print(line, NULL);
+}
+
+
+/**
+ * Print the limits a job is deferred by, if it has
+ * any, without a terminating newline.
+ * 
+ * @param   job  The job.
+ * @return       0 on success, -1 on error.
+ */
+static int
+print_limits(const struct job *job)
+{
+	const char *resources[] = PRESSURE_RESOURCES;
+	char line[sizeof("\n  limits: cpu=100 io=100 memory=100 load=. (quiet)") + 3 * sizeof(int)];
+	char *p = line;
+	int i;
+
+	if (!job->load && !job->pressure[0] && !job->pressure[1] && !job->pressure[2])
+		return 0;
+	p = stpcpy(p, "\n  limits:");
+	for (i = 0; i < 3; i++)
+		if (job->pressure[i])
+			p += sprintf(p, " %s=%i", resources[i], job->pressure[i]);
+	if (job->load)
+		p += sprintf(p, " load=%u.%02u", job->load / 100, job->load % 100);
+	if (job->quiet)
+		stpcpy(p, " (quiet)");
+	return print(line, NULL);
+}
+
+
+/**
+ * Print the cgroup limits of a job, if it has
+ * any, without a terminating newline.
+ * 
+ * @param   job  The job.
+ * @return       0 on success, -1 on error.
+ */
+static int
+print_controls(const struct job *job)
+{
+	char line[sizeof("\n  controls: cpu.weight= cpu.max=/ memory.max= io.weight=")
+		  + 4 * 3 * sizeof(long int) + 3 * sizeof(uint64_t)];
+	char *p = line;
+
+	if (!HAS_CGROUP(job))
+		return 0;
+	p = stpcpy(p, "\n  controls:");
+	if (job->cpu_weight)
+		p += sprintf(p, " cpu.weight=%u", job->cpu_weight);
+	if (job->cpu_max[0])
+		p += sprintf(p, " cpu.max=%lu/%lu", job->cpu_max[0], job->cpu_max[1]);
+	if (job->memory_max)
+		p += sprintf(p, " memory.max=%ju", (uintmax_t)(job->memory_max));
+	if (job->io_weight)
+		sprintf(p, " io.weight=%u", job->io_weight);
+	return print(line, NULL);
+}
+
+
+/**
+ * Print the scheduling attributes of a job, if it
+ * has any, without a terminating newline.
+ * 
+ * @param   job  The job.
+ * @return       0 on success, -1 on error.
+ */
+static int
+print_attributes(const struct job *job)
+{
+#define CPU(I)  ((I) < AFFINITY_CPUS && (job->cpus[(I) / bits] >> ((I) % bits) & 1))
+
+	const int bits = (int)(CHAR_BIT * sizeof(long int));
+	const char *classes[] = {"", "realtime", "best-effort", "idle"};
+	char line[sizeof("\n  scheduling: cpus= nice=-20 ioprio=best-effort:0 policy=fifo:99")
+		  + AFFINITY_CPUS * sizeof("255,")];
+	char *p = line;
+	int i, j, class;
+
+	if (!HAS_AFFINITY(job) && !job->renice && !job->ioprio && !job->policy)
+		return 0;
+	p = stpcpy(p, "\n  scheduling:");
+	if (HAS_AFFINITY(job)) {
+		p = stpcpy(p, " cpus=");
+		for (i = 0; i < AFFINITY_CPUS; i = j) {
+			for (; (i < AFFINITY_CPUS) && !CPU(i); i++);
+			for (j = i; CPU(j); j++);
+			if (i < AFFINITY_CPUS)
+				p += sprintf(p, p[-1] == '=' ? "%i" : ",%i", i);
+			if (j - 1 > i)
+				p += sprintf(p, "-%i", j - 1);
+		}
+	}
+	if (job->renice)
+		p += sprintf(p, " nice=%i", job->nice);
+	if (job->ioprio) {
+		class = IOPRIO_PRIO_CLASS(job->ioprio);
+		p += sprintf(p, " ioprio=%s", classes[class & 3]);
+		if (class != IOPRIO_CLASS_IDLE)
+			p += sprintf(p, ":%i", (int)IOPRIO_PRIO_DATA(job->ioprio));
+	}
+	if (job->policy == 'f' || job->policy == 'r')
+		sprintf(p, " policy=%s:%i", job->policy == 'f' ? "fifo" : "rr", job->rtprio);
+	else if (job->policy)
+		sprintf(p, " policy=%s", job->policy == 'o' ? "other" : job->policy == 'b' ? "batch" : "idle");
+	return print(line, NULL);
+
+#undef CPU
+}
+
+
+/**
+ * Dump a job to stdout.
+ * 
+ * @param   full  The job, with its payload.
+ * @return        0 on success, -1 on error.
+ */
+static int
+print_job(struct job_full *full)
+{
+#define FIX_NSEC(T)  (((T)->tv_nsec < 0L) ? ((T)->tv_sec -= 1, (T)->tv_nsec += 1000000000L) : 0L)
 
 	struct tm *tm;
 	struct timespec rem;
 	const char *clk;
 	char rem_s[3 * sizeof(time_t) + sizeof("d00:00:00")];
-	char *qstr = NULL;
-	char *wdir = NULL;
+	char *buf = NULL;
 	char line[sizeof("job: %zu clock: unrecognised argc: %i remaining:  argv[0]: ")
 		  + 3 * sizeof(size_t) + 3 * sizeof(int) + sizeof(rem_s) + 9];
 	char timestr_a[sizeof("-00-00 00:00:00") + 3 * sizeof(time_t)];
 	char timestr_b[10];
-	char **args = NULL;
-	char **arg;
-	char **argv = NULL;
-	char **envp = NULL;
-	size_t argsn;
-	int rc = 0, saved_errno;
+	const struct job *job = &(full->job);
+	char *arg, *wdir, *end = full->payload + job->n;
+	int i, n, rc = 0, saved_errno;
 
 	/* Get remaining time. */
 	if (clock_gettime(job->clk, &rem))
@@ -182,9 +361,14 @@ print_job(struct job *job)
 	rem.tv_sec  = job->ts.tv_sec  - rem.tv_sec;
 	rem.tv_nsec = job->ts.tv_nsec - rem.tv_nsec;
 	FIX_NSEC(&rem);
-	if (rem.tv_sec < 0)
+	if ((rem.tv_sec < 0) && !job->waiting && (job->quiet || !HAS_LIMITS(job)) && !IS_RUNNING(job))
 		/* This job will be removed momentarily, do not list it. (To simply things.) */
 		return 0;
+	if (rem.tv_sec < 0)
+		/* This job is held until the jobs it waits for have finished,
+		 * or until the system is quiet enough, or it is running and
+		 * will be retried if it fails. */
+		rem.tv_sec = 0, rem.tv_nsec = 0;
 
 	/* Get clock name. */
 	switch (job->clk) {
@@ -205,25 +389,65 @@ print_job(struct job *job)
 	}
 	sprintf(timestr_b, "%09li", job->ts.tv_nsec);
 
-	/* Get arguments. */
-	t (!(args = restore_array(job->payload, job->n, &argsn)));
-	t (!(argv = sublist(args, (size_t)(job->argc))));
-	t (!(envp = sublist(args + job->argc, argsn - (size_t)(job->argc)))); /* Includes wdir. */
+	/* The payload is walked rather than unmarshalled, so it must end with
+	 * a NUL byte. No string in the payload is longer than the payload,
+	 * so one buffer will do. */
+	t (errno = EINVAL, !job->n || full->payload[job->n - 1]);
+	wdir = full->payload + job->wdir_off;
+	t (!(buf = malloc(QUOTE_SIZE(job->n))));
 
 	/* Send message. */
-	t (!(qstr = quote(args[0])));
-	t (!(wdir = quote(envp[0])));
 	sprintf(line, "job: %zu clock: %s argc: %i remaining: %s.%09li argv[0]: ",
 		job->no, clk, job->argc, rem_s, rem.tv_nsec);
-	t (print(line, qstr,
+	t (print(line, quote(full->payload, buf),
 	         "\n  time: ", timestr_a, ".", timestr_b,
-	         "\n  wdir: ", wdir,
-	         "\n  argv:", NULL));
-	ARRAY(argv);      t (print("\n  envp:", NULL));
-	ARRAY(envp + 1);  t (print("\n\n", NULL));
+	         "\n  wdir: ", NULL));
+	t (print(quote(wdir, buf), NULL));
+	if (job->script) {
+		sprintf(line, "\n  script: %zu bytes", job->script);
+		t (print(line, NULL));
+	}
+	t (print_recurrence(job));
+	for (i = n = 0; i < MAX_PREREQUISITES; i++) {
+		if (!(job->waiting & (1 << i)))
+			continue;
+		sprintf(line, "%s %zu%s", n++ ? "" : "\n  after:", job->after[i],
+		        job->after_on[i] == 's' ? ":success" : job->after_on[i] == 'f' ? ":failure" : "");
+		t (print(line, NULL));
+	}
+	t (print_limits(job));
+	t (print_controls(job));
+	t (print_attributes(job));
+	if (job->timeout.tv_sec || job->timeout.tv_nsec) {
+		sprintf(line, "\n  timeout: %lli.%09li/%lli.%09li",
+		        (long long int)(job->timeout.tv_sec), job->timeout.tv_nsec,
+		        (long long int)(job->grace.tv_sec), job->grace.tv_nsec);
+		t (print(line, NULL));
+	}
+	if (job->stale) {
+		sprintf(line, "\n  overdue: %s", job->stale == 'r' ? "run" : job->stale == 's' ? "skip" : "once");
+		if (job->stale != 'r')
+			sprintf(strchr(line, '\0'), ":%lli.%09li", (long long int)(job->overdue.tv_sec), job->overdue.tv_nsec);
+		t (print(line, NULL));
+	}
+	if (job->attempts) {
+		sprintf(line, "\n  attempts: %u/%u delay: %lli.%09li jitter: %u%%%s",
+		        job->attempt + 1, job->attempts,
+		        (long long int)(job->retry_delay.tv_sec), job->retry_delay.tv_nsec,
+		        (unsigned int)(job->jitter), IS_RUNNING(job) ? job->cancelled ? " (running, cancelled)" : " (running)" : "");
+		t (print(line, NULL));
+	}
+	t (print("\n  argv:", NULL));
+	for (arg = full->payload; arg < end; arg = (char *)memchr(arg, '\0', (size_t)(end - arg)) + 1) {
+		if (arg == wdir)
+			t (print("\n  envp:", NULL));
+		else
+			t (print(" ", quote(arg, buf), NULL));
+	}
+	t (print("\n\n", NULL));
 
 done:
-	S(free(qstr), free(args), free(argv), free(wdir), free(envp));
+	S(free(buf));
 	return rc;
 fail:
 	rc = -1;
@@ -231,11 +455,386 @@ fail:
 }
 
 
+/**
+ * Dump an event to stdout.
+ * 
+ * @param   event  The event.
+ * @return         0 on success, -1 on error.
+ */
+static int
+print_event(const struct event *event)
+{
+	struct tm *tm;
+	char line[sizeof("event:  job:  at: .\n") + sizeof(event->action) + 3 * sizeof(size_t)
+		  + sizeof("-00-00 00:00:00") + 3 * sizeof(time_t) + 9];
+	char timestr[sizeof("-00-00 00:00:00") + 3 * sizeof(time_t)];
+
+	if (!(tm = localtime(&(event->when.tv_sec))))
+		return -1;
+	strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", tm);
+	sprintf(line, "event: %s job: %zu at: %s.%09li\n",
+		event->action, event->no, timestr, event->when.tv_nsec);
+	return print(line, NULL);
+}
+
+
+/**
+ * Print all events that have been logged since
+ * the last call.
+ * 
+ * The log is read with its lock held, so that
+ * an event that is being logged is not read
+ * before it has been written in full.
+ * 
+ * If events have been overwritten before they
+ * were printed, a line with the number of lost
+ * events is printed in their place.
+ * 
+ * @param   fd   File descriptor for the event log.
+ * @param   seq  The sequence number of the first unprinted event,
+ *               will be updated.
+ * @return       0 on success, -1 on error.
+ */
+static int
+print_events(int fd, size_t *seq)
+{
+	struct event events[64];
+	struct event_log log;
+	char line[sizeof("lost: \n") + 3 * sizeof(size_t)];
+	size_t i, n, lost = 0;
+	ssize_t r;
+	int saved_errno;
+
+	t (flock(fd, LOCK_SH));
+	t (r = preadn(fd, &log, sizeof(log), (size_t)0), r < 0);
+	if (r < (ssize_t)sizeof(log))
+		goto done;
+	if (*seq > log.seq)
+		*seq = 0; /* The log has been recreated. */
+	if (log.seq - *seq > EVENTS_MAX)
+		lost = log.seq - EVENTS_MAX - *seq, *seq = log.seq - EVENTS_MAX;
+
+	while (*seq < log.seq) {
+		/* Read up to the end of the ring, or of the unprinted events. */
+		n = EVENTS_MAX - *seq % EVENTS_MAX;
+		n = n < log.seq - *seq ? n : log.seq - *seq;
+		n = n < sizeof(events) / sizeof(*events) ? n : sizeof(events) / sizeof(*events);
+		t (r = preadn(fd, events, n * sizeof(*events), EVENT_OFFSET(*seq)), r < 0);
+		n = (size_t)r / sizeof(*events);
+		if (!n)
+			break;
+		for (i = 0; i < n; i++, ++*seq) {
+			if (events[i].seq != *seq) {
+				lost++;
+				continue;
+			}
+			if (lost) {
+				sprintf(line, "lost: %zu\n", lost);
+				t (print(line, NULL));
+				lost = 0;
+			}
+			t (print_event(events + i));
+		}
+	}
+	if (lost) {
+		sprintf(line, "lost: %zu\n", lost);
+		t (print(line, NULL));
+	}
+done:
+	flock(fd, LOCK_UN); /* Failure isn't fatal. */
+	return 0;
+fail:
+	S(flock(fd, LOCK_UN));
+	return -1;
+}
+
+
+/**
+ * Print all queued jobs, and then print all events
+ * that occur until killed.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+watch(void)
+{
+	char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	char *path = NULL, *name;
+	struct job_full **jobs = NULL;
+	struct job_full **job;
+	struct inotify_event ev;
+	struct event_log log;
+	size_t seq = 0;
+	int fd = -1, inotify = -1, changed, saved_errno;
+	ssize_t r, i;
+
+	/* Watch the event log, the state file is not reread. The log does not exist until
+	 * the first event is logged, and we do not create it, so its directory is watched. */
+	t (!(path = runtime_path("events")));
+	*(name = strrchr(path, '/')) = '\0';
+	t (inotify = inotify_init1(IN_CLOEXEC), inotify == -1);
+	t (inotify_add_watch(inotify, path, IN_CREATE | IN_MODIFY) == -1);
+	*name++ = '/';
+
+	/* Get the snapshot and where in the log it was taken. Events
+	 * are logged with the state file locked, so we will not miss
+	 * or duplicate any event. (`get_jobs` unlocks the file.) */
+	t (lock_state(LOCK_SH));
+	t ((fd = open(path, O_RDONLY), fd == -1) && (errno != ENOENT));
+	if (fd >= 0) {
+		t (flock(fd, LOCK_SH));
+		t (r = preadn(fd, &log, sizeof(log), (size_t)0), r < 0);
+		seq = r < (ssize_t)sizeof(log) ? 0 : log.seq;
+		t (flock(fd, LOCK_UN));
+	}
+	t (!(jobs = get_jobs()));
+	for (job = jobs; *job; job++)
+		t (print_job(*job));
+
+	/* Follow the log. */
+	for (changed = 1;;) {
+		if (changed && (fd < 0))
+			t ((fd = open(path, O_RDONLY), fd == -1) && (errno != ENOENT));
+		if (changed && (fd >= 0))
+			t (print_events(fd, &seq));
+		if (r = read(inotify, buf, sizeof(buf)), r < 0) {
+			t (errno != EINTR);
+			continue;
+		}
+		/* The other files in the directory are modified too. (`buf` is not aligned.) */
+		for (i = changed = 0; i < r; i += (ssize_t)(sizeof(ev) + ev.len)) {
+			memcpy(&ev, buf + i, sizeof(ev));
+			changed |= ev.len && !strcmp(buf + i + sizeof(ev), name);
+		}
+	}
+
+fail:
+	saved_errno = errno;
+	free(jobs), free(path), close(fd), close(inotify);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/**
+ * Print queue statistics, only the state file's header is read.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+print_stats(void)
+{
+	static const char *clocks[] = {"walltime", "boottime"};
+	struct state_header header;
+	struct tm *tm;
+	char tm_s[2][sizeof("-00-00 00:00:00") + 3 * sizeof(time_t)];
+	char line[sizeof("walltime: jobs:  earliest: . latest: .\n") + 3 * sizeof(size_t) + 2 * sizeof(tm_s[0]) + 18];
+	const struct timespec *ts[2];
+	int c, i, saved_errno;
+
+	t (lock_state(LOCK_SH));
+	t (read_header(&header) < 0);
+	t (flock(STATE_FILENO, LOCK_UN));
+
+	for (c = 0; c < 2; c++) {
+		if (!header.jobs[c]) {
+			sprintf(line, "%s: jobs: 0\n", clocks[c]);
+			t (print(line, NULL));
+			continue;
+		}
+		ts[0] = header.earliest + c;
+		ts[1] = header.latest + c;
+		for (i = 0; i < 2; i++) {
+			if (c == CLOCK_INDEX(CLOCK_REALTIME)) {
+				t (!(tm = localtime(&(ts[i]->tv_sec))));
+				strftime(tm_s[i], sizeof(tm_s[i]), "%Y-%m-%d %H:%M:%S", tm);
+			} else {
+				strduration(tm_s[i], ts[i]->tv_sec);
+			}
+		}
+		sprintf(line, "%s: jobs: %zu earliest: %s.%09li latest: %s.%09li\n", clocks[c],
+			header.jobs[c], tm_s[0], ts[0]->tv_nsec, tm_s[1], ts[1]->tv_nsec);
+		t (print(line, NULL));
+	}
+	sprintf(line, "payload: %zu\n", header.payload);
+	t (print(line, NULL));
+	return 0;
+fail:
+	S(flock(STATE_FILENO, LOCK_UN));
+	return -1;
+}
+
+
+/**
+ * Print the daemon's metrics, the state file is not locked.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+print_metrics(void)
+{
+#define HISTOGRAM(NAME)  \
+	t (sprintf(line, #NAME ": count: %llu sum: %llu buckets:",  \
+	           (unsigned long long int)(m.NAME.count), (unsigned long long int)(m.NAME.sum)) < 0);  \
+	t (print(line, NULL));  \
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {  \
+		sprintf(line, " %llu", (unsigned long long int)(m.NAME.buckets[i]));  \
+		t (print(line, NULL));  \
+	}  \
+	t (print("\n", NULL))
+#define PER_CLOCK(NAME)  \
+	sprintf(line, #NAME ": walltime: %llu boottime: %llu\n",  \
+	        (unsigned long long int)(m.NAME[CLOCK_INDEX(CLOCK_REALTIME)]),  \
+	        (unsigned long long int)(m.NAME[CLOCK_INDEX(CLOCK_BOOTTIME)]));  \
+	t (print(line, NULL))
+
+	struct metrics m;
+	char line[sizeof("lock_wait: count:  sum:  buckets:") + 2 * 3 * sizeof(unsigned long long int)];
+	size_t i;
+
+	if (metrics_read(&m))
+		return 0;
+
+	HISTOGRAM(lateness);
+	HISTOGRAM(dispatch);
+	HISTOGRAM(spawn);
+	HISTOGRAM(hook);
+	HISTOGRAM(runtime);
+	HISTOGRAM(lock_wait);
+	PER_CLOCK(wakeups);
+	PER_CLOCK(depth);
+	sprintf(line, "timeouts: terminated: %llu killed: %llu\n",
+	        (unsigned long long int)(m.terminated), (unsigned long long int)(m.killed));
+	t (print(line, NULL));
+	sprintf(line, "launches: throttled: %llu skipped: %llu\n",
+	        (unsigned long long int)(m.throttled), (unsigned long long int)(m.skipped));
+	t (print(line, NULL));
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Create a textual representation of a point in time.
+ * 
+ * @param  buffer  Output buffer, with a size of at least
+ *                 `sizeof("-00-00 00:00:00.000000000")`
+ *                 plus enough to encode a `time_t`.
+ * @param  ts      The point in time.
+ * @param  clk     The clock `ts` is measured in.
+ * @return         0 on success, -1 on error.
+ */
+static int
+strtimespec(char *buffer, const struct timespec *ts, clockid_t clk)
+{
+	struct tm *tm;
+	if (clk == CLOCK_REALTIME) {
+		if (!(tm = localtime(&(ts->tv_sec))))
+			return -1;
+		buffer += strftime(buffer, sizeof("-00-00 00:00:00") + 3 * sizeof(time_t), "%Y-%m-%d %H:%M:%S", tm);
+	} else {
+		strduration(buffer, ts->tv_sec);
+		buffer = strchr(buffer, '\0');
+	}
+	sprintf(buffer, ".%09li", ts->tv_nsec);
+	return 0;
+}
+
+
+/**
+ * Print an entry in the history journal.
+ * 
+ * @param   entry  The entry.
+ * @return         0 on success, -1 on error.
+ */
+static int
+print_history_entry(struct history *entry)
+{
+	char sched_s[sizeof("-00-00 00:00:00.000000000") + 3 * sizeof(time_t)];
+	char spawn_s[sizeof(sched_s)];
+	char line[sizeof("job:  clock: boottime scheduled:  started:  duration: . signal:  utime: . stime: . maxrss:  argv[0]: ")
+		  + 2 * sizeof(sched_s) + 3 * sizeof(size_t) + 6 * 3 * sizeof(long long int) + 3 * sizeof(int) + 9 + 2 * 6];
+	struct timespec duration;
+	char qbuf[QUOTE_SIZE(sizeof(entry->argv0))];
+
+	entry->argv0[sizeof(entry->argv0) - 1] = '\0';
+	duration.tv_sec  = entry->exited.tv_sec  - entry->spawned.tv_sec;
+	duration.tv_nsec = entry->exited.tv_nsec - entry->spawned.tv_nsec;
+	if (duration.tv_nsec < 0)
+		duration.tv_sec -= 1, duration.tv_nsec += 1000000000L;
+
+	if (strtimespec(sched_s, &(entry->scheduled), entry->clk))  return -1;
+	if (strtimespec(spawn_s, &(entry->spawned), entry->clk))    return -1;
+
+	sprintf(line, "job: %zu clock: %s scheduled: %s started: %s duration: %lli.%09li %s: %i "
+		"utime: %lli.%06li stime: %lli.%06li maxrss: %li argv[0]: ",
+		entry->no, entry->clk == CLOCK_BOOTTIME ? "boottime" : "walltime", sched_s, spawn_s,
+		(long long int)(duration.tv_sec), duration.tv_nsec,
+		WIFSIGNALED(entry->status) ? "signal" : "status",
+		WIFSIGNALED(entry->status) ? WTERMSIG(entry->status) : WEXITSTATUS(entry->status),
+		(long long int)(entry->utime.tv_sec), (long int)(entry->utime.tv_usec),
+		(long long int)(entry->stime.tv_sec), (long int)(entry->stime.tv_usec),
+		entry->maxrss);
+	return print(line, quote(entry->argv0, qbuf), "\n", NULL);
+}
+
+
+/**
+ * Print the history journal, oldest entry first.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+static int
+print_history(void)
+{
+	static const char *segments[] = {"history.old", "history"};
+	struct history entries[64];
+	char *path;
+	size_t i, j, n, off;
+	ssize_t r;
+	int fds[2] = {-1, -1};
+	int saved_errno;
+
+	/* The journal is rotated with the state file locked. */
+	t (lock_state(LOCK_SH));
+	for (i = 0; i < 2; i++) {
+		t (!(path = runtime_path(segments[i])));
+		fds[i] = open(path, O_RDONLY);
+		free(path);
+		t ((fds[i] == -1) && (errno != ENOENT));
+	}
+	t (flock(STATE_FILENO, LOCK_UN));
+
+	for (i = 0; i < 2; i++) {
+		for (off = 0; fds[i] >= 0; off += n * sizeof(*entries)) {
+			t (r = preadn(fds[i], entries, sizeof(entries), off), r < 0);
+			n = (size_t)r / sizeof(*entries);
+			for (j = 0; j < n; j++)
+				t (print_history_entry(entries + j));
+			if (n < sizeof(entries) / sizeof(*entries))
+				break;
+		}
+		close(fds[i]), fds[i] = -1;
+	}
+	return 0;
+fail:
+	S(flock(STATE_FILENO, LOCK_UN), close(fds[0]), close(fds[1]));
+	return -1;
+}
+
+
 /**
  * Print all queued jobs.
  * 
- * @param   argc  Should be 1 or 0.
- * @param   argv  The command line, should only include the name of the process.
+ * @param   argc  Should be 1 or 0, or 2 if the second argument
+ *                is "--watch", "--stats", "--metrics", or "--history".
+ * @param   argv  The command line, should only include the name of the process,
+ *                optionally "-q" and a queue, and optionally "--watch" to follow the queue, "--stats" to
+ *                print statistics rather than the jobs, "--metrics" to
+ *                print the daemon's metrics rather than the jobs, or
+ *                "--history" to print the completed jobs rather the
+ *                queued jobs.
  * @return  0     The process was successful.
  * @return  1     The process failed queuing the job.
  * @return  2     User error, you do not know what you are doing.
@@ -243,17 +842,28 @@ fail:
 int
 main(int argc, char *argv[])
 {
-	struct job **jobs = NULL;
-	struct job **job;
-	PROLOGUE(argc < 2, O_RDONLY);
+	struct job_full **jobs = NULL;
+	struct job_full **job;
+	int follow = 0, stats = 0, metrics = 0, history = 0;
+	PROLOGUE((argc < 2) || ((argc == 2) && ((follow  = !strcmp(argv[1], "--watch")) ||
+	                                        (stats   = !strcmp(argv[1], "--stats")) ||
+	                                        (metrics = !strcmp(argv[1], "--metrics")) ||
+	                                        (history = !strcmp(argv[1], "--history")))), O_RDONLY);
+
+	if (follow)
+		t (watch());
+	if (stats || metrics || history) {
+		t (stats ? print_stats() : metrics ? print_metrics() : print_history());
+		goto done;
+	}
 
 	t (!(jobs = get_jobs()));
 	for (job = jobs; *job; job++)
 		t (print_job(*job));
+	log_trace('l', NULL, (size_t)(job - jobs)); /* Failure isn't fatal. */
 
+done:
 	CLEANUP_START;
-	for (job = jobs; jobs && *job; job++)
-		free(*job);
 	free(jobs);
 	CLEANUP_END;
 }
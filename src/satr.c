@@ -24,7 +24,7 @@
 
 
 COMMAND("satr")
-USAGE("[JOB-ID]...")
+USAGE("[-q QUEUE] [JOB-ID]...")
 
 
 
@@ -32,7 +32,8 @@ USAGE("[JOB-ID]...")
  * Run all queued jobs even if it is not time yet.
  * 
  * @param   argc  Should be 1 or 0.
- * @param   argv  The command line, should only include the name of the process.
+ * @param   argv  The command line, should only include the name of the process,
+ *                optionally "-q" and a queue, and the IDs of the jobs to run.
  * @return  0     The process was successful.
  * @return  1     The process failed queuing the job.
  * @return  2     User error, you do not know what you are doing.
@@ -44,6 +45,7 @@ main(int argc, char *argv[])
 	PROLOGUE(1, O_RDWR);
 	NO_OPTIONS;
 	t (set_hookpath());
+	t (set_queuespath());
 
 	if (argc > 1) {
 		for (argv++; *argv; argv++)
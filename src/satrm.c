@@ -24,7 +24,7 @@
 
 
 COMMAND("satrm")
-USAGE("JOB-ID...")
+USAGE("[-q QUEUE] JOB-ID...")
 
 
 
@@ -33,7 +33,8 @@ USAGE("JOB-ID...")
  * 
  * @param   argc  Should be 2.
  * @param   argv  The command line, should only include the name
- *                of the process and the ID of the job to remove.
+ *                of the process, optionally "-q" and a queue,
+ *                and the ID of the job to remove.
  * @return  0     The process was successful.
  * @return  1     The process failed queuing the job.
  * @return  2     User error, you do not know what you are doing.
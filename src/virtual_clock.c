@@ -0,0 +1,211 @@
+/**
+ * Copyright © 2015, 2016  Mattias Andrée <maandree@member.fsf.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "common.h"
+#include "virtual_clock.h"
+#include <sys/mman.h>
+
+
+
+/**
+ * Atomically read a value in the virtual clock's file.
+ * 
+ * @param   P:int64_t *  The value.
+ * @return  :int64_t     The value.
+ */
+#ifdef __GNUC__
+# define LOAD(P)  __atomic_load_n(P, __ATOMIC_RELAXED)
+#else
+# define LOAD(P)  (*(P))
+#endif
+
+/**
+ * Atomically set a value in the virtual clock's file.
+ * 
+ * @param  P:int64_t *  The value.
+ * @param  V:int64_t    The new value.
+ */
+#ifdef __GNUC__
+# define STORE(P, V)  __atomic_store_n(P, V, __ATOMIC_RELAXED)
+#else
+# define STORE(P, V)  ((void)(*(P) = (V)))
+#endif
+
+
+
+/**
+ * The mapped virtual clock, `NULL` if not mapped yet.
+ */
+static struct virtual_clock *vclock = NULL;
+
+
+
+/**
+ * Add nanoseconds to a time.
+ * 
+ * @param  ts  The time.
+ * @param  ns  The number of nanoseconds, may be negative.
+ */
+static void
+add_ns(struct timespec *ts, int64_t ns)
+{
+	ts->tv_sec  += (time_t)(ns / 1000000000LL);
+	ts->tv_nsec += (long int)(ns % 1000000000LL);
+	if (ts->tv_nsec >= 1000000000L)
+		ts->tv_sec += 1, ts->tv_nsec -= 1000000000L;
+	else if (ts->tv_nsec < 0)
+		ts->tv_sec -= 1, ts->tv_nsec += 1000000000L;
+}
+
+
+/**
+ * Map the virtual clock's file to memory, create it if missing.
+ * 
+ * @return  The virtual clock, `NULL` on error, in which
+ *          case the real time should be used.
+ */
+struct virtual_clock *
+virtual_clock_get(void)
+{
+	struct virtual_clock init = { .offset = 0, .limit = INT64_MAX };
+	char *path = NULL;
+	struct stat attr;
+	void *map;
+	int fd = -1, saved_errno = errno;
+
+	if (vclock)
+		return vclock;
+
+	t (!(path = runtime_path("clock")));
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd >= 0)
+		t (pwriten(fd, &init, sizeof(init), (size_t)0) < (ssize_t)sizeof(init));
+	else
+		t ((errno != EEXIST) || (fd = open(path, O_RDWR), fd == -1));
+	t (fstat(fd, &attr));
+	t (attr.st_size < (off_t)sizeof(*vclock)); /* Being created. */
+	t (map = mmap(NULL, sizeof(*vclock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)0), map == MAP_FAILED);
+	vclock = map;
+fail:
+	close(fd), free(path);
+	errno = saved_errno;
+	return vclock;
+}
+
+
+/**
+ * `clock_gettime`, but for the virtual clock.
+ * 
+ * @param   clk  See clock_gettime(3).
+ * @param   ts   See clock_gettime(3).
+ * @return       See clock_gettime(3).
+ */
+int
+virtual_clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	if ((clock_gettime)(clk, ts))
+		return -1;
+	if (((clk == CLOCK_REALTIME) || (clk == CLOCK_BOOTTIME)) && virtual_clock_get())
+		add_ns(ts, LOAD(&(vclock->offset)));
+	return 0;
+}
+
+
+/**
+ * `timerfd_settime`, but absolute times are measured
+ * in the virtual clock.
+ * 
+ * @param   fd     See timerfd_settime(2).
+ * @param   flags  See timerfd_settime(2).
+ * @param   new    See timerfd_settime(2).
+ * @param   old    See timerfd_settime(2).
+ * @return         See timerfd_settime(2).
+ */
+int
+virtual_timerfd_settime(int fd, int flags, const struct itimerspec *new, struct itimerspec *old)
+{
+	struct itimerspec spec = *new;
+	if ((flags & TFD_TIMER_ABSTIME) && (spec.it_value.tv_sec || spec.it_value.tv_nsec) && virtual_clock_get()) {
+		add_ns(&(spec.it_value), -LOAD(&(vclock->offset)));
+		if ((spec.it_value.tv_sec < 0) || (!spec.it_value.tv_sec && !spec.it_value.tv_nsec))
+			spec.it_value.tv_sec = 0, spec.it_value.tv_nsec = 1; /* Already expired. */
+	}
+	return (timerfd_settime)(fd, flags, &spec, old);
+}
+
+
+/**
+ * Advance the virtual clock to when the first of the daemon's
+ * timers expire, unless that is beyond the limit.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int
+virtual_clock_advance(void)
+{
+	static const int fds[] = {BOOT_FILENO, REAL_FILENO};
+	struct itimerspec specs[2];
+	int64_t step = 0, left[2], offset;
+	size_t i;
+
+	if (!virtual_clock_get())
+		return 0;
+
+	for (i = 0; i < 2; i++) {
+		t (timerfd_gettime(fds[i], specs + i));
+		left[i] = (int64_t)(specs[i].it_value.tv_sec) * 1000000000LL + specs[i].it_value.tv_nsec;
+		if (left[i] && (!step || (left[i] < step)))
+			step = left[i];
+	}
+	offset = LOAD(&(vclock->offset));
+	if (!step || (step > LOAD(&(vclock->limit)) - offset))
+		return 0;
+
+	STORE(&(vclock->offset), offset + step);
+	for (i = 0; i < 2; i++) {
+		if (!left[i])
+			continue;
+		left[i] = left[i] > step ? left[i] - step : 1;
+		specs[i].it_value.tv_sec = 0, specs[i].it_value.tv_nsec = 0;
+		add_ns(&(specs[i].it_value), left[i]);
+		t ((timerfd_settime)(fds[i], 0, specs + i, NULL));
+	}
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Set how far the daemon may advance the virtual clock.
+ * 
+ * @param   ns  The number of nanoseconds, from now, that the daemon may
+ *              advance the virtual clock, 0 to stop it from advancing.
+ * @return      0 on success, -1 on error.
+ */
+int
+virtual_clock_allow(int64_t ns)
+{
+	if (!virtual_clock_get())
+		return -1;
+	STORE(&(vclock->limit), LOAD(&(vclock->offset)) + ns);
+	return 0;
+}
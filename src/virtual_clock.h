@@ -0,0 +1,97 @@
+/**
+ * Copyright © 2015, 2016  Mattias Andrée <maandree@member.fsf.org>
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <time.h>
+
+
+
+/**
+ * A simulated clock, that replaces `CLOCK_REALTIME` and
+ * `CLOCK_BOOTTIME` when compiled with `-DVIRTUAL_CLOCK`.
+ * 
+ * The simulated time is the real time plus an offset, which
+ * the daemon increases when it would otherwise wait for a
+ * timer, so that time advances instantly to the next
+ * expiration. It is stored in a file in the runtime directory
+ * which is mapped to the memory of all processes that use it.
+ */
+struct virtual_clock {
+	/**
+	 * The number of nanoseconds the simulated time
+	 * is ahead of the real time.
+	 */
+	int64_t offset;
+
+	/**
+	 * The daemon will not advance `offset` beyond this value.
+	 * `INT64_MAX` when the file is created.
+	 */
+	int64_t limit;
+};
+
+
+
+/**
+ * Map the virtual clock's file to memory, create it if missing.
+ * 
+ * @return  The virtual clock, `NULL` on error, in which
+ *          case the real time should be used.
+ */
+struct virtual_clock *virtual_clock_get(void);
+
+/**
+ * `clock_gettime`, but for the virtual clock.
+ * 
+ * @param   clk  See clock_gettime(3).
+ * @param   ts   See clock_gettime(3).
+ * @return       See clock_gettime(3).
+ */
+int virtual_clock_gettime(clockid_t clk, struct timespec *ts);
+
+/**
+ * `timerfd_settime`, but absolute times are measured
+ * in the virtual clock.
+ * 
+ * @param   fd     See timerfd_settime(2).
+ * @param   flags  See timerfd_settime(2).
+ * @param   new    See timerfd_settime(2).
+ * @param   old    See timerfd_settime(2).
+ * @return         See timerfd_settime(2).
+ */
+int virtual_timerfd_settime(int fd, int flags, const struct itimerspec *new, struct itimerspec *old);
+
+/**
+ * Advance the virtual clock to when the first of the daemon's
+ * timers expire, unless that is beyond the limit.
+ * 
+ * @return  0 on success, -1 on error.
+ */
+int virtual_clock_advance(void);
+
+/**
+ * Set how far the daemon may advance the virtual clock.
+ * 
+ * @param   ns  The number of nanoseconds, from now, that the daemon may
+ *              advance the virtual clock, 0 to stop it from advancing.
+ * @return      0 on success, -1 on error.
+ */
+int virtual_clock_allow(int64_t ns);